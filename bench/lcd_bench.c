@@ -0,0 +1,418 @@
+/*
+ * lcd_bench.c
+ *
+ * Host benchmark of the LCD library and the LVGL -> tft_flush -> panel path,
+ * run against the in-memory panel emulator. Every case prints one JSON object
+ * per line so results can be stored and compared between releases.
+ *
+ * usage: lcd_bench [-n frames] [-s spi_hz] [-c cmd_hz] [-r] [-o rotation] [-b count:pixels] [-a] [-t te_hz] [case ...]
+ *   -n   frames per case (default 100)
+ *   -s   SPI clock of the emulated bus in Hz
+ *   -c   clock of commands and their parameters in Hz, at most spi_hz
+ *   -r   realtime: block every write for its modelled bus time
+ *   -o   display rotation, 0..3 in steps of 90 degrees
+ *   -b   draw buffers as count:pixels, e.g. 2:76800 for full-frame double buffering
+ *   -a   let the strip size auto-tune (strip_px reports where it settled)
+ *   -t   give the panel a TE line at te_hz, refreshes then wait for its edges
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "lv_conf.h"
+#include "lvgl/lvgl.h"
+#include "tft.h"
+#include "ili9341_user_lib.h"
+#include "ili9341_emu.h"
+
+typedef struct{
+	const char *name;
+	void (*setup)(void);
+	void (*frame)(uint32_t i);
+	void (*teardown)(void);
+}bench_case_t;
+
+static lcd_transport_t *emu;
+static lv_disp_t *disp;
+static lv_obj_t *scene;
+static lv_indev_drv_t drag_drv;
+static lv_point_t drag_point;
+static bool drag_pressed;
+static uint8_t import_src[ILI9341_FB_WIDTH * ILI9341_FB_HEIGHT * 4];
+static uint16_t import_dst[ILI9341_FB_WIDTH * ILI9341_FB_HEIGHT];
+
+static uint64_t now_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*Wait until the display driver has released the buffer it is flushing*/
+static void wait_flush(void)
+{
+	while (disp->driver->draw_buf->flushing)
+	{
+		if (disp->driver->wait_cb)		disp->driver->wait_cb(disp->driver);
+		else							sched_yield();
+	}
+}
+
+/*Call the registered flush_cb directly, the way lv_refr would*/
+static void flush_area(lv_coord_t x1, lv_coord_t y1, lv_coord_t x2, lv_coord_t y2)
+{
+	lv_area_t area = { x1, y1, x2, y2 };
+
+	wait_flush();
+	disp->driver->draw_buf->flushing = 1;
+	disp->driver->draw_buf->flushing_last = 1;
+	disp->driver->flush_cb(disp->driver, &area, disp->driver->draw_buf->buf1);
+	wait_flush();
+}
+
+/*drag_point is in screen coordinates, LVGL expects the touch panel's*/
+static void drag_read(lv_indev_drv_t *drv, lv_indev_data_t *data)
+{
+	lv_coord_t w = disp->driver->hor_res;
+	lv_coord_t h = disp->driver->ver_res;
+
+	(void)drv;
+	switch (disp->driver->rotated)
+	{
+	case LV_DISP_ROT_90:	data->point.x = drag_point.y;			data->point.y = h - 1 - drag_point.x;	break;
+	case LV_DISP_ROT_180:	data->point.x = w - 1 - drag_point.x;	data->point.y = h - 1 - drag_point.y;	break;
+	case LV_DISP_ROT_270:	data->point.x = w - 1 - drag_point.y;	data->point.y = drag_point.x;			break;
+	default:				data->point = drag_point;												break;
+	}
+	data->state = drag_pressed ? LV_INDEV_STATE_PRESSED : LV_INDEV_STATE_RELEASED;
+}
+
+static void render_frame(void)
+{
+	lv_tick_inc(LV_DISP_DEF_REFR_PERIOD);
+	lv_timer_handler();
+	lv_refr_now(disp);
+	wait_flush();
+}
+
+/* Library cases */
+
+static void fill_full(uint32_t i)
+{
+	bsp_lcd_set_background_color((i & 1) ? 0x0000FF : 0xFFFF00);
+}
+
+static void fill_small(uint32_t i)
+{
+	bsp_lcd_fill_rect(0x00FF00 ^ i, (i * 37) % (240 - 32), 32, (i * 53) % (320 - 32), 32);
+}
+
+/*A full-screen camera frame or asset converted to RGB565 and sent*/
+static void import_setup(void)
+{
+	for (size_t i = 0; i < sizeof(import_src); i++)
+	{
+		import_src[i] = (uint8_t)(i * 7 + (i >> 10));
+	}
+}
+
+static void import_frame(uint8_t format, uint32_t flags)
+{
+	uint16_t w = bsp_lcd_get_width();
+	uint16_t h = bsp_lcd_get_height();
+	uint32_t bpp = (format == BSP_LCD_CONV_RGB888) ? 3 : 4;
+	lcd_area_t area = { 0, w - 1, 0, h - 1 };
+
+	bsp_lcd_convert(import_dst, w * 2U, import_src, w * bpp, w, h, format, flags | BSP_LCD_CONV_PANEL);
+	bsp_lcd_write_rect(&area, (const uint8_t *)import_dst, w * 2U);
+}
+
+static void import_rgb888(uint32_t i)
+{
+	(void)i;
+	import_frame(BSP_LCD_CONV_RGB888, BSP_LCD_CONV_DITHER);
+}
+
+static void import_argb8888(uint32_t i)
+{
+	(void)i;
+	import_frame(BSP_LCD_CONV_ARGB8888, 0);
+}
+
+/* tft_flush cases, sized to what one draw buffer holds */
+
+static void flush_strip(uint32_t i)
+{
+	(void)i;
+	flush_area(0, 0, lv_disp_get_hor_res(disp) - 1, disp->driver->draw_buf->size / lv_disp_get_hor_res(disp) - 1);
+}
+
+static void flush_square(uint32_t i)
+{
+	lv_coord_t x = (i * 37) % (lv_disp_get_hor_res(disp) - 64);
+	lv_coord_t y = (i * 53) % (lv_disp_get_ver_res(disp) - 64);
+
+	flush_area(x, y, x + 63, y + 63);
+}
+
+static void flush_row(uint32_t i)
+{
+	lv_coord_t y = i % lv_disp_get_ver_res(disp);
+
+	flush_area(0, y, lv_disp_get_hor_res(disp) - 1, y);
+}
+
+static void flush_clipped(uint32_t i)
+{
+	(void)i;
+	flush_area(-40, -10, 79, 29);
+}
+
+/* LVGL scenes */
+
+static void scene_teardown(void)
+{
+	lv_obj_del(scene);
+	scene = NULL;
+	render_frame();
+}
+
+static void list_setup(void)
+{
+	char txt[16];
+
+	scene = lv_list_create(lv_scr_act());
+	lv_obj_set_size(scene, LV_PCT(100), LV_PCT(100));
+	for (int i = 0; i < 40; i++)
+	{
+		snprintf(txt, sizeof(txt), "Item %d", i);
+		lv_list_add_btn(scene, LV_SYMBOL_FILE, txt);
+	}
+	render_frame();
+}
+
+static void list_frame(uint32_t i)
+{
+	lv_obj_scroll_by(scene, 0, ((i / 100) & 1) ? 6 : -6, LV_ANIM_OFF);
+	render_frame();
+}
+
+/*The same list drawn flat, which the panel can scroll (see tft_set_scroll_offload())*/
+static void list_flat_setup(void)
+{
+	list_setup();
+	lv_obj_set_style_radius(scene, 0, 0);
+	lv_obj_set_style_border_width(scene, 0, 0);
+	render_frame();
+}
+
+static void list_hw_setup(void)
+{
+	list_flat_setup();
+	tft_set_scroll_offload(disp, scene);
+}
+
+/*A finger held on the list, dragging it up and back down 6 px per refresh*/
+static void drag_frame(uint32_t i)
+{
+	uint32_t steps = (lv_disp_get_ver_res(disp) - 80) / 6;
+	uint32_t t = i % (2 * steps);
+
+	drag_pressed = true;
+	drag_point.x = lv_disp_get_hor_res(disp) / 2;
+	drag_point.y = lv_disp_get_ver_res(disp) - 40 - 6 * (t < steps ? t : 2 * steps - t);
+	render_frame();
+}
+
+static void drag_teardown(void)
+{
+	drag_pressed = false;
+	tft_set_scroll_offload(disp, NULL);
+	scene_teardown();
+}
+
+static lv_chart_series_t *chart_ser;
+
+static void chart_setup(void)
+{
+	scene = lv_chart_create(lv_scr_act());
+	lv_obj_set_size(scene, 220, 160);
+	lv_obj_center(scene);
+	lv_chart_set_point_count(scene, 40);
+	chart_ser = lv_chart_add_series(scene, lv_palette_main(LV_PALETTE_RED), LV_CHART_AXIS_PRIMARY_Y);
+	render_frame();
+}
+
+static void chart_frame(uint32_t i)
+{
+	lv_chart_set_next_value(scene, chart_ser, (lv_coord_t)((i * 37) % 100));
+	render_frame();
+}
+
+static void spinner_setup(void)
+{
+	scene = lv_spinner_create(lv_scr_act(), 1000, 60);
+	lv_obj_set_size(scene, 80, 80);
+	lv_obj_center(scene);
+	render_frame();
+}
+
+static void spinner_frame(uint32_t i)
+{
+	(void)i;
+	render_frame();
+}
+
+static lv_obj_t *scr_a;
+static lv_obj_t *scr_b;
+
+static void transition_setup(void)
+{
+	scr_a = lv_scr_act();
+	scr_b = lv_obj_create(NULL);
+	lv_obj_set_style_bg_color(scr_b, lv_palette_main(LV_PALETTE_BLUE), 0);
+	lv_label_set_text(lv_label_create(scr_b), "Screen B");
+	render_frame();
+}
+
+static void transition_frame(uint32_t i)
+{
+	/*A 300 ms slide takes ten refresh periods, then the other way back*/
+	if (i % 10 == 0)
+	{
+		lv_scr_load_anim(((i / 10) & 1) ? scr_a : scr_b, LV_SCR_LOAD_ANIM_MOVE_LEFT, 300, 0, false);
+	}
+	render_frame();
+}
+
+static void transition_teardown(void)
+{
+	lv_scr_load(scr_a);
+	lv_obj_del(scr_b);
+	render_frame();
+}
+
+static const bench_case_t cases[] = {
+	{ "fill_full",			NULL,				fill_full,			NULL },
+	{ "fill_small",			NULL,				fill_small,			NULL },
+	{ "import_rgb888",		import_setup,		import_rgb888,		NULL },
+	{ "import_argb8888",	import_setup,		import_argb8888,	NULL },
+	{ "flush_strip",		NULL,				flush_strip,		NULL },
+	{ "flush_square",		NULL,				flush_square,		NULL },
+	{ "flush_row",			NULL,				flush_row,			NULL },
+	{ "flush_clipped",		NULL,				flush_clipped,		NULL },
+	{ "lvgl_list_scroll",	list_setup,			list_frame,			scene_teardown },
+	{ "lvgl_list_drag",		list_flat_setup,	drag_frame,			drag_teardown },
+	{ "lvgl_list_drag_hw",	list_hw_setup,		drag_frame,			drag_teardown },
+	{ "lvgl_chart",			chart_setup,		chart_frame,		scene_teardown },
+	{ "lvgl_spinner",		spinner_setup,		spinner_frame,		scene_teardown },
+	{ "lvgl_transition",	transition_setup,	transition_frame,	transition_teardown },
+};
+
+static void run_case(const bench_case_t *c, uint32_t frames, const lcd_emu_config_t *cfg)
+{
+	lcd_emu_stats_t st;
+	uint64_t wall, cpu;
+
+	if (c->setup)		c->setup();
+	lcd_emu_reset_stats(emu);
+
+	wall = now_ns(CLOCK_MONOTONIC);
+	cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+	for (uint32_t i = 0; i < frames; i++)
+	{
+		c->frame(i);
+	}
+	cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	wall = now_ns(CLOCK_MONOTONIC) - wall;
+
+	lcd_emu_get_stats(emu, &st);
+	if (c->teardown)	c->teardown();
+
+	printf("{\"case\":\"%s\",\"frames\":%u,\"spi_hz\":%u,\"cmd_hz\":%u,\"te_hz\":%u,\"rotation\":%d,\"buffers\":%u,\"strip_px\":%u,"
+	       "\"fps\":%.1f,\"bus_fps\":%.1f,"
+	       "\"bytes_per_frame\":%.1f,\"syscalls_per_frame\":%.2f,\"transfers_per_frame\":%.2f,"
+	       "\"cpu_us_per_frame\":%.1f,\"bus_us_per_frame\":%.1f}\n",
+	       c->name, frames, cfg->spi_hz, cfg->cmd_hz, cfg->te_hz, lv_disp_get_rotation(disp),
+	       bsp_lcd_get_draw_buffer_count(), (unsigned)disp->driver->draw_buf->size,
+	       frames * 1e9 / (double)wall,
+	       st.busy_ns ? frames * 1e9 / (double)st.busy_ns : 0.0,
+	       (double)st.bytes / frames, (double)st.writes / frames, (double)st.transfers / frames,
+	       cpu / 1e3 / frames, st.busy_ns / 1e3 / frames);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	lcd_emu_config_t cfg = { LCD_EMU_DEFAULT_SPI_HZ, LCD_EMU_DEFAULT_XFER_NS, 0, 0, LCD_EMU_DEFAULT_CMD_HZ };
+	uint32_t frames = 100;
+	int rotation = 0;
+	uint32_t db_count = 0, db_px = 0;
+	int autotune = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:c:ro:b:at:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':	frames = strtoul(optarg, NULL, 0);		break;
+		case 's':	cfg.spi_hz = strtoul(optarg, NULL, 0);	break;
+		case 'c':	cfg.cmd_hz = strtoul(optarg, NULL, 0);	break;
+		case 'r':	cfg.realtime = 1;						break;
+		case 'o':	rotation = atoi(optarg) & 3;			break;
+		case 'b':	sscanf(optarg, "%u:%u", &db_count, &db_px);	break;
+		case 'a':	autotune = 1;							break;
+		case 't':	cfg.te_hz = strtoul(optarg, NULL, 0);	break;
+		default:
+			fprintf(stderr, "usage: %s [-n frames] [-s spi_hz] [-c cmd_hz] [-r] [-o rotation] [-b count:pixels] [-a] [-t te_hz] [case ...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (cfg.cmd_hz > cfg.spi_hz)	cfg.cmd_hz = cfg.spi_hz;
+	emu = lcd_emu_create(&cfg);
+	if (emu == NULL || frames == 0)
+	{
+		return 1;
+	}
+	bsp_lcd_set_transport(emu);
+
+	lv_init();
+	tft_init();
+	disp = lv_disp_get_default();
+	lv_disp_set_rotation(disp, rotation);
+	if (db_count && tft_set_draw_buffers(disp, db_count, db_px) < 0)
+	{
+		fprintf(stderr, "invalid draw buffers %u:%u\n", db_count, db_px);
+		return 1;
+	}
+	tft_set_autotune(disp, autotune);
+
+	lv_indev_drv_init(&drag_drv);
+	drag_drv.type = LV_INDEV_TYPE_POINTER;
+	drag_drv.read_cb = drag_read;
+	lv_indev_drv_register(&drag_drv);
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		int selected = (optind == argc);
+
+		for (int a = optind; a < argc; a++)
+		{
+			selected |= (strcmp(argv[a], cases[i].name) == 0);
+		}
+		if (selected)
+		{
+			run_case(&cases[i], frames, &cfg);
+		}
+	}
+
+	bsp_lcd_deinit();
+	return 0;
+}
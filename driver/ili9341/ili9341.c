@@ -9,14 +9,47 @@
 #include <linux/delay.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/interrupt.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/property.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <ili9341.h>
 
+#define CREATE_TRACE_POINTS
+#include "ili9341_trace.h"
+
 #define DRIVER_AUTHOR                   "quan0412 lehuuquan0412@gmail.com"
 #define DRIVER_DESC                     "ili9341 driver for LCD-TFT"
 #define DRIVER_LICENSE                  "GPL"
 
 #define DEVICE_NAME                     "ili9341"
 #define DEVICE_CLASS                    "ili9341_class"
+#define ILI9341_MAX_DEVICES             8
+
+#define ILI9341_FILL_BUF_SIZE           PAGE_SIZE
+/* Pages of a payload sent in place per round, one frame from any alignment */
+#define ILI9341_ZC_PAGES                (DIV_ROUND_UP(ILI9341_FRAME_SIZE, PAGE_SIZE) + 1)
+/* Transfers per message, a full one is sent and the next one started */
+#define ILI9341_ZC_XFERS                ILI9341_ZC_PAGES
+/* Shorter payloads are copied into the fill buffer, taking page references costs more */
+#define ILI9341_ZC_MIN                  512U
+#define ILI9341_READ_SPEED_HZ           6000000U
+#define ILI9341_CMD_SPEED_HZ            10000000U   /* 100 ns write cycle, override with "cmd-speed-hz" */
+/* spi_sync() latency histogram, bucket n counts calls under 2^n us, the last one the rest */
+#define ILI9341_LAT_BUCKETS             16
 
 #define BSP_LCD_WIDTH  		            240
 #define BSP_LCD_HEIGHT 		            320
@@ -47,6 +80,51 @@ static const struct of_device_id ili9341_dt_ids [] = {
     {}
 };
 
+/*
+ * One class and char device region for every panel. Each SPI device gets a
+ * minor, taken from an "lcdN" alias in the device tree when it has one
+ * so the nodes keep their names, otherwise in probe order.
+ */
+static struct class *ili9341_class;
+static dev_t ili9341_devt;
+static DEFINE_IDA(ili9341_ida);
+/* Bound panels by minor, open() takes its reference under the lock */
+static struct ili9341_device *ili9341_devices[ILI9341_MAX_DEVICES];
+static DEFINE_MUTEX(ili9341_devices_lock);
+
+struct ili9341_file;
+
+/*
+ * Write path counters, shown and cleared through the "stats" file in the
+ * panel's debugfs directory. Only atomics, so the struct can be cleared as
+ * an array of them.
+ */
+struct ili9341_stats
+{
+    atomic64_t writes;
+    atomic64_t cmds;
+    atomic64_t param_bytes;
+    atomic64_t data_bytes;          /* Pixel payloads, repeats expanded */
+    atomic64_t msgs;                /* spi_sync() calls */
+    atomic64_t xfers;
+    atomic64_t wire_bytes;
+    atomic64_t spi_ns;              /* Time inside spi_sync() */
+    atomic64_t copy_bytes;          /* Copied in from writes, user memory or the queue */
+    atomic64_t copy_ns;
+    atomic64_t errors;
+    atomic64_t lat[ILI9341_LAT_BUCKETS];
+};
+
+/* A write queued by an O_NONBLOCK file, executed by the device's workqueue */
+struct ili9341_job
+{
+    struct work_struct work;
+    struct ili9341_device *device;
+    struct ili9341_file *file;
+    uint8_t *buf;                   /* ILI9341_QUEUE_WRITE_MAX bytes of the queue buffer */
+    size_t len;
+};
+
 struct ili9341_device
 {
     struct spi_device *spi;
@@ -54,17 +132,72 @@ struct ili9341_device
     struct gpio_desc *dcx_pin;
     struct gpio_desc *rsx_pin;
     struct cdev cdev;
-    struct class *class;
     dev_t dev;
-}
+    int id;                         /* Minor, /dev/ili9341 for 0 and /dev/ili9341-N after that */
+    struct mutex lock;
+    /* Held by the probe until remove, by every open file and every mapping of fb */
+    struct kref ref;
+    bool gone;                      /* Unbound, set under lock, the SPI device may be gone */
+    u32 cmd_speed_hz;               /* Commands and their parameters, pixels go at max_speed_hz */
+    struct ili9341_stats stats;
+    u64 setup_ns;                   /* The probe's spi_setup(), the only one */
+    struct dentry *debugfs;
+    size_t max_xfer;                /* Longest transfer and message the controller takes, */
+    size_t max_msg;                 /* multiples of 4 so 16 bit words are never split */
+    void *fb;
+    size_t fb_size;
+    uint8_t *fill_buf;              /* DMA-safe, also bounces parameters and short payloads */
+    /* Write path: user pages of a payload and the message sending them, reused by every write */
+    struct page *zc_pages[ILI9341_ZC_PAGES];
+    struct spi_transfer zc_xfers[ILI9341_ZC_XFERS];
+    struct spi_message zc_msg;
+    unsigned int zc_nxfers;
+    size_t zc_len;
+    struct gpio_desc *te_pin;       /* Optional, NULL without a TE line */
+    int te_irq;
+    spinlock_t vsync_lock;
+    uint32_t vsync_seq;             /* TE edges since probe */
+    u64 vsync_ns;                   /* Time of the last one */
+    wait_queue_head_t event_wait;   /* TE edges and completed queued writes */
+    /* Non-blocking writes, jobs are used round robin and complete in order */
+    struct workqueue_struct *wq;
+    struct ili9341_job jobs[ILI9341_QUEUE_DEPTH];
+    uint8_t *queue_mem;
+    struct mutex queue_lock;        /* Serializes submitters */
+    spinlock_t done_lock;
+    uint32_t queued;
+    uint32_t completed;
+};
+
+/* Per open file: the last vsync edge it has read and its queued writes */
+struct ili9341_file
+{
+    struct ili9341_device *device;
+    uint32_t vsync_seq;
+    uint32_t flush_queued;
+    uint32_t flush_done;            /* Updated under done_lock */
+    uint32_t flush_read;
+    u64 flush_ns;
+    int flush_err;
+};
 
 static int          ili9341_open(struct inode *inode, struct file *file);
-static ssize_t      ili9341_write(struct file *file, const char __user *buf, size_t size, loff_t *poss);
+static int          ili9341_release(struct inode *inode, struct file *file);
+static ssize_t      ili9341_read(struct file *file, char __user *buf, size_t count, loff_t *ppos);
+static __poll_t     ili9341_poll(struct file *file, poll_table *wait);
+static ssize_t      ili9341_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static int          ili9341_mmap(struct file *file, struct vm_area_struct *vma);
+static long         ili9341_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = ili9341_open,
-    .write = ili9341_write,
+    .release = ili9341_release,
+    .read = ili9341_read,
+    .poll = ili9341_poll,
+    .write_iter = ili9341_write_iter,
+    .mmap = ili9341_mmap,
+    .unlocked_ioctl = ili9341_ioctl,
 };
 
 static char *my_devnode(struct device *dev, umode_t *mode) {
@@ -74,72 +207,780 @@ static char *my_devnode(struct device *dev, umode_t *mode) {
     return NULL;
 }
 
-static int ili9341_send_data_8b(struct ili9341_device *device, uint8_t *data, uint32_t len)
+static struct dentry *ili9341_debugfs;
+
+static void ili9341_stats_reset(struct ili9341_stats *stats)
 {
-    device->spi->bits_per_word = 8;
-    spi_setup(device->spi);
-    return spi_write(device->spi, data, len);
+	atomic64_t *counter = (atomic64_t *)stats;
+	size_t i;
+
+	for (i = 0; i < sizeof(*stats) / sizeof(*counter); i++)
+	{
+		atomic64_set(&counter[i], 0);
+	}
+}
+
+/* Every message goes out through here to be timed and counted */
+static int ili9341_sync(struct ili9341_device *device, struct spi_message *msg)
+{
+	struct ili9341_stats *stats = &device->stats;
+	struct spi_transfer *xfer;
+	unsigned int nxfers = 0, len = 0;
+	u64 start, ns;
+	int ret;
+
+	list_for_each_entry(xfer, &msg->transfers, transfer_list)
+	{
+		nxfers++;
+		len += xfer->len;
+	}
+
+	start = ktime_get_ns();
+	ret = spi_sync(device->spi, msg);
+	ns = ktime_get_ns() - start;
+
+	atomic64_inc(&stats->msgs);
+	atomic64_add(nxfers, &stats->xfers);
+	atomic64_add(len, &stats->wire_bytes);
+	atomic64_add(ns, &stats->spi_ns);
+	atomic64_inc(&stats->lat[min_t(int, fls64(div_u64(ns, NSEC_PER_USEC)), ILI9341_LAT_BUCKETS - 1)]);
+	if (ret < 0)	atomic64_inc(&stats->errors);
+	trace_ili9341_msg(device->id, nxfers, len, ns, ret);
+	return ret;
+}
+
+/* copy_from_iter() of the write path, timed and counted */
+static bool ili9341_copy_in(struct ili9341_device *device, void *dst, size_t len, struct iov_iter *from)
+{
+	u64 start = ktime_get_ns();
+	size_t got = copy_from_iter(dst, len, from);
+	u64 ns = ktime_get_ns() - start;
+
+	atomic64_add(got, &device->stats.copy_bytes);
+	atomic64_add(ns, &device->stats.copy_ns);
+	trace_ili9341_copy(device->id, got, ns);
+	return got == len;
+}
+
+/*
+ * Every transfer carries its own word size and clock, so the controller is
+ * set up once at probe instead of through spi_setup() whenever they change.
+ */
+static int ili9341_xfer(struct ili9341_device *device, const void *buf, uint32_t len, uint8_t bits, u32 speed_hz)
+{
+	struct spi_transfer xfer = {
+		.tx_buf = buf,
+		.len = len,
+		.bits_per_word = bits,
+		.speed_hz = speed_hz,
+	};
+	struct spi_message msg;
+
+	spi_message_init_with_transfers(&msg, &xfer, 1);
+	return ili9341_sync(device, &msg);
+}
+
+static void ili9341_msg_init(struct ili9341_device *device)
+{
+	spi_message_init(&device->zc_msg);
+	device->zc_nxfers = 0;
+	device->zc_len = 0;
+}
+
+/* Send the message built so far, which leaves an empty one either way */
+static int ili9341_msg_sync(struct ili9341_device *device)
+{
+	int ret = device->zc_nxfers ? ili9341_sync(device, &device->zc_msg) : 0;
+
+	ili9341_msg_init(device);
+	return ret;
+}
+
+/*
+ * Append len bytes of pixel data to the device's message. Data that directly
+ * follows the last transfer extends it, and nothing is made longer than the
+ * controller takes in one transfer or message, so a full frame stays on its
+ * DMA path as one message with CS asserted and DC high throughout. Only when
+ * the message runs out of transfers or bytes is it sent and a new one
+ * started. The data must stay untouched until ili9341_msg_sync().
+ */
+static int ili9341_msg_add(struct ili9341_device *device, const uint8_t *data, size_t len, bool frame_16b)
+{
+	struct spi_transfer *xfer;
+	uint8_t bits = frame_16b ? 16 : 8;
+	size_t room, piece;
+	int ret;
+
+	atomic64_add(len, &device->stats.data_bytes);
+	while (len)
+	{
+		room = device->max_msg - device->zc_len;
+		xfer = device->zc_nxfers ? &device->zc_xfers[device->zc_nxfers - 1] : NULL;
+		if (room && xfer && xfer->bits_per_word == bits && xfer->len < device->max_xfer &&
+		    (const uint8_t *)xfer->tx_buf + xfer->len == data)
+		{
+			piece = min3(len, device->max_xfer - xfer->len, room);
+			xfer->len += piece;
+		}else if (room && device->zc_nxfers < ILI9341_ZC_XFERS)
+		{
+			piece = min3(len, device->max_xfer, room);
+			xfer = &device->zc_xfers[device->zc_nxfers++];
+			memset(xfer, 0, sizeof(*xfer));
+			xfer->tx_buf = data;
+			xfer->len = piece;
+			xfer->bits_per_word = bits;
+			xfer->speed_hz = device->spi->max_speed_hz;
+			spi_message_add_tail(xfer, &device->zc_msg);
+		}else
+		{
+			ret = ili9341_msg_sync(device);
+			if (ret < 0)	return ret;
+			continue;
+		}
+
+		data += piece;
+		len -= piece;
+		device->zc_len += piece;
+	}
+
+	return 0;
 }
 
-static int ili9341_send_data_16b(struct ili9341_device *device, uint8_t *data, uint32_t len)
+/* Command parameters, at the command clock like the command itself */
+static int ili9341_send_params(struct ili9341_device *device, uint8_t *params, uint32_t len)
 {
-	device->spi->bits_per_word = 16;
-	spi_setup(device->spi);
-	uint16_t *data_to_send = (uint16_t *)data;
- 	return spi_write(device->spi, data_to_send, len);
+	atomic64_add(len, &device->stats.param_bytes);
+	return ili9341_xfer(device, params, len, 8, device->cmd_speed_hz);
 }
 
-static void ili9341_send_cmd(struct ili9341_device *device, uint8_t cmd)
+static int ili9341_send_cmd(struct ili9341_device *device, uint8_t cmd)
 {
+    int ret;
+
+    atomic64_inc(&device->stats.cmds);
+    trace_ili9341_cmd(device->id, cmd);
     gpiod_set_value(device->dcx_pin, 0);
-	device->spi->bits_per_word = 8;
-	spi_setup(device->spi);
-    spi_write(device->spi, &cmd, 1);
+    ret = ili9341_xfer(device, &cmd, 1, 8, device->cmd_speed_hz);
     gpiod_set_value(device->dcx_pin, 1);
+    return ret;
+}
+
+static int ili9341_send_data(struct ili9341_device *device, uint8_t *data, uint32_t len, bool frame_16b)
+{
+	int ret = ili9341_msg_add(device, data, len, frame_16b);
+
+	if (ret < 0)	return ret;
+	return ili9341_msg_sync(device);
+}
+
+/*
+ * Send count copies of a pattern of len bytes. The pattern is replicated
+ * into the fill buffer once and that buffer is sent as often as needed.
+ */
+static int ili9341_send_repeat(struct ili9341_device *device, const uint8_t *pattern, uint32_t len, uint32_t count, bool frame_16b)
+{
+	uint64_t remaining = (uint64_t)len * count;
+	size_t chunk, filled;
+	int ret;
+
+	if (!len || len > ILI9341_REPEAT_MAX_PATTERN || (frame_16b && (len & 1)))
+	{
+		return -EINVAL;
+	}
+	/* A count from userspace, bounded so one write cannot hold the bus for minutes */
+	if (remaining > ILI9341_FB_SIZE)	return -EINVAL;
+
+	chunk = (ILI9341_FILL_BUF_SIZE / len) * len;
+	if (chunk > remaining)		chunk = remaining;
+	for (filled = 0; filled < chunk; filled += len)
+	{
+		memcpy(device->fill_buf + filled, pattern, len);
+	}
+
+	/* Every chunk is a transfer of the same buffer, as many per message as fit */
+	while (remaining)
+	{
+		if (chunk > remaining)	chunk = remaining;
+		ret = ili9341_msg_add(device, device->fill_buf, chunk, frame_16b);
+		if (ret < 0)	return ret;
+		remaining -= chunk;
+	}
+
+	return ili9341_msg_sync(device);
+}
+
+/* Copy len bytes of a write into the fill buffer and send them, a page at a time */
+static int ili9341_send_copy(struct ili9341_device *device, struct iov_iter *from, size_t len, bool frame_16b)
+{
+	size_t chunk;
+	int ret;
+
+	while (len)
+	{
+		chunk = min_t(size_t, len, ILI9341_FILL_BUF_SIZE);
+		if (!ili9341_copy_in(device, device->fill_buf, chunk, from))		return -EFAULT;
+		ret = ili9341_send_data(device, device->fill_buf, chunk, frame_16b);
+		if (ret < 0)	return ret;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * Send len bytes of a write straight out of the caller's pages. They are
+ * referenced (not copied) a frame at a time, and each run of pages that is
+ * contiguous in the kernel's mapping becomes one transfer of the device's
+ * message, so the pixel path neither allocates nor copies. Payloads that
+ * are short, or 16 bit data that would be split inside a word at a page
+ * boundary, go through the fill buffer instead.
+ */
+static int ili9341_send_iter(struct ili9341_device *device, struct iov_iter *from, size_t len, bool frame_16b)
+{
+	uint8_t *addr;
+	size_t start, off, left, piece;
+	ssize_t got;
+	int npages, i, ret;
+
+	if (len > iov_iter_count(from))	return -EINVAL;
+	if (len < ILI9341_ZC_MIN)		return ili9341_send_copy(device, from, len, frame_16b);
+
+	/* Queued writes are already in the driver's buffer */
+	if (iov_iter_is_kvec(from))
+	{
+		ret = ili9341_send_data(device, (uint8_t *)from->kvec->iov_base + from->iov_offset, len, frame_16b);
+		if (ret < 0)	return ret;
+		iov_iter_advance(from, len);
+		return 0;
+	}
+
+	while (len)
+	{
+		got = iov_iter_get_pages(from, device->zc_pages, len, ILI9341_ZC_PAGES, &start);
+		if (got <= 0)				return got ? got : -EFAULT;
+		npages = DIV_ROUND_UP(start + got, PAGE_SIZE);
+		if (frame_16b && ((start | got) & 1))
+		{
+			for (i = 0; i < npages; i++)	put_page(device->zc_pages[i]);
+			return ili9341_send_copy(device, from, len, frame_16b);
+		}
+
+		off = start;
+		left = got;
+		ret = 0;
+		for (i = 0; i < npages; i++)
+		{
+			addr = (uint8_t *)kmap(device->zc_pages[i]) + off;
+			piece = min_t(size_t, left, PAGE_SIZE - off);
+			left -= piece;
+			off = 0;
+			if (!ret)	ret = ili9341_msg_add(device, addr, piece, frame_16b);
+		}
+		if (!ret)	ret = ili9341_msg_sync(device);
+
+		for (i = 0; i < npages; i++)
+		{
+			kunmap(device->zc_pages[i]);
+			put_page(device->zc_pages[i]);
+		}
+		if (ret < 0)	return ret;
+
+		iov_iter_advance(from, got);
+		len -= got;
+	}
+
+	return 0;
+}
+
+/*
+ * Execute a packed command stream (see SPI_SEND_STREAM) as it is read from
+ * the write. Every record is validated against the remaining length before
+ * anything is sent for it. Headers, parameters and repeat patterns are
+ * copied, payloads are sent from the caller's memory.
+ */
+static int ili9341_exec_stream(struct ili9341_device *device, struct iov_iter *from)
+{
+	struct ili9341_rec_hdr rec;
+	uint8_t repeat[sizeof(uint32_t) + ILI9341_REPEAT_MAX_PATTERN];
+	size_t params_len, data_len;
+	unsigned int delay_ms = 0;
+	int ret;
+
+	while (iov_iter_count(from) >= sizeof(rec))
+	{
+		if (!ili9341_copy_in(device, &rec, sizeof(rec), from))				return -EFAULT;
+
+		/* Before aligning, a len near 4 GiB wraps to 0 in a 32 bit size_t */
+		if (rec.nparams > ILI9341_REC_MAX_PARAMS || rec.len > ILI9341_REC_MAX_LEN ||
+		    rec.len > iov_iter_count(from))
+		{
+			return -EINVAL;
+		}
+		params_len = ILI9341_REC_ALIGN((size_t)rec.nparams);
+		data_len = ILI9341_REC_ALIGN((size_t)rec.len);
+		if (params_len + data_len > iov_iter_count(from))
+		{
+			return -EINVAL;
+		}
+
+		if (!(rec.flags & ILI9341_REC_NO_CMD))
+		{
+			ret = ili9341_send_cmd(device, rec.cmd);
+			if (ret < 0)	return ret;
+		}
+
+		if (rec.nparams)
+		{
+			if (!ili9341_copy_in(device, device->fill_buf, rec.nparams, from))	return -EFAULT;
+			ret = ili9341_send_params(device, device->fill_buf, rec.nparams);
+			if (ret < 0)	return ret;
+		}
+		iov_iter_advance(from, params_len - rec.nparams);
+
+		if (rec.flags & ILI9341_REC_REPEAT)
+		{
+			uint32_t count;
+
+			if (rec.len < sizeof(count) || rec.len > sizeof(repeat))		return -EINVAL;
+			if (!ili9341_copy_in(device, repeat, rec.len, from))				return -EFAULT;
+			memcpy(&count, repeat, sizeof(count));
+			ret = ili9341_send_repeat(device, repeat + sizeof(count), rec.len - sizeof(count), count,
+						  rec.flags & ILI9341_REC_DATA_16B);
+			if (ret < 0)	return ret;
+		}else if (rec.len)
+		{
+			ret = ili9341_send_iter(device, from, rec.len, rec.flags & ILI9341_REC_DATA_16B);
+			if (ret < 0)	return ret;
+		}
+		iov_iter_advance(from, data_len - rec.len);
+
+		if (rec.delay_ms)
+		{
+			/* Slept with the device locked */
+			delay_ms += rec.delay_ms;
+			if (delay_ms > ILI9341_STREAM_MAX_DELAY_MS)	return -EINVAL;
+			msleep(rec.delay_ms);
+		}
+	}
+
+	return iov_iter_count(from) ? -EINVAL : 0;
+}
+
+/*
+ * Read len bytes of a read command. DCX stays low for the whole exchange and
+ * the data is clocked in slower, the panel's read cycle is 150 ns. RDDID and
+ * RDDST insert one dummy clock before their data, which shifts everything
+ * read after it by one bit.
+ */
+static int ili9341_read_reg(struct ili9341_device *device, uint8_t cmd, uint8_t *data, uint8_t len)
+{
+	uint8_t *buf = device->fill_buf;
+	int dummy = (cmd == ILI9341_READ_DISPLAY_ID || cmd == ILI9341_RDDST);
+	struct spi_transfer xfers[2] = {
+		{ .tx_buf = buf, .len = 1, .bits_per_word = 8, .speed_hz = device->cmd_speed_hz },
+		{ .rx_buf = buf + 8, .len = len + dummy, .bits_per_word = 8,
+		  .speed_hz = min_t(u32, device->cmd_speed_hz, ILI9341_READ_SPEED_HZ) },
+	};
+	struct spi_message msg;
+	int ret, i;
+
+	if (!len || len > 4)	return -EINVAL;
+
+	buf[0] = cmd;
+	gpiod_set_value(device->dcx_pin, 0);
+	spi_message_init_with_transfers(&msg, xfers, ARRAY_SIZE(xfers));
+	ret = ili9341_sync(device, &msg);
+	gpiod_set_value(device->dcx_pin, 1);
+	if (ret < 0)	return ret;
+
+	for (i = 0; i < len; i++)
+	{
+		data[i] = dummy ? (buf[8 + i] << 1) | (buf[9 + i] >> 7) : buf[8 + i];
+	}
+	return 0;
+}
+
+static int ili9341_set_window(struct ili9341_device *device, uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2)
+{
+	uint8_t params[4];
+	int ret;
+
+	params[0] = x1 >> 8;
+	params[1] = x1 & 0xFF;
+	params[2] = x2 >> 8;
+	params[3] = x2 & 0xFF;
+	ret = ili9341_send_cmd(device, ILI9341_CASET);
+	if (ret < 0)	return ret;
+	ret = ili9341_send_params(device, params, 4);
+	if (ret < 0)	return ret;
+
+	params[0] = y1 >> 8;
+	params[1] = y1 & 0xFF;
+	params[2] = y2 >> 8;
+	params[3] = y2 & 0xFF;
+	ret = ili9341_send_cmd(device, ILI9341_RASET);
+	if (ret < 0)	return ret;
+	return ili9341_send_params(device, params, 4);
+}
+
+/*
+ * A window inside panel memory. The orientation (MADCTL) is up to userspace,
+ * so columns and pages may be swapped.
+ */
+static bool ili9341_window_valid(uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2)
+{
+	if (x2 < x1 || y2 < y1)		return false;
+	return (x2 < ILI9341_FB_WIDTH && y2 < ILI9341_FB_HEIGHT) ||
+	       (x2 < ILI9341_FB_HEIGHT && y2 < ILI9341_FB_WIDTH);
+}
+
+/*
+ * Send a rectangle of the shared framebuffer to the panel. Rows go into the
+ * device's message, where rows that are contiguous in the framebuffer join
+ * into controller-sized transfers, many rows per spi_sync().
+ */
+static int ili9341_flush_rect(struct ili9341_device *device, struct ili9341_flush_rect *rect)
+{
+	size_t row_bytes, rows;
+	uint8_t *src;
+	int ret;
+
+	if (!ili9341_window_valid(rect->x1, rect->x2, rect->y1, rect->y2))	return -EINVAL;
+	if (rect->flags & ~ILI9341_REC_DATA_16B)				return -EINVAL;
+
+	row_bytes = ((size_t)rect->x2 - rect->x1 + 1) * 2;
+	rows = (size_t)rect->y2 - rect->y1 + 1;
+	if (rect->stride < row_bytes || rect->stride > device->fb_size)	return -EINVAL;
+	/* In 64 bits, a stride near 4 GiB must not wrap on 32 bit machines */
+	if (rect->offset > device->fb_size ||
+	    (u64)(rows - 1) * rect->stride + row_bytes > device->fb_size - rect->offset)
+	{
+		return -EINVAL;
+	}
+
+	ret = ili9341_set_window(device, rect->x1, rect->x2, rect->y1, rect->y2);
+	if (ret < 0)	return ret;
+	ret = ili9341_send_cmd(device, ILI9341_GRAM);
+	if (ret < 0)	return ret;
+
+	src = (uint8_t *)device->fb + rect->offset;
+	for (; rows; rows--, src += rect->stride)
+	{
+		ret = ili9341_msg_add(device, src, row_bytes, rect->flags & ILI9341_REC_DATA_16B);
+		if (ret < 0)	return ret;
+	}
+
+	return ili9341_msg_sync(device);
+}
+
+/*
+ * Write count copies of a pattern into a window out of the fill buffer (see
+ * ILI9341_IOC_FILL_RECT). Everything is checked before the window is set.
+ */
+static int ili9341_fill_window(struct ili9341_device *device, uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2,
+			       const uint8_t *pattern, uint32_t len, uint32_t count, uint32_t flags)
+{
+	bool frame_16b = flags & ILI9341_REC_DATA_16B;
+	int ret;
+
+	if (!ili9341_window_valid(x1, x2, y1, y2) || (flags & ~ILI9341_REC_DATA_16B))	return -EINVAL;
+	if (!len || len > ILI9341_REPEAT_MAX_PATTERN || (frame_16b && (len & 1)))	return -EINVAL;
+	/* No more than the window holds, RGB565 */
+	if ((u64)len * count > (u64)(x2 - x1 + 1) * (y2 - y1 + 1) * 2)			return -EINVAL;
+
+	ret = ili9341_set_window(device, x1, x2, y1, y2);
+	if (ret < 0)	return ret;
+	ret = ili9341_send_cmd(device, ILI9341_GRAM);
+	if (ret < 0)	return ret;
+	return ili9341_send_repeat(device, pattern, len, count, frame_16b);
+}
+
+/* Last reference gone: no file, mapping or bound SPI device uses the panel */
+static void ili9341_free(struct kref *ref)
+{
+	struct ili9341_device *ili9341 = container_of(ref, struct ili9341_device, ref);
+
+	destroy_workqueue(ili9341->wq);
+	vfree(ili9341->queue_mem);
+	kfree(ili9341->fill_buf);
+	free_pages_exact(ili9341->fb, ili9341->fb_size);
+	kfree(ili9341);
 }
 
 static int ili9341_open(struct inode *inode, struct file *file)
 {
-    struct ili9341_device *ili9341 = container_of(inode->i_cdev, struct ili9341_device, cdev);
-    file->private_data = ili9341;
+    struct ili9341_device *ili9341;
+    struct ili9341_file *priv;
+
+    priv = kmalloc(sizeof(*priv), GFP_KERNEL);
+    if (!priv)				return -ENOMEM;
+
+    mutex_lock(&ili9341_devices_lock);
+    ili9341 = ili9341_devices[iminor(inode)];
+    if (ili9341)			kref_get(&ili9341->ref);
+    mutex_unlock(&ili9341_devices_lock);
+    if (!ili9341)
+    {
+        kfree(priv);
+        return -ENODEV;
+    }
+
+    /* Only edges after the open are reported */
+    priv->device = ili9341;
+    priv->vsync_seq = READ_ONCE(ili9341->vsync_seq);
+    priv->flush_queued = 0;
+    priv->flush_done = 0;
+    priv->flush_read = 0;
+    priv->flush_ns = 0;
+    priv->flush_err = 0;
+    file->private_data = priv;
     return 0;
 }
 
-static ssize_t ili9341_write(struct file *file, const char __user *buf, size_t size, loff_t *poss)
+static int ili9341_release(struct inode *inode, struct file *file)
+{
+	struct ili9341_file *priv = file->private_data;
+	struct ili9341_device *ili9341 = priv->device;
+
+	/* Queued writes still point at the file */
+	if (priv->flush_queued)		flush_workqueue(ili9341->wq);
+	kfree(priv);
+	kref_put(&ili9341->ref, ili9341_free);
+	return 0;
+}
+
+/*
+ * TE goes high when the panel has scanned out the last line of a frame, so
+ * GRAM written from here on is not shown half old, half new.
+ */
+static irqreturn_t ili9341_te_irq(int irq, void *data)
+{
+	struct ili9341_device *ili9341 = data;
+	u64 now = ktime_get_ns();
+
+	spin_lock(&ili9341->vsync_lock);
+	ili9341->vsync_seq++;
+	ili9341->vsync_ns = now;
+	spin_unlock(&ili9341->vsync_lock);
+
+	wake_up_interruptible(&ili9341->event_wait);
+	return IRQ_HANDLED;
+}
+
+static bool ili9341_vsync_pending(struct ili9341_file *priv)
 {
-	struct ili9341_device *ili9341 = file->private_data;
-	uint8_t *kbuf;
-	uint8_t type_data;
+	return READ_ONCE(priv->device->vsync_seq) != priv->vsync_seq;
+}
+
+static bool ili9341_flush_pending(struct ili9341_file *priv)
+{
+	return READ_ONCE(priv->flush_done) != priv->flush_read;
+}
+
+static bool ili9341_queue_full(struct ili9341_device *ili9341)
+{
+	return READ_ONCE(ili9341->queued) - READ_ONCE(ili9341->completed) >= ILI9341_QUEUE_DEPTH;
+}
+
+static bool ili9341_event_pending(struct ili9341_file *priv)
+{
+	return ili9341_flush_pending(priv) || ili9341_vsync_pending(priv) || READ_ONCE(priv->device->gone);
+}
+
+/*
+ * Returns one struct ili9341_event: the file's completed queued writes if
+ * there are new ones, otherwise the newest TE edge it has not read yet,
+ * waiting for either if there is none
+ */
+static ssize_t ili9341_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct ili9341_file *priv = file->private_data;
+	struct ili9341_device *ili9341 = priv->device;
+	struct ili9341_event ev;
+	unsigned long flags;
 	int ret;
 
-	if (size < 2) 			return size;
+	if (count < sizeof(ev))			return -EINVAL;
+	if (READ_ONCE(ili9341->gone))	return -ENODEV;
 
-	if (copy_from_user(&type_data, buf, 1))
+	if (!ili9341_event_pending(priv))
+	{
+		/* Nothing to wait for without TE and with no write in flight */
+		if (!ili9341->te_pin && priv->flush_queued == priv->flush_read)	return -EOPNOTSUPP;
+		if (file->f_flags & O_NONBLOCK)		return -EAGAIN;
+
+		ret = wait_event_interruptible(ili9341->event_wait, ili9341_event_pending(priv));
+		if (ret)					return ret;
+		if (READ_ONCE(ili9341->gone))	return -ENODEV;
+	}
+
+	if (ili9341_flush_pending(priv))
+	{
+		spin_lock(&ili9341->done_lock);
+		ev.type = ILI9341_EVENT_FLUSH_DONE;
+		ev.sequence = priv->flush_done;
+		ev.timestamp_ns = priv->flush_ns;
+		spin_unlock(&ili9341->done_lock);
+		priv->flush_read = ev.sequence;
+	}else
+	{
+		spin_lock_irqsave(&ili9341->vsync_lock, flags);
+		ev.type = ILI9341_EVENT_VSYNC;
+		ev.sequence = ili9341->vsync_seq;
+		ev.timestamp_ns = ili9341->vsync_ns;
+		spin_unlock_irqrestore(&ili9341->vsync_lock, flags);
+		priv->vsync_seq = ev.sequence;
+	}
+
+	if (copy_to_user(buf, &ev, sizeof(ev)))
 	{
 		return -EFAULT;
 	}
+	return sizeof(ev);
+}
 
-	buf += 1;
+static __poll_t ili9341_poll(struct file *file, poll_table *wait)
+{
+	struct ili9341_file *priv = file->private_data;
+	struct ili9341_device *ili9341 = priv->device;
+	__poll_t mask = 0;
 
-	kbuf = kmalloc(size - 1, GFP_KERNEL);
-	if (!kbuf)				return -ENOMEM;
+	poll_wait(file, &ili9341->event_wait, wait);
+	if (READ_ONCE(ili9341->gone))	return EPOLLHUP | EPOLLERR;
 
-	if (copy_from_user(kbuf, buf, size - 1))
+	/* Blocking writes complete before they return */
+	if (!(file->f_flags & O_NONBLOCK) || !ili9341_queue_full(ili9341))
+	{
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+	if (ili9341_event_pending(priv))
+	{
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	return mask;
+}
+
+/* Execute one write, mode byte first, with the device locked */
+static int ili9341_exec_write(struct ili9341_device *ili9341, struct iov_iter *from)
+{
+	uint8_t type_data, cmd;
+	int ret;
+
+	if (!ili9341_copy_in(ili9341, &type_data, 1, from))
 	{
-		kfree(kbuf);
 		return -EFAULT;
 	}
 
-	if ((type_data & 1) == SPI_SEND_CMD)
+	/* Queued writes are executed out of the driver's kvec */
+	atomic64_inc(&ili9341->stats.writes);
+	trace_ili9341_write(ili9341->id, type_data, iov_iter_count(from) + 1, iov_iter_is_kvec(from));
+
+	mutex_lock(&ili9341->lock);
+	if (ili9341->gone)
 	{
-		ret = ili9341_send_cmd(ili9341, *kbuf);
+		ret = -ENODEV;
+	}else if (type_data & SPI_SEND_STREAM)
+	{
+		ret = ili9341_exec_stream(ili9341, from);
+	}else if ((type_data & 1) == SPI_SEND_CMD)
+	{
+		ret = ili9341_copy_in(ili9341, &cmd, 1, from) ? ili9341_send_cmd(ili9341, cmd) : -EFAULT;
 	}else
 	{
-		if (((type_data & FRAME_16_B) >> 1) == 0) 		ret = ili9341_send_data_8b(ili9341, kbuf, size - 1);
-		else ret = ili9341_send_data_16b(ili9341, kbuf, size - 1);
+		ret = ili9341_send_iter(ili9341, from, iov_iter_count(from), type_data & FRAME_16_B);
 	}
+	mutex_unlock(&ili9341->lock);
+
+	return ret;
+}
+
+static void ili9341_job_work(struct work_struct *work)
+{
+	struct ili9341_job *job = container_of(work, struct ili9341_job, work);
+	struct ili9341_device *ili9341 = job->device;
+	struct ili9341_file *priv = job->file;
+	struct kvec kv = { job->buf, job->len };
+	struct iov_iter iter;
+	int ret;
+
+	iov_iter_kvec(&iter, WRITE, &kv, 1, job->len);
+	ret = ili9341_exec_write(ili9341, &iter);
 
-	kfree(kbuf);
+	spin_lock(&ili9341->done_lock);
+	ili9341->completed++;
+	priv->flush_done++;
+	priv->flush_ns = ktime_get_ns();
+	if (ret < 0)	priv->flush_err = ret;
+	spin_unlock(&ili9341->done_lock);
+
+	wake_up_interruptible(&ili9341->event_wait);
+}
+
+/*
+ * O_NONBLOCK: copy the write into the next free queue buffer and let the
+ * workqueue send it, so the caller can render while the bus is busy
+ */
+static ssize_t ili9341_queue_write(struct ili9341_file *priv, struct iov_iter *from)
+{
+	struct ili9341_device *ili9341 = priv->device;
+	size_t size = iov_iter_count(from);
+	struct ili9341_job *job;
+	int err;
+
+	if (size > ILI9341_QUEUE_WRITE_MAX)		return -EMSGSIZE;
+
+	spin_lock(&ili9341->done_lock);
+	err = priv->flush_err;
+	priv->flush_err = 0;
+	spin_unlock(&ili9341->done_lock);
+	if (err)								return err;
+
+	mutex_lock(&ili9341->queue_lock);
+	if (ili9341_queue_full(ili9341))
+	{
+		mutex_unlock(&ili9341->queue_lock);
+		return -EAGAIN;
+	}
+
+	job = &ili9341->jobs[ili9341->queued % ILI9341_QUEUE_DEPTH];
+	if (!ili9341_copy_in(ili9341, job->buf, size, from))
+	{
+		mutex_unlock(&ili9341->queue_lock);
+		return -EFAULT;
+	}
+	job->file = priv;
+	job->len = size;
+	priv->flush_queued++;
+	WRITE_ONCE(ili9341->queued, ili9341->queued + 1);
+	queue_work(ili9341->wq, &job->work);
+	mutex_unlock(&ili9341->queue_lock);
+
+	return size;
+}
+
+/*
+ * The payload is read from the caller's iovecs as it is executed, so
+ * userspace can hand the mode byte and the pixel data over in separate
+ * segments of one writev() and the pixels are never copied. O_NONBLOCK
+ * writes are queued instead, see ILI9341_QUEUE_DEPTH.
+ */
+static ssize_t ili9341_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct ili9341_file *priv = iocb->ki_filp->private_data;
+	size_t size = iov_iter_count(from);
+	int ret;
+
+	if (READ_ONCE(priv->device->gone))	return -ENODEV;
+	if (size < 2) 			return size;
+
+	if (iocb->ki_filp->f_flags & O_NONBLOCK)
+	{
+		return ili9341_queue_write(priv, from);
+	}
+
+	/* Queued writes go out first */
+	flush_workqueue(priv->device->wq);
+	ret = ili9341_exec_write(priv->device, from);
 
 	if (ret < 0){
 		return ret;
@@ -147,6 +988,112 @@ static ssize_t ili9341_write(struct file *file, const char __user *buf, size_t s
 	return size;
 }
 
+/* A mapping keeps fb, so every copy of the vma holds a reference */
+static void ili9341_vm_open(struct vm_area_struct *vma)
+{
+	struct ili9341_device *ili9341 = vma->vm_private_data;
+
+	kref_get(&ili9341->ref);
+}
+
+static void ili9341_vm_close(struct vm_area_struct *vma)
+{
+	struct ili9341_device *ili9341 = vma->vm_private_data;
+
+	kref_put(&ili9341->ref, ili9341_free);
+}
+
+static const struct vm_operations_struct ili9341_vm_ops = {
+	.open = ili9341_vm_open,
+	.close = ili9341_vm_close,
+};
+
+static int ili9341_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ili9341_device *ili9341 = ((struct ili9341_file *)file->private_data)->device;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (READ_ONCE(ili9341->gone))	return -ENODEV;
+	if (vma->vm_pgoff || size > ili9341->fb_size)
+	{
+		return -EINVAL;
+	}
+
+	ret = remap_pfn_range(vma, vma->vm_start, virt_to_phys(ili9341->fb) >> PAGE_SHIFT,
+			      size, vma->vm_page_prot);
+	if (ret)	return ret;
+
+	vma->vm_ops = &ili9341_vm_ops;
+	vma->vm_private_data = ili9341;
+	ili9341_vm_open(vma);
+	return 0;
+}
+
+static long ili9341_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct ili9341_device *ili9341 = ((struct ili9341_file *)file->private_data)->device;
+	struct ili9341_flush_rect rect;
+	struct ili9341_read_reg reg;
+	struct ili9341_fill_rect fill;
+	struct ili9341_pattern_rect pat;
+	int ret;
+
+	switch (cmd)
+	{
+	case ILI9341_IOC_FLUSH_RECT:
+		if (copy_from_user(&rect, (void __user *)arg, sizeof(rect)))
+		{
+			return -EFAULT;
+		}
+		flush_workqueue(ili9341->wq);
+		mutex_lock(&ili9341->lock);
+		ret = ili9341->gone ? -ENODEV : ili9341_flush_rect(ili9341, &rect);
+		mutex_unlock(&ili9341->lock);
+		return ret;
+	case ILI9341_IOC_READ_REG:
+		if (copy_from_user(&reg, (void __user *)arg, sizeof(reg)))
+		{
+			return -EFAULT;
+		}
+		flush_workqueue(ili9341->wq);
+		mutex_lock(&ili9341->lock);
+		ret = ili9341->gone ? -ENODEV : ili9341_read_reg(ili9341, reg.cmd, reg.data, reg.len);
+		mutex_unlock(&ili9341->lock);
+		if (ret < 0)	return ret;
+		if (copy_to_user((void __user *)arg, &reg, sizeof(reg)))
+		{
+			return -EFAULT;
+		}
+		return 0;
+	case ILI9341_IOC_FILL_RECT:
+		if (copy_from_user(&fill, (void __user *)arg, sizeof(fill)))
+		{
+			return -EFAULT;
+		}
+		flush_workqueue(ili9341->wq);
+		mutex_lock(&ili9341->lock);
+		ret = ili9341->gone ? -ENODEV :
+		      ili9341_fill_window(ili9341, fill.x1, fill.x2, fill.y1, fill.y2, (uint8_t *)&fill.color,
+				  sizeof(fill.color), ((uint32_t)fill.x2 - fill.x1 + 1) * ((uint32_t)fill.y2 - fill.y1 + 1),
+				  fill.flags);
+		mutex_unlock(&ili9341->lock);
+		return ret;
+	case ILI9341_IOC_PATTERN_RECT:
+		if (copy_from_user(&pat, (void __user *)arg, sizeof(pat)))
+		{
+			return -EFAULT;
+		}
+		flush_workqueue(ili9341->wq);
+		mutex_lock(&ili9341->lock);
+		ret = ili9341->gone ? -ENODEV :
+		      ili9341_fill_window(ili9341, pat.x1, pat.x2, pat.y1, pat.y2, pat.pattern, pat.len, pat.count, pat.flags);
+		mutex_unlock(&ili9341->lock);
+		return ret;
+	default:
+		return -ENOTTY;
+	}
+}
 
 static void ili9341_reset(struct ili9341_device *device)
 {
@@ -156,125 +1103,31 @@ static void ili9341_reset(struct ili9341_device *device)
     udelay(5);
 }
 
-static void ili9341_init(struct ili9341_device *device)
-{
-    uint8_t params[15];
-	ili9341_send_cmd(device->spi, ILI9341_SWRESET);
-	ili9341_send_cmd(device->spi, ILI9341_POWERB);
-	params[0] = 0x00;
-	params[1] = 0xD9;
-	params[2] = 0x30;
-	ili9341_send_data_8b(device->spi, params, 3);
-
-	ili9341_send_cmd(device->spi, ILI9341_POWER_SEQ);
-	params[0]= 0x64;
-	params[1]= 0x03;
-	params[2]= 0X12;
-	params[3]= 0X81;
-	ili9341_send_data_8b(device->spi, params, 4);
-
-	ili9341_send_cmd(device->spi, ILI9341_DTCA);
-	params[0]= 0x85;
-	params[1]= 0x10;
-	params[2]= 0x7A;
-	ili9341_send_data_8b(device->spi, params, 3);
-
-	ili9341_send_cmd(device->spi, ILI9341_POWERA);
-	params[0]= 0x39;
-	params[1]= 0x2C;
-	params[2]= 0x00;
-	params[3]= 0x34;
-	params[4]= 0x02;
-	ili9341_send_data_8b(device->spi, params, 5);
-
-	ili9341_send_cmd(device->spi, ILI9341_PRC);
-	params[0]= 0x20;
-	ili9341_send_data_8b(device->spi, params, 1);
-
-	ili9341_send_cmd(device->spi, ILI9341_DTCB);
-	params[0]= 0x00;
-	params[1]= 0x00;
-	ili9341_send_data_8b(device->spi, params, 2);
-
-	ili9341_send_cmd(device->spi, ILI9341_POWER1);
-	params[0]= 0x1B;
-	ili9341_send_data_8b(device->spi, params, 1);
-
-	ili9341_send_cmd(device->spi, ILI9341_POWER2);
-	params[0]= 0x12;
-	ili9341_send_data_8b(device->spi, params, 1);
-
-	ili9341_send_cmd(device->spi, ILI9341_VCOM1);
-	params[0]= 0x08;
-	params[1]= 0x26;
-	ili9341_send_data_8b(device->spi, params, 2);
-
-	ili9341_send_cmd(device->spi, ILI9341_VCOM2);
-	params[0]= 0XB7;
-	ili9341_send_data_8b(device->spi, params, 1);
-
-
-	ili9341_send_cmd(device->spi, ILI9341_PIXEL_FORMAT);
-	params[0]= 0x55; //select RGB565
-	ili9341_send_data_8b(device->spi, params, 1);
-
-	ili9341_send_cmd(device->spi, ILI9341_FRMCTR1);
-	params[0]= 0x00;
-	params[1]= 0x1B;//frame rate = 70
-	ili9341_send_data_8b(device->spi, params, 2);
-
-	ili9341_send_cmd(device->spi, ILI9341_DFC);    // Display Function Control
-	params[0]= 0x0A;
-	params[1]= 0xA2;
-	ili9341_send_data_8b(device->spi, params, 2);
-
-	ili9341_send_cmd(device->spi, ILI9341_3GAMMA_EN);    // 3Gamma Function Disable
-	params[0]= 0x02; //LCD_WR_DATA(0x00);
-	ili9341_send_data_8b(device->spi, params, 1);
-
-	ili9341_send_cmd(device->spi, ILI9341_GAMMA);
-	params[0]= 0x01;
-	ili9341_send_data_8b(device->spi, params, 1);
-
-	ili9341_send_cmd(device->spi, ILI9341_PGAMMA);    //Set Gamma
-	params[0]= 0x0F;
-	params[1]= 0x1D;
-	params[2]= 0x1A;
-	params[3]= 0x0A;
-	params[4]= 0x0D;
-	params[5]= 0x07;
-	params[6]= 0x49;
-	params[7]= 0X66;
-	params[8]= 0x3B;
-	params[9]= 0x07;
-	params[10]= 0x11;
-	params[11]= 0x01;
-	params[12]= 0x09;
-	params[13]= 0x05;
-	params[14]= 0x04;
-	ili9341_send_data_8b(device->spi, params, 15);
-
-	ili9341_send_cmd(device->spi, ILI9341_NGAMMA);
-	params[0]= 0x00;
-	params[1]= 0x18;
-	params[2]= 0x1D;
-	params[3]= 0x02;
-	params[4]= 0x0F;
-	params[5]= 0x04;
-	params[6]= 0x36;
-	params[7]= 0x13;
-	params[8]= 0x4C;
-	params[9]= 0x07;
-	params[10]= 0x13;
-	params[11]= 0x0F;
-	params[12]= 0x2E;
-	params[13]= 0x2F;
-	params[14]= 0x05;
-	ili9341_send_data_8b(device->spi, params, 15);
-
-	ili9341_send_cmd(device->spi, ILI9341_SLEEP_OUT); //Exit Sleep
-	udelay(10);
-	ili9341_send_cmd(device->spi, ILI9341_DISPLAY_ON); //display on
+static const struct ili9341_init_cmd ili9341_init_seq[] = ILI9341_INIT_SEQ;
+
+/* Same table the user library sends, parameters go out of the DMA-safe fill buffer */
+static int ili9341_init(struct ili9341_device *device)
+{
+	const struct ili9341_init_cmd *seq;
+	int ret;
+
+	for (seq = ili9341_init_seq; seq < ili9341_init_seq + ARRAY_SIZE(ili9341_init_seq); seq++)
+	{
+		ret = ili9341_send_cmd(device, seq->cmd);
+		if (ret < 0)	return ret;
+		if (seq->nparams)
+		{
+			memcpy(device->fill_buf, seq->params, seq->nparams);
+			ret = ili9341_send_params(device, device->fill_buf, seq->nparams);
+			if (ret < 0)	return ret;
+		}
+		if (seq->delay_ms)
+		{
+			msleep(seq->delay_ms);
+		}
+	}
+
+	return 0;
 }
 
 void ili9341_set_orientation(struct ili9341_device *device, uint8_t orientation)
@@ -287,8 +1140,8 @@ void ili9341_set_orientation(struct ili9341_device *device, uint8_t orientation)
 		param = MADCTL_MY| MADCTL_MX| MADCTL_BGR;  /* Memory Access Control <portrait setting> */
 	}
 
-	ili9341_send_cmd(device->spi, ILI9341_MAC);    // Memory Access Control command
-	ili9341_send_data_8b(device->spi, &param, 1);
+	ili9341_send_cmd(device, ILI9341_MAC);    // Memory Access Control command
+	ili9341_send_params(device, &param, 1);
 }
 
 void ili9341_set_display_area(struct ili9341_device *device)
@@ -299,28 +1152,112 @@ void ili9341_set_display_area(struct ili9341_device *device)
 	params[1] = (0 >> 0) & 0xFF;
 	params[2] = (BSP_LCD_ACTIVE_WIDTH >> 8) & 0xFF;
 	params[3] = (BSP_LCD_ACTIVE_WIDTH >> 0) & 0xFF;
-	ili9341_send_cmd(device->spi, ILI9341_CASET);
-	ili9341_send_data_8b(device->spi, params, 4);
+	ili9341_send_cmd(device, ILI9341_CASET);
+	ili9341_send_params(device, params, 4);
 
 	params[2] = (BSP_LCD_ACTIVE_HEIGHT >> 8) & 0xFF;
 	params[3] = (BSP_LCD_ACTIVE_HEIGHT >> 0) & 0xFF;
 
-	ili9341_send_cmd(device->spi, ILI9341_RASET);
-	ili9341_send_data_8b(device->spi, params, 4);
+	ili9341_send_cmd(device, ILI9341_RASET);
+	ili9341_send_params(device, params, 4);
 }	
 
+/*
+ * The panel is still set up from before, e.g. the module was reloaded: it is
+ * awake and shows 16 bit pixels in normal mode. Without a MISO line reads
+ * return 0x00 or 0xFF and the panel is always initialized.
+ */
+static bool ili9341_is_configured(struct ili9341_device *device)
+{
+	uint8_t dpm, dst[4];
+
+	if (ili9341_read_reg(device, ILI9341_RDDPM, &dpm, 1) < 0 ||
+	    ili9341_read_reg(device, ILI9341_RDDST, dst, 4) < 0)
+	{
+		return false;
+	}
+
+	return dpm != 0xFF && (dpm & ILI9341_DPM_READY) == ILI9341_DPM_READY &&
+	       ILI9341_DST_PIXFMT(dst) == 0x05 && !(dst[1] & ILI9341_DST_IDLE);
+}
+
 void ili9341_configure(struct ili9341_device *device)
 {
-	ili9341_reset(device);
-	ili9341_init(device);
+	if (!ili9341_is_configured(device))
+	{
+		ili9341_reset(device);
+		if (ili9341_init(device) < 0)
+		{
+			pr_err("Failed to initialize panel\n");
+		}
+	}
 	ili9341_set_display_area(device);
-	ili9341_set_orientation(device);
+	ili9341_set_orientation(device, BSP_LCD_ORIENTATION);
 }
 
 
+/*
+ * debugfs ili9341/<spi device>/stats. The achieved rate is bytes on the wire
+ * over time inside spi_sync(), next to what the clock alone would allow.
+ */
+static int ili9341_stats_show(struct seq_file *s, void *unused)
+{
+	struct ili9341_device *device = s->private;
+	struct ili9341_stats *stats = &device->stats;
+	u64 wire_bytes = atomic64_read(&stats->wire_bytes);
+	u64 spi_us = div_u64(atomic64_read(&stats->spi_ns), NSEC_PER_USEC);
+	int i;
+
+	seq_printf(s, "writes:           %lld\n", atomic64_read(&stats->writes));
+	seq_printf(s, "cmds:             %lld\n", atomic64_read(&stats->cmds));
+	seq_printf(s, "param_bytes:      %lld\n", atomic64_read(&stats->param_bytes));
+	seq_printf(s, "data_bytes:       %lld\n", atomic64_read(&stats->data_bytes));
+	seq_printf(s, "msgs:             %lld\n", atomic64_read(&stats->msgs));
+	seq_printf(s, "xfers:            %lld\n", atomic64_read(&stats->xfers));
+	seq_printf(s, "wire_bytes:       %llu\n", wire_bytes);
+	seq_printf(s, "errors:           %lld\n", atomic64_read(&stats->errors));
+	seq_printf(s, "spi_us:           %llu\n", spi_us);
+	seq_printf(s, "bytes_per_sec:    %llu\n", spi_us ? div64_u64(wire_bytes * USEC_PER_SEC, spi_us) : 0);
+	seq_printf(s, "clock_bytes_per_sec: %u\n", device->spi->max_speed_hz / 8);
+	seq_printf(s, "copy_bytes:       %lld\n", atomic64_read(&stats->copy_bytes));
+	seq_printf(s, "copy_us:          %llu\n", div_u64(atomic64_read(&stats->copy_ns), NSEC_PER_USEC));
+	seq_printf(s, "setup_us:         %llu\n", div_u64(device->setup_ns, NSEC_PER_USEC));
+	seq_puts(s, "msg_latency_us:\n");
+	for (i = 0; i < ILI9341_LAT_BUCKETS - 1; i++)
+	{
+		seq_printf(s, "  <%-8u %lld\n", 1U << i, atomic64_read(&stats->lat[i]));
+	}
+	seq_printf(s, "  >=%-7u %lld\n", 1U << (i - 1), atomic64_read(&stats->lat[i]));
+	return 0;
+}
+
+static int ili9341_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ili9341_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters */
+static ssize_t ili9341_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct ili9341_device *device = ((struct seq_file *)file->private_data)->private;
+
+	ili9341_stats_reset(&device->stats);
+	return count;
+}
+
+static const struct file_operations ili9341_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ili9341_stats_open,
+	.read = seq_read,
+	.write = ili9341_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int ili9341_pdrv_probe(struct spi_device *device)
 {
 	struct ili9341_device *ili9341;
+	u64 start;
 	int ret;
 
 	ili9341 = kmalloc(sizeof(*ili9341), GFP_KERNEL);
@@ -328,26 +1265,123 @@ static int ili9341_pdrv_probe(struct spi_device *device)
 	if (!ili9341)
 	{
 		pr_err("kmalloc failed\n");
-		return -1;
+		return -ENOMEM;
 	}
 
 	ili9341->spi = device;
-	spi_setup(device);
+	ili9341->id = -1;
+	mutex_init(&ili9341->lock);
+	kref_init(&ili9341->ref);
+	ili9341->gone = false;
+	ili9341_stats_reset(&ili9341->stats);
+
+	/* The only spi_setup(), transfers bring their own word size and clock */
+	device->bits_per_word = 8;
+	start = ktime_get_ns();
+	ret = spi_setup(device);
+	ili9341->setup_ns = ktime_get_ns() - start;
+	if (ret < 0)
+	{
+		pr_err("Failed to set up SPI\n");
+		goto err_free;
+	}
+	ili9341->cmd_speed_hz = ILI9341_CMD_SPEED_HZ;
+	device_property_read_u32(&device->dev, "cmd-speed-hz", &ili9341->cmd_speed_hz);
+	if (device->max_speed_hz)
+	{
+		ili9341->cmd_speed_hz = min(ili9341->cmd_speed_hz, device->max_speed_hz);
+	}
+
+	/* Controllers that cannot take a whole frame at once get it in pieces they can */
+	ili9341->max_xfer = max_t(size_t, spi_max_transfer_size(device) & ~(size_t)3, 4);
+	ili9341->max_msg = max_t(size_t, spi_max_message_size(device) & ~(size_t)3, ili9341->max_xfer);
+	ili9341_msg_init(ili9341);
+
+	/* Lowmem pages, so the SPI core can DMA-map transfers out of them */
+	ili9341->fb_size = PAGE_ALIGN(ILI9341_FB_SIZE);
+	ili9341->fb = alloc_pages_exact(ili9341->fb_size, GFP_KERNEL | __GFP_ZERO);
+	if (!ili9341->fb)
+	{
+		pr_err("Failed to allocate framebuffer\n");
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	ili9341->fill_buf = kmalloc(ILI9341_FILL_BUF_SIZE, GFP_KERNEL);
+	if (!ili9341->fill_buf)
+	{
+		pr_err("Failed to allocate fill buffer\n");
+		ret = -ENOMEM;
+		goto err_fb;
+	}
+
+	/* Queue of O_NONBLOCK writes, the SPI core maps vmalloc memory page by page */
+	mutex_init(&ili9341->queue_lock);
+	spin_lock_init(&ili9341->done_lock);
+	ili9341->queued = 0;
+	ili9341->completed = 0;
+	ili9341->queue_mem = vmalloc(ILI9341_QUEUE_DEPTH * ILI9341_QUEUE_WRITE_MAX);
+	ili9341->wq = alloc_ordered_workqueue("ili9341/%s", 0, dev_name(&device->dev));
+	if (!ili9341->queue_mem || !ili9341->wq)
+	{
+		pr_err("Failed to allocate write queue\n");
+		ret = -ENOMEM;
+		goto err_queue;
+	}
+	for (ret = 0; ret < ILI9341_QUEUE_DEPTH; ret++)
+	{
+		INIT_WORK(&ili9341->jobs[ret].work, ili9341_job_work);
+		ili9341->jobs[ret].device = ili9341;
+		ili9341->jobs[ret].buf = ili9341->queue_mem + ret * ILI9341_QUEUE_WRITE_MAX;
+	}
 
 	ili9341->dcx_pin = gpiod_get(&device->dev, "dcx", GPIOD_OUT_LOW);
+	if (IS_ERR(ili9341->dcx_pin))
+	{
+		pr_err("Failed to get DCX gpio\n");
+		ret = PTR_ERR(ili9341->dcx_pin);
+		goto err_queue;
+	}
 	gpiod_set_value(ili9341->dcx_pin, 1);
 
 	ili9341->rsx_pin = gpiod_get(&device->dev, "rsx", GPIOD_OUT_LOW);
+	if (IS_ERR(ili9341->rsx_pin))
+	{
+		pr_err("Failed to get RSX gpio\n");
+		ret = PTR_ERR(ili9341->rsx_pin);
+		goto err_dcx;
+	}
 	gpiod_set_value(ili9341->rsx_pin, 1);
 
+	spin_lock_init(&ili9341->vsync_lock);
+	init_waitqueue_head(&ili9341->event_wait);
+	ili9341->vsync_seq = 0;
+	ili9341->vsync_ns = 0;
+	ili9341->te_pin = gpiod_get_optional(&device->dev, "te", GPIOD_IN);
+	if (IS_ERR(ili9341->te_pin))
+	{
+		pr_err("Failed to get TE gpio, vsync events disabled\n");
+		ili9341->te_pin = NULL;
+	}
+
 	ili9341_configure(ili9341);
 
-	ret = alloc_chrdev_region(&ili9341->dev, 0, 1, DEVICE_NAME);
+	ret = of_alias_get_id(device->dev.of_node, "lcd");
+	if (ret >= 0 && ret < ILI9341_MAX_DEVICES)
+	{
+		ret = ida_alloc_range(&ili9341_ida, ret, ret, GFP_KERNEL);
+	}else
+	{
+		ret = ida_alloc_max(&ili9341_ida, ILI9341_MAX_DEVICES - 1, GFP_KERNEL);
+	}
 	if (ret < 0)
 	{
-		pr_err("Failed to allocate character device region\n");
-        return ret;
+		pr_err("No free minor for %s\n", dev_name(&device->dev));
+		goto err_gpio;
 	}
+	ili9341->id = ret;
+	ili9341->dev = MKDEV(MAJOR(ili9341_devt), ili9341->id);
+	spi_set_drvdata(device, ili9341);
 
 	cdev_init(&ili9341->cdev, &fops);
 	ili9341->cdev.owner = THIS_MODULE;
@@ -356,36 +1390,95 @@ static int ili9341_pdrv_probe(struct spi_device *device)
 	if (ret)
 	{
 		pr_err("Failed to add character device\n");
-		unregister_chrdev_region(ili9341->dev, 1);
-		return ret;
+		goto err_ida;
 	}
 
-	ili9341->class = class_create(THIS_MODULE, DEVICE_CLASS);
-	if (IS_ERR(ili9341->class))
+	/* The first panel keeps the name the user library opens by default */
+	if (ili9341->id == 0)
 	{
-		pr_err("Failed to create class\n");
-		cdev_del(&ili9341->cdev);
-		unregister_chrdev_region(&ili9341->dev, 1);
-		return PTR_ERR(ili9341->class);
+		ili9341->spi_device_t = device_create(ili9341_class, &device->dev, ili9341->dev, ili9341, DEVICE_NAME);
+	}else
+	{
+		ili9341->spi_device_t = device_create(ili9341_class, &device->dev, ili9341->dev, ili9341,
+						      DEVICE_NAME "-%d", ili9341->id);
+	}
+	if (IS_ERR(ili9341->spi_device_t))
+	{
+		pr_err("Failed to create device node\n");
+		ret = PTR_ERR(ili9341->spi_device_t);
+		goto err_cdev;
 	}
 
-	ili9341->class->devnode = my_devnode;
-	ili9341->spi_device_t = device_create(ili9341->class, NULL, ili9341->dev, NULL, DEVICE_NAME);
+	ili9341->debugfs = debugfs_create_dir(dev_name(&device->dev), ili9341_debugfs);
+	debugfs_create_file("stats", 0644, ili9341->debugfs, ili9341, &ili9341_stats_fops);
 
-	spi_set_drvdata(device, ili9341);
+	/* Last, nothing after it can fail and take the handler away again */
+	if (ili9341->te_pin)
+	{
+		ili9341->te_irq = gpiod_to_irq(ili9341->te_pin);
+		ret = (ili9341->te_irq < 0) ? ili9341->te_irq :
+			request_irq(ili9341->te_irq, ili9341_te_irq, IRQF_TRIGGER_RISING, dev_name(&device->dev), ili9341);
+		if (ret)
+		{
+			pr_err("Failed to request TE interrupt, vsync events disabled\n");
+			gpiod_put(ili9341->te_pin);
+			ili9341->te_pin = NULL;
+		}
+	}
+
+	mutex_lock(&ili9341_devices_lock);
+	ili9341_devices[ili9341->id] = ili9341;
+	mutex_unlock(&ili9341_devices_lock);
 
 	pr_info("Success !!!\n");
 	return 0;
+
+err_cdev:
+	cdev_del(&ili9341->cdev);
+err_ida:
+	ida_free(&ili9341_ida, ili9341->id);
+err_gpio:
+	if (ili9341->te_pin)	gpiod_put(ili9341->te_pin);
+	gpiod_put(ili9341->rsx_pin);
+err_dcx:
+	gpiod_put(ili9341->dcx_pin);
+err_queue:
+	if (ili9341->wq)		destroy_workqueue(ili9341->wq);
+	vfree(ili9341->queue_mem);
+	kfree(ili9341->fill_buf);
+err_fb:
+	free_pages_exact(ili9341->fb, ili9341->fb_size);
+err_free:
+	kfree(ili9341);
+	return ret;
 }
 
 static int ili9341_pdrv_remove(struct spi_device *device)
 {
 	struct ili9341_device *ili9341 = spi_get_drvdata(device);
 
-	device_destroy(ili9341->class, ili9341->dev);
-	class_destroy(ili9341->class);
+	/* No new opens, files and mappings still open keep the memory */
+	mutex_lock(&ili9341_devices_lock);
+	ili9341_devices[ili9341->id] = NULL;
+	mutex_unlock(&ili9341_devices_lock);
+
+	debugfs_remove_recursive(ili9341->debugfs);
+	device_destroy(ili9341_class, ili9341->dev);
 	cdev_del(&ili9341->cdev);
-	unregister_chrdev_region(ili9341->dev, 1);
+	ida_free(&ili9341_ida, ili9341->id);
+
+	/* Writes and ioctls from here on fail, queued ones drain without touching the bus */
+	mutex_lock(&ili9341->lock);
+	ili9341->gone = true;
+	mutex_unlock(&ili9341->lock);
+	flush_workqueue(ili9341->wq);
+	wake_up_interruptible(&ili9341->event_wait);
+
+	if (ili9341->te_pin)
+	{
+		free_irq(ili9341->te_irq, ili9341);
+		gpiod_put(ili9341->te_pin);
+	}
 
 	gpiod_set_value(ili9341->dcx_pin, 0);
 	gpiod_set_value(ili9341->rsx_pin, 0);
@@ -393,6 +1486,8 @@ static int ili9341_pdrv_remove(struct spi_device *device)
 	gpiod_put(ili9341->dcx_pin);
 	gpiod_put(ili9341->rsx_pin);
 
+	kref_put(&ili9341->ref, ili9341_free);
+
 	pr_info("Goodbye @@@\n");
 	return 0;
 }
@@ -409,7 +1504,48 @@ static struct spi_driver ili9341_spi_driver = {
 	},
 };
 
-module_spi_driver(ili9341_spi_driver);
+static int __init ili9341_module_init(void)
+{
+	int ret;
+
+	ret = alloc_chrdev_region(&ili9341_devt, 0, ILI9341_MAX_DEVICES, DEVICE_NAME);
+	if (ret < 0)
+	{
+		pr_err("Failed to allocate character device region\n");
+		return ret;
+	}
+
+	ili9341_class = class_create(THIS_MODULE, DEVICE_CLASS);
+	if (IS_ERR(ili9341_class))
+	{
+		pr_err("Failed to create class\n");
+		unregister_chrdev_region(ili9341_devt, ILI9341_MAX_DEVICES);
+		return PTR_ERR(ili9341_class);
+	}
+	ili9341_class->devnode = my_devnode;
+	ili9341_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+
+	ret = spi_register_driver(&ili9341_spi_driver);
+	if (ret < 0)
+	{
+		debugfs_remove_recursive(ili9341_debugfs);
+		class_destroy(ili9341_class);
+		unregister_chrdev_region(ili9341_devt, ILI9341_MAX_DEVICES);
+	}
+	return ret;
+}
+
+static void __exit ili9341_module_exit(void)
+{
+	spi_unregister_driver(&ili9341_spi_driver);
+	debugfs_remove_recursive(ili9341_debugfs);
+	class_destroy(ili9341_class);
+	unregister_chrdev_region(ili9341_devt, ILI9341_MAX_DEVICES);
+	ida_destroy(&ili9341_ida);
+}
+
+module_init(ili9341_module_init);
+module_exit(ili9341_module_exit);
 
 MODULE_AUTHOR(DRIVER_AUTHOR);
 MODULE_DESCRIPTION(DRIVER_DESC);
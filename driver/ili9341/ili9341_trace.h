@@ -0,0 +1,116 @@
+/*
+ * ili9341_trace.h
+ *
+ * Tracepoints of the write path, enable with
+ *   echo 1 > /sys/kernel/tracing/events/ili9341/enable
+ * Built with the driver's directory on the include path, as for <ili9341.h>.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ili9341
+
+#if !defined(_ILI9341_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ILI9341_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* One write() or queued write as it starts to execute */
+TRACE_EVENT(ili9341_write,
+
+	TP_PROTO(int id, uint8_t mode, size_t len, bool queued),
+
+	TP_ARGS(id, mode, len, queued),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(uint8_t, mode)
+		__field(size_t, len)
+		__field(bool, queued)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->mode = mode;
+		__entry->len = len;
+		__entry->queued = queued;
+	),
+
+	TP_printk("lcd%d mode=0x%02x len=%zu%s", __entry->id, __entry->mode,
+		  __entry->len, __entry->queued ? " queued" : "")
+);
+
+TRACE_EVENT(ili9341_cmd,
+
+	TP_PROTO(int id, uint8_t cmd),
+
+	TP_ARGS(id, cmd),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(uint8_t, cmd)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->cmd = cmd;
+	),
+
+	TP_printk("lcd%d cmd=0x%02x", __entry->id, __entry->cmd)
+);
+
+/* One spi_sync(): its transfers, bytes on the wire and how long it took */
+TRACE_EVENT(ili9341_msg,
+
+	TP_PROTO(int id, unsigned int nxfers, unsigned int len, u64 ns, int ret),
+
+	TP_ARGS(id, nxfers, len, ns, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(unsigned int, nxfers)
+		__field(unsigned int, len)
+		__field(u64, ns)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->nxfers = nxfers;
+		__entry->len = len;
+		__entry->ns = ns;
+		__entry->ret = ret;
+	),
+
+	TP_printk("lcd%d xfers=%u len=%u ns=%llu ret=%d", __entry->id, __entry->nxfers,
+		  __entry->len, __entry->ns, __entry->ret)
+);
+
+/* Bytes copied in from user memory and the time it took */
+TRACE_EVENT(ili9341_copy,
+
+	TP_PROTO(int id, size_t len, u64 ns),
+
+	TP_ARGS(id, len, ns),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(size_t, len)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->len = len;
+		__entry->ns = ns;
+	),
+
+	TP_printk("lcd%d len=%zu ns=%llu", __entry->id, __entry->len, __entry->ns)
+);
+
+#endif /* _ILI9341_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ili9341_trace
+#include <trace/define_trace.h>
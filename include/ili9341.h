@@ -26,6 +26,13 @@
 #endif
 
 /* Includes ------------------------------------------------------------------*/
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#else
+#include <stdint.h>
+#include <sys/ioctl.h>
+#endif
 
 /**
   * @brief  ILI9341 Registers
@@ -133,6 +140,200 @@
 #define FRAME_8_B                       0
 #define FRAME_16_B                      1 << 1
 
+/*
+ * Command stream: when the mode byte has SPI_SEND_STREAM set, the rest of the
+ * write is a sequence of records executed by the driver in one call.
+ * Each record is a header, nparams 8 bit parameter bytes and len payload
+ * bytes, with params and payload each padded to ILI9341_REC_ALIGN on the wire.
+ */
+#define SPI_SEND_STREAM                 1 << 2
+
+#define ILI9341_REC_NO_CMD              (1U << 0)   /* Payload continues the previous command */
+#define ILI9341_REC_DATA_16B            (1U << 1)   /* Payload is sent as 16 bit words */
+#define ILI9341_REC_REPEAT              (1U << 2)   /* Payload is a repeat count and a pattern, see below */
+
+#define ILI9341_REC_MAX_PARAMS          16U
+#define ILI9341_REC_ALIGN(n)            (((n) + 3U) & ~3U)
+/* Longest payload of a record, checked before ILI9341_REC_ALIGN() so it cannot wrap */
+#define ILI9341_REC_MAX_LEN             ILI9341_FB_SIZE
+
+/*
+ * With ILI9341_REC_REPEAT the payload starts with a uint32_t count followed
+ * by a pattern of len - 4 bytes, and the driver sends the pattern count times
+ * back to back. Solid fills are a two byte pattern, so no pixel buffer has
+ * to be built or copied for them. With ILI9341_REC_DATA_16B the pattern
+ * length must be even. One repeat sends at most ILI9341_FB_SIZE bytes.
+ */
+#define ILI9341_REPEAT_MAX_PATTERN      64U
+
+struct ili9341_rec_hdr {
+    uint8_t cmd;
+    uint8_t flags;
+    uint8_t nparams;
+    uint8_t delay_ms;           /* Wait after the record, e.g. for SWRESET and SLEEP_OUT */
+    uint32_t len;
+};
+
+/* Total delay_ms of one stream, a longer stream fails with EINVAL at the record past it */
+#define ILI9341_STREAM_MAX_DELAY_MS     1000U
+
+/*
+ * Power-on register setup shared by the driver and the user library, so both
+ * leave the panel in the same state. Expand ILI9341_INIT_SEQ into an array of
+ * struct ili9341_init_cmd and send each command with its parameters, then
+ * wait its delay.
+ */
+struct ili9341_init_cmd {
+    uint8_t cmd;
+    uint8_t nparams;
+    uint8_t delay_ms;
+    uint8_t params[15];
+};
+
+#define ILI9341_INIT_SEQ { \
+    { ILI9341_SWRESET,      0, 5,   { 0 } }, \
+    { ILI9341_POWERB,       3, 0,   { 0x00, 0xD9, 0x30 } }, \
+    { ILI9341_POWER_SEQ,    4, 0,   { 0x64, 0x03, 0x12, 0x81 } }, \
+    { ILI9341_DTCA,         3, 0,   { 0x85, 0x10, 0x7A } }, \
+    { ILI9341_POWERA,       5, 0,   { 0x39, 0x2C, 0x00, 0x34, 0x02 } }, \
+    { ILI9341_PRC,          1, 0,   { 0x20 } }, \
+    { ILI9341_DTCB,         2, 0,   { 0x00, 0x00 } }, \
+    { ILI9341_POWER1,       1, 0,   { 0x1B } }, \
+    { ILI9341_POWER2,       1, 0,   { 0x12 } }, \
+    { ILI9341_VCOM1,        2, 0,   { 0x08, 0x26 } }, \
+    { ILI9341_VCOM2,        1, 0,   { 0xB7 } }, \
+    { ILI9341_PIXEL_FORMAT, 1, 0,   { 0x55 } },                 /* RGB565 */ \
+    { ILI9341_FRMCTR1,      2, 0,   { 0x00, 0x1B } },           /* 70 Hz */ \
+    { ILI9341_DFC,          2, 0,   { 0x0A, 0xA2 } }, \
+    { ILI9341_3GAMMA_EN,    1, 0,   { 0x02 } }, \
+    { ILI9341_GAMMA,        1, 0,   { 0x01 } }, \
+    { ILI9341_PGAMMA,       15, 0,  { 0x0F, 0x1D, 0x1A, 0x0A, 0x0D, 0x07, 0x49, 0x66, \
+                                      0x3B, 0x07, 0x11, 0x01, 0x09, 0x05, 0x04 } }, \
+    { ILI9341_NGAMMA,       15, 0,  { 0x00, 0x18, 0x1D, 0x02, 0x0F, 0x04, 0x36, 0x13, \
+                                      0x4C, 0x07, 0x13, 0x0F, 0x2E, 0x2F, 0x05 } }, \
+    { ILI9341_SLEEP_OUT,    0, 120, { 0 } }, \
+    { ILI9341_DISPLAY_ON,   0, 0,   { 0 } }, \
+    { ILI9341_TEON,         1, 0,   { 0x00 } },                 /* TE in V-blank only */ \
+}
+
+/*
+ * Shared framebuffer: the driver owns ILI9341_FB_SIZE bytes of RGB565 memory
+ * that userspace maps with mmap() at offset 0 and renders into directly.
+ * ILI9341_IOC_FLUSH_RECT sends a window of it to the panel; offset and stride
+ * are in bytes relative to the start of the mapping. flags is
+ * ILI9341_REC_DATA_16B for host-order pixels, 0 for pixels already stored
+ * in wire (big-endian) order.
+ */
+#define ILI9341_FB_WIDTH                240U
+#define ILI9341_FB_HEIGHT               320U
+#define ILI9341_FRAME_SIZE              (ILI9341_FB_WIDTH * ILI9341_FB_HEIGHT * 2U)
+#define ILI9341_FB_FRAMES               2U
+#define ILI9341_FB_SIZE                 (ILI9341_FRAME_SIZE * ILI9341_FB_FRAMES)
+
+struct ili9341_flush_rect {
+    uint16_t x1;
+    uint16_t x2;
+    uint16_t y1;
+    uint16_t y2;
+    uint32_t offset;
+    uint32_t stride;
+    uint32_t flags;
+};
+
+#define ILI9341_IOC_MAGIC               'i'
+#define ILI9341_IOC_FLUSH_RECT          _IOW(ILI9341_IOC_MAGIC, 1, struct ili9341_flush_rect)
+
+/*
+ * ILI9341_IOC_READ_REG returns len bytes of a read command such as RDDST or
+ * RDDPM. The dummy clock cycle in front of the RDDID and RDDST data on the
+ * serial interface is skipped by the driver.
+ */
+struct ili9341_read_reg {
+    uint8_t cmd;
+    uint8_t len;                /* 1 to 4 */
+    uint8_t data[4];
+};
+
+#define ILI9341_IOC_READ_REG            _IOWR(ILI9341_IOC_MAGIC, 2, struct ili9341_read_reg)
+
+/*
+ * ILI9341_IOC_FILL_RECT fills a window with one color, and
+ * ILI9341_IOC_PATTERN_RECT writes count copies of a pattern of len bytes
+ * into a window from its first pixel on. The driver sends them out of its
+ * own repeat buffer like an ILI9341_REC_REPEAT record, so no pixel buffer
+ * is built or copied in. Color and pattern go out as stored: host-order
+ * 16 bit words with ILI9341_REC_DATA_16B in flags, wire-order bytes without.
+ * A window off the panel in either orientation, or a pattern longer than
+ * the window's RGB565 bytes, fails with EINVAL.
+ */
+struct ili9341_fill_rect {
+    uint16_t x1;
+    uint16_t x2;
+    uint16_t y1;
+    uint16_t y2;
+    uint16_t color;             /* RGB565 */
+    uint16_t flags;
+};
+
+struct ili9341_pattern_rect {
+    uint16_t x1;
+    uint16_t x2;
+    uint16_t y1;
+    uint16_t y2;
+    uint32_t count;
+    uint32_t len;               /* 1 to ILI9341_REPEAT_MAX_PATTERN, even with ILI9341_REC_DATA_16B */
+    uint32_t flags;
+    uint8_t pattern[ILI9341_REPEAT_MAX_PATTERN];
+};
+
+#define ILI9341_IOC_FILL_RECT           _IOW(ILI9341_IOC_MAGIC, 3, struct ili9341_fill_rect)
+#define ILI9341_IOC_PATTERN_RECT        _IOW(ILI9341_IOC_MAGIC, 4, struct ili9341_pattern_rect)
+
+/* RDDPM bits, all set once the init sequence has run */
+#define ILI9341_DPM_BSTON               0x80U   /* Booster on */
+#define ILI9341_DPM_SLPOUT              0x10U   /* Out of sleep */
+#define ILI9341_DPM_NORON               0x08U   /* Normal display mode */
+#define ILI9341_DPM_DISON               0x04U   /* Display on */
+#define ILI9341_DPM_READY               (ILI9341_DPM_BSTON | ILI9341_DPM_SLPOUT | ILI9341_DPM_NORON | ILI9341_DPM_DISON)
+
+/* RDDST data[1]: interface pixel format in bits 6..4 (5 is RGB565) and idle mode */
+#define ILI9341_DST_PIXFMT(data)        (((data)[1] >> 4) & 0x07U)
+#define ILI9341_DST_IDLE                0x08U
+
+/*
+ * Events: with a TE line wired up ("te-gpios" in the device tree) the driver
+ * turns on the panel's tearing effect output, which pulses once per frame as
+ * the panel enters vertical blanking. read() returns whole
+ * struct ili9341_event records for the newest edge the file has not read,
+ * blocking until there is one (-EAGAIN with O_NONBLOCK), and poll() reports
+ * POLLIN meanwhile. Edges that were not read in time are dropped, sequence
+ * counts them all. Without a TE line, and with no non-blocking writes
+ * pending (see below), read() fails with EOPNOTSUPP and poll() does not
+ * report POLLIN, so probe with a read() before polling.
+ */
+#define ILI9341_EVENT_VSYNC             1U
+#define ILI9341_EVENT_FLUSH_DONE        2U
+
+struct ili9341_event {
+    uint32_t type;
+    uint32_t sequence;          /* TE edges since the driver was loaded, or writes of the file completed */
+    uint64_t timestamp_ns;      /* CLOCK_MONOTONIC */
+};
+
+/*
+ * Non-blocking writes: on a file opened with O_NONBLOCK, write() copies the
+ * write into one of ILI9341_QUEUE_DEPTH driver buffers and returns at once,
+ * and the driver sends the queued writes in order in the background. It
+ * fails with EAGAIN while every buffer is in flight and with EMSGSIZE for
+ * writes longer than ILI9341_QUEUE_WRITE_MAX. poll() reports POLLOUT while a
+ * buffer is free and POLLIN once writes of the file have completed, which
+ * read() returns (before any TE edge) as an ILI9341_EVENT_FLUSH_DONE whose
+ * sequence counts the file's completed writes. When a queued write fails,
+ * the file's next write() returns its error.
+ */
+#define ILI9341_QUEUE_DEPTH             4U
+#define ILI9341_QUEUE_WRITE_MAX         (ILI9341_FRAME_SIZE + 4096U)
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,41 @@
+/*
+ * ili9341_emu.h
+ *
+ * In-memory ILI9341 panel: decodes the driver's write format into a
+ * simulated GRAM and charges each transfer against an SPI clock model.
+ */
+
+#ifndef ILI9341_EMU_H_
+#define ILI9341_EMU_H_
+
+#include <stdint.h>
+#include "ili9341_transport.h"
+
+#define LCD_EMU_DEFAULT_SPI_HZ      32000000UL
+#define LCD_EMU_DEFAULT_XFER_NS     2000UL
+#define LCD_EMU_DEFAULT_CMD_HZ      10000000UL  /*The driver's ILI9341_CMD_SPEED_HZ*/
+
+typedef struct{
+    uint32_t spi_hz;        /*SPI clock the transfer time is charged against*/
+    uint32_t xfer_ns;       /*Fixed cost of every transfer (CS, DC toggle, driver)*/
+    uint8_t realtime;       /*1: block each write for its modelled duration*/
+    uint32_t te_hz;         /*Rate of the simulated TE output, 0 for a panel without TE line*/
+    uint32_t cmd_hz;        /*Clock of commands and their parameters, 0 for the default (at most spi_hz)*/
+}lcd_emu_config_t;
+
+typedef struct{
+    uint64_t writes;        /*Calls into the transport*/
+    uint64_t transfers;     /*SPI transfers the driver would issue*/
+    uint64_t cmds;
+    uint64_t bytes;         /*Bytes on the wire, commands included*/
+    uint64_t pixels;
+    uint64_t busy_ns;       /*Modelled bus time*/
+}lcd_emu_stats_t;
+
+lcd_transport_t *lcd_emu_create(const lcd_emu_config_t *cfg);
+const uint16_t *lcd_emu_gram(lcd_transport_t *t);
+void lcd_emu_snapshot(lcd_transport_t *t, uint16_t *out);
+void lcd_emu_get_stats(lcd_transport_t *t, lcd_emu_stats_t *stats);
+void lcd_emu_reset_stats(lcd_transport_t *t);
+
+#endif /* ILI9341_EMU_H_ */
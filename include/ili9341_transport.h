@@ -0,0 +1,65 @@
+/*
+ * ili9341_transport.h
+ *
+ * Backends that carry the driver's write format (mode byte followed by a
+ * command, data or command-stream payload) to a panel.
+ */
+
+#ifndef ILI9341_TRANSPORT_H_
+#define ILI9341_TRANSPORT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct ili9341_event;
+
+/*Environment variable selecting the backend, see lcd_transport_create()*/
+#define LCD_TRANSPORT_ENV           "BSP_LCD_TRANSPORT"
+
+/*SPI clock of the spidev backend when the spec does not give one*/
+#define LCD_SPIDEV_DEFAULT_HZ       32000000UL
+
+typedef struct lcd_transport lcd_transport_t;
+
+typedef struct{
+    const char *name;
+    /*One write as the chardev would receive it, returns bytes consumed or -1*/
+    ssize_t (*writev)(lcd_transport_t *t, const struct iovec *iov, int iovcnt);
+    /*ILI9341_IOC_* requests, -1 with errno ENOTTY when unsupported*/
+    int (*ioctl)(lcd_transport_t *t, unsigned long request, void *arg);
+    /*Shared framebuffer of ILI9341_FB_SIZE bytes, NULL when unsupported*/
+    void *(*map_fb)(lcd_transport_t *t);
+    void (*unmap_fb)(lcd_transport_t *t, void *fb);
+    /*
+     * Wait up to timeout_ms (-1 forever) for the next TE edge after the call.
+     * 1 with ev filled in, 0 on timeout, -1 with errno EOPNOTSUPP without TE.
+     */
+    int (*wait_vsync)(lcd_transport_t *t, struct ili9341_event *ev, int timeout_ms);
+    /*
+     * Optional, NULL when unsupported. writev_async queues a write the way an
+     * O_NONBLOCK write to the chardev does: iov may be reused on return, -1
+     * with errno EAGAIN while ILI9341_QUEUE_DEPTH writes are in flight.
+     * wait_async waits up to timeout_ms (-1 forever) for queued writes to
+     * complete and returns how many did since the last call.
+     */
+    ssize_t (*writev_async)(lcd_transport_t *t, const struct iovec *iov, int iovcnt);
+    int (*wait_async)(lcd_transport_t *t, int timeout_ms);
+    void (*destroy)(lcd_transport_t *t);
+}lcd_transport_ops_t;
+
+struct lcd_transport{
+    const lcd_transport_ops_t *ops;
+    int fd;         /*Descriptor writes may be submitted to directly, -1 if none*/
+    void *priv;
+};
+
+lcd_transport_t *lcd_chardev_transport_create(const char *path);
+lcd_transport_t *lcd_file_transport_create(const char *path);
+lcd_transport_t *lcd_spidev_transport_create(const char *spidev, const char *gpiochip,
+                                             uint32_t dc_line, uint32_t speed_hz);
+lcd_transport_t *lcd_transport_create(const char *spec);
+void lcd_transport_destroy(lcd_transport_t *t);
+
+#endif /* ILI9341_TRANSPORT_H_ */
@@ -11,7 +11,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include "ili9341.h"
+#include "ili9341_transport.h"
 
 #define DEVICE_PATH         "/dev/ili9341"
 
@@ -37,25 +39,62 @@
 #define BSP_LCD_PIXEL_FMT 			BSP_LCD_PIXEL_FMT_RGB565
 
 
-/*Select orientation*/
-#define PORTRAIT  0
-#define LANDSCAPE 1
+/*Select orientation, each step turns the picture by 90 degrees (same order as lv_disp_rot_t)*/
+#define PORTRAIT            0
+#define LANDSCAPE           1
+#define PORTRAIT_INVERTED   2
+#define LANDSCAPE_INVERTED  3
 #define BSP_LCD_ORIENTATION   PORTRAIT
 
-#if(BSP_LCD_ORIENTATION == PORTRAIT)
-	#define  BSP_LCD_ACTIVE_WIDTH 			BSP_LCD_WIDTH
-	#define  BSP_LCD_ACTIVE_HEIGHT  		BSP_LCD_HEIGHT
-#elif(BSP_LCD_ORIENTATION == LANDSCAPE)
-	#define  BSP_LCD_ACTIVE_WIDTH 			BSP_LCD_HEIGHT
-	#define  BSP_LCD_ACTIVE_HEIGHT 			BSP_LCD_WIDTH
-#endif
+
+/*Skip reset and init when the panel reports it is already set up (RDDPM, RDDST)*/
+#define BSP_LCD_FAST_BOOT    1
 
 
 #define AUTO				 1
 #define MANUAL				 0
 #define BSP_LCD_CS_MANAGE    MANUAL
 
-#define USE_DMA 0
+/*
+ * Keep pixels byte-swapped (big-endian RGB565, the panel's wire order) in all
+ * buffers so they go out as plain 8 bit data and the SPI word size never has
+ * to change. Must match LV_COLOR_16_SWAP in lv_conf.h.
+ */
+#define BSP_LCD_PIXEL_SWAP          1
+
+/*Default draw buffers, see bsp_lcd_set_draw_buffers()*/
+#define BSP_LCD_DB_MAX_COUNT        2
+#define BSP_LCD_DB_COUNT            2
+#define BSP_LCD_DB_SIZE             (10UL * 1024UL)     /*Bytes per buffer, one row to ILI9341_FRAME_SIZE*/
+
+#define USE_DMA 1           /*Flush LVGL draw buffers from a worker thread (see tft.c)*/
+
+/*Submit draw buffer flushes through io_uring (needs liburing)*/
+#define BSP_LCD_USE_IO_URING    0
+#define BSP_LCD_URING_DEPTH     8
+
+/*Queue draw buffer flushes as non-blocking writes and collect completions with poll()*/
+#define BSP_LCD_USE_NONBLOCK    0
+/*Flushes complete from lcd_poll() rather than before lcd_write_rect_async() returns*/
+#define BSP_LCD_ASYNC_FLUSH     (BSP_LCD_USE_IO_URING || BSP_LCD_USE_NONBLOCK)
+
+/*Keep a shadow of panel GRAM and send only the pixels that changed*/
+#define BSP_LCD_USE_SHADOW_FB       0
+#define BSP_LCD_DIFF_WINDOW_BYTES   11  /*CASET, RASET and RAMWR with their parameters*/
+#define BSP_LCD_DIFF_XFER_BYTES     8   /*Per-transfer setup cost expressed in bytes on the wire*/
+
+/*Let the driver repeat the pixel for solid fills instead of sending a filled buffer*/
+#define BSP_LCD_USE_REPEAT_FILL     1
+
+/*Source formats of bsp_lcd_convert()*/
+#define BSP_LCD_CONV_RGB888         0   /*R, G, B bytes*/
+#define BSP_LCD_CONV_ARGB8888       1   /*Host-order uint32_t 0xAARRGGBB (lv_color32_t), alpha is ignored*/
+
+/*bsp_lcd_convert() flags*/
+#define BSP_LCD_CONV_SWAP           (1U << 0)   /*Store big-endian RGB565, see BSP_LCD_PIXEL_SWAP*/
+#define BSP_LCD_CONV_DITHER         (1U << 1)   /*Ordered dither instead of dropping the low bits*/
+/*Byte order the library's buffers are kept in*/
+#define BSP_LCD_CONV_PANEL          (BSP_LCD_PIXEL_SWAP ? BSP_LCD_CONV_SWAP : 0U)
 
 typedef struct{
     uint16_t x1;
@@ -64,34 +103,107 @@ typedef struct{
     uint16_t y2;
 }lcd_area_t;
 
+/* Transaction builder for the driver's command stream (SPI_SEND_STREAM) */
+#define LCD_TXN_MAX_RECS            24  /*Fits the whole ILI9341_INIT_SEQ*/
+/*Room to gather every row of a full-height rectangle into one record*/
+#define LCD_TXN_MAX_IOV             (1 + 4 * LCD_TXN_MAX_RECS + ILI9341_FB_HEIGHT)
+
+typedef struct{
+    uint8_t mode;
+    uint32_t nrecs;
+    uint32_t niov;
+    struct ili9341_rec_hdr hdr[LCD_TXN_MAX_RECS];
+    uint8_t params[LCD_TXN_MAX_RECS][ILI9341_REC_MAX_PARAMS];
+    uint32_t repeat[LCD_TXN_MAX_RECS];
+    struct iovec iov[LCD_TXN_MAX_IOV];
+}lcd_txn_t;
+
 struct bsp_lcd;
 
 typedef void (*bsp_lcd_dma_cplt_cb_t)(struct bsp_lcd*);
 typedef void (*bsp_lcd_dma_err_cb_t)(struct bsp_lcd*);
 
-typedef struct{
+typedef struct bsp_lcd{
+    lcd_transport_t *transport;
+    uint8_t *fb;
+    void *uring;
+    uint32_t inflight;          /*Queued non-blocking writes, see BSP_LCD_USE_NONBLOCK*/
+    int async_err;              /*errno of an earlier queued write, reported by the next lcd_poll()*/
+    void *shadow;               /*GRAM copy for BSP_LCD_USE_SHADOW_FB*/
     uint8_t orientation;
+    uint16_t width;         /*Active size, follows the orientation*/
+    uint16_t height;
     uint8_t pixel_format;
     uint8_t * draw_buffer1;
-    uint8_t * draw_buffer2;
+    uint8_t * draw_buffer2;     /*NULL with a single draw buffer*/
+    uint8_t * db_mem[BSP_LCD_DB_MAX_COUNT];
+    uint32_t db_size;
+    uint8_t db_count;
     uint32_t write_length;
-    uint8_t *buff_to_draw;
-    uint8_t *buff_to_flush;
+    uint8_t db_index;
     lcd_area_t area;
+    uint16_t scroll_top;        /*Vertical scroll area in rows of the active orientation, see bsp_lcd_scroll()*/
+    uint16_t scroll_height;     /*0 when the panel does not scroll*/
+    uint16_t scroll_offset;
     bsp_lcd_dma_cplt_cb_t dma_cplt_cb;
     bsp_lcd_dma_err_cb_t dma_err_cb;
+    void *user_data;            /*Free for the owner of the handle, e.g. its display driver*/
 }bsp_lcd_t;
 
 
+/*
+ * Handle API. Each panel has its own bsp_lcd_t and none of these share
+ * state, so panels on different SPI buses can be driven from different
+ * threads. The bsp_lcd_* calls below work on a default handle.
+ */
+bsp_lcd_t *lcd_create(lcd_transport_t *t);
+void lcd_destroy(bsp_lcd_t *lcd);
+int lcd_init(bsp_lcd_t *lcd);
+int lcd_set_draw_buffers(bsp_lcd_t *lcd, uint32_t count, uint32_t size);
+void lcd_set_orientation(bsp_lcd_t *lcd, uint8_t orientation);
+int lcd_set_scroll_area(bsp_lcd_t *lcd, uint16_t top, uint16_t height);
+int lcd_scroll(bsp_lcd_t *lcd, int16_t dy);
+int lcd_wait_vsync(bsp_lcd_t *lcd, struct ili9341_event *ev, int timeout_ms);
+int lcd_set_tear_scanline(bsp_lcd_t *lcd, uint16_t line);
+int lcd_fill_area(bsp_lcd_t *lcd, const lcd_area_t *area, uint16_t color);
+int lcd_write_rect(bsp_lcd_t *lcd, const lcd_area_t *area, const uint8_t *buffer, uint32_t stride);
+int lcd_write_rect_async(bsp_lcd_t *lcd, const lcd_area_t *area, uint8_t *buffer, uint32_t stride);
+void lcd_poll(bsp_lcd_t *lcd, int wait);
+void lcd_shadow_invalidate(bsp_lcd_t *lcd);
+int lcd_txn_submit(bsp_lcd_t *lcd, lcd_txn_t *txn);
 
 void bsp_lcd_init(void);
+void bsp_lcd_deinit(void);
+void bsp_lcd_set_transport(lcd_transport_t *t);
 void bsp_lcd_set_orientation(int orientation);
+uint16_t bsp_lcd_get_width(void);
+uint16_t bsp_lcd_get_height(void);
+int bsp_lcd_set_scroll_area(uint16_t top, uint16_t height);
+int bsp_lcd_scroll(int16_t dy);
+int bsp_lcd_wait_vsync(struct ili9341_event *ev, int timeout_ms);
+int bsp_lcd_set_tear_scanline(uint16_t line);
 int bsp_lcd_write(uint8_t *buffer, uint32_t nbytes);
 void bsp_lcd_set_background_color(uint32_t rgb888);
 void bsp_lcd_fill_rect(uint32_t rgb888, uint32_t x_start, uint32_t x_width,uint32_t y_start,uint32_t y_height);
 void bsp_lcd_set_display_area(uint16_t x1, uint16_t x2, uint16_t y1 , uint16_t y2);
+int bsp_lcd_write_rect(const lcd_area_t *area, const uint8_t *buffer, uint32_t stride);
+int bsp_lcd_write_rect_async(const lcd_area_t *area, uint8_t *buffer, uint32_t stride);
+void bsp_lcd_poll(int wait);
+void bsp_lcd_shadow_invalidate(void);
 void bsp_lcd_send_cmd_mem_write(void);
 uint16_t bsp_lcd_convert_rgb888_to_rgb565(uint32_t rgb888);
+int bsp_lcd_convert(void *dst, uint32_t dst_stride, const void *src, uint32_t src_stride,
+                    uint32_t width, uint32_t height, uint8_t format, uint32_t flags);
+void bsp_lcd_txn_init(lcd_txn_t *txn);
+int bsp_lcd_txn_add(lcd_txn_t *txn, uint8_t cmd, const uint8_t *params, uint8_t nparams, const void *data, uint32_t len, uint8_t flags);
+int bsp_lcd_txn_add_repeat(lcd_txn_t *txn, uint8_t cmd, const void *pattern, uint32_t len, uint32_t count, uint8_t flags);
+int bsp_lcd_txn_add_area(lcd_txn_t *txn, const lcd_area_t *area);
+int bsp_lcd_txn_add_rows(lcd_txn_t *txn, uint8_t cmd, const uint8_t *data, uint32_t row_len, uint32_t rows, uint32_t stride, uint8_t flags);
+int bsp_lcd_txn_add_delay(lcd_txn_t *txn, uint8_t ms);
+int bsp_lcd_txn_submit(lcd_txn_t *txn);
+int bsp_lcd_set_draw_buffers(uint32_t count, uint32_t size);
+uint32_t bsp_lcd_get_draw_buffer_size(void);
+uint32_t bsp_lcd_get_draw_buffer_count(void);
 void *bsp_lcd_get_draw_buffer1_addr(void);
 void *bsp_lcd_get_draw_buffer2_addr(void);
 #endif /* BSP_LCD_H_ */
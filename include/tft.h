@@ -19,17 +19,36 @@
 #define TFT_HOR_RES 240
 #define TFT_VER_RES 320
 
+/*Default draw buffers, change at runtime with tft_set_draw_buffers()*/
+#define TFT_DRAW_BUF_COUNT		2
+#define TFT_DRAW_BUF_SIZE		((10UL * 1024UL) / 2)	/*Pixels per buffer, TFT_HOR_RES * TFT_VER_RES for full frames*/
+
+/*Tune the strip size from measured render and transfer times (see tft_set_autotune())*/
+#define TFT_DRAW_BUF_AUTOTUNE	0
+#define TFT_TUNE_PERIOD			30		/*Refreshes between two tuning steps*/
+
+/*Pace refreshes by the panel's TE output when it has one (see tft_set_te_source())*/
+#define TFT_USE_TE				1
+#define TFT_TE_TIMEOUT			50		/*[ms] Longest wait for an edge before its period is known*/
+
 #define TFT_EXT_FB		0		/*Frame buffer is located into an external SDRAM*/
 #define TFT_USE_GPU		0		/*Enable hardware accelerator*/
 
 /**********************
  *      TYPEDEFS
  **********************/
+/*Same contract as lcd_wait_vsync()*/
+typedef int (*tft_te_source_t)(bsp_lcd_t * lcd, struct ili9341_event * ev, int timeout_ms);
 
 /**********************
  * GLOBAL PROTOTYPES
  **********************/
 void tft_init(void);
+lv_disp_t * tft_create(bsp_lcd_t * lcd);
+int tft_set_draw_buffers(lv_disp_t * disp, uint32_t count, uint32_t size_px);
+void tft_set_autotune(lv_disp_t * disp, bool en);
+void tft_set_scroll_offload(lv_disp_t * disp, lv_obj_t * obj);
+void tft_set_te_source(lv_disp_t * disp, tft_te_source_t src);
 
 /**********************
  *      MACROS
@@ -0,0 +1,339 @@
+/*
+ * ili9341_convert.c
+ *
+ * Bulk conversion of RGB888 and ARGB8888 buffers to the panel's RGB565,
+ * e.g. camera frames or decoded assets. The SIMD paths are chosen at compile
+ * time from the target flags (-mavx2, -mssse3, NEON on ARM) and handle the
+ * middle of each row; a scalar loop does the rest and every other target.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ili9341_user_lib.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CONV_AVX2		1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CONV_SSE2		1
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define CONV_SSSE3		1
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONV_NEON		1
+#endif
+#endif
+
+/*
+ * 4x4 ordered dither thresholds. Adding threshold / 2 before dropping 3 bits
+ * (threshold / 4 before dropping 2) spreads the truncation error so that
+ * gradients average out to the source colour instead of banding.
+ */
+static const uint8_t conv_bayer[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 },
+};
+
+#if CONV_AVX2 || CONV_SSE2
+/*Dither bytes for 4 pixels in ARGB8888 byte order (B, G, R, A)*/
+static void conv_dither_bgra(uint8_t out[16], const uint8_t *bayer, uint32_t flags)
+{
+	memset(out, 0, 16);
+	if (!(flags & BSP_LCD_CONV_DITHER))
+	{
+		return;
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		out[4 * i + 0] = bayer[i] >> 1;
+		out[4 * i + 1] = bayer[i] >> 2;
+		out[4 * i + 2] = bayer[i] >> 1;
+	}
+}
+#endif
+
+#if CONV_AVX2
+/*Eight B, G, R, A pixels to RGB565 in the low half of each 32 bit lane*/
+static inline __m256i conv_avx2_565(__m256i v)
+{
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 8), _mm256_set1_epi32(0xF800));
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 5), _mm256_set1_epi32(0x07E0));
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 3), _mm256_set1_epi32(0x001F));
+
+	/*Sign extend so the saturating pack keeps all 16 bits*/
+	v = _mm256_or_si256(r, _mm256_or_si256(g, b));
+	return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+/*Sixteen pixels held in two vectors of eight, stored in order*/
+static inline void conv_avx2_store(uint16_t *d, __m256i lo, __m256i hi, __m256i dither, uint32_t flags)
+{
+	__m256i p;
+
+	lo = conv_avx2_565(_mm256_adds_epu8(lo, dither));
+	hi = conv_avx2_565(_mm256_adds_epu8(hi, dither));
+	/*packs works per 128 bit lane, put the quarters back in order*/
+	p = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+	if (flags & BSP_LCD_CONV_SWAP)
+	{
+		p = _mm256_or_si256(_mm256_slli_epi16(p, 8), _mm256_srli_epi16(p, 8));
+	}
+	_mm256_storeu_si256((__m256i *)d, p);
+}
+
+/*Four R, G, B pixels from each 16 byte half into B, G, R, 0 lanes*/
+static inline __m256i conv_avx2_rgb(const uint8_t *s)
+{
+	const __m256i shuf = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+										  2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	__m256i v = _mm256_set_m128i(_mm_loadu_si128((const __m128i *)(s + 12)),
+								 _mm_loadu_si128((const __m128i *)s));
+
+	return _mm256_shuffle_epi8(v, shuf);
+}
+
+static uint32_t conv_row_simd(uint16_t *d, const uint8_t *s, uint32_t w, uint32_t bpp,
+							  const uint8_t *bayer, uint32_t flags)
+{
+	uint8_t dither_bytes[16];
+	__m256i dither;
+	uint32_t x = 0;
+
+	conv_dither_bgra(dither_bytes, bayer, flags);
+	dither = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)dither_bytes));
+
+	if (bpp == 4)
+	{
+		for (; x + 16 <= w; x += 16)
+		{
+			conv_avx2_store(d + x, _mm256_loadu_si256((const __m256i *)(s + 4 * x)),
+							_mm256_loadu_si256((const __m256i *)(s + 4 * x + 32)), dither, flags);
+		}
+	}
+	else
+	{
+		/*The last 16 byte load reads up to 5 pixels past the 16*/
+		for (; x + 18 <= w; x += 16)
+		{
+			conv_avx2_store(d + x, conv_avx2_rgb(s + 3 * x), conv_avx2_rgb(s + 3 * x + 24), dither, flags);
+		}
+	}
+	return x;
+}
+
+#elif CONV_SSE2
+/*Four B, G, R, A pixels to RGB565 in the low half of each 32 bit lane*/
+static inline __m128i conv_sse2_565(__m128i v)
+{
+	__m128i r = _mm_and_si128(_mm_srli_epi32(v, 8), _mm_set1_epi32(0xF800));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(v, 5), _mm_set1_epi32(0x07E0));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(v, 3), _mm_set1_epi32(0x001F));
+
+	/*Sign extend so the saturating pack keeps all 16 bits*/
+	v = _mm_or_si128(r, _mm_or_si128(g, b));
+	return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+/*Eight pixels held in two vectors of four, stored in order*/
+static inline void conv_sse2_store(uint16_t *d, __m128i lo, __m128i hi, __m128i dither, uint32_t flags)
+{
+	__m128i p;
+
+	lo = conv_sse2_565(_mm_adds_epu8(lo, dither));
+	hi = conv_sse2_565(_mm_adds_epu8(hi, dither));
+	p = _mm_packs_epi32(lo, hi);
+	if (flags & BSP_LCD_CONV_SWAP)
+	{
+		p = _mm_or_si128(_mm_slli_epi16(p, 8), _mm_srli_epi16(p, 8));
+	}
+	_mm_storeu_si128((__m128i *)d, p);
+}
+
+#if CONV_SSSE3
+/*Four R, G, B pixels into B, G, R, 0 lanes*/
+static inline __m128i conv_ssse3_rgb(const uint8_t *s)
+{
+	const __m128i shuf = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)s), shuf);
+}
+#endif
+
+static uint32_t conv_row_simd(uint16_t *d, const uint8_t *s, uint32_t w, uint32_t bpp,
+							  const uint8_t *bayer, uint32_t flags)
+{
+	uint8_t dither_bytes[16];
+	__m128i dither;
+	uint32_t x = 0;
+
+	conv_dither_bgra(dither_bytes, bayer, flags);
+	dither = _mm_loadu_si128((const __m128i *)dither_bytes);
+
+	if (bpp == 4)
+	{
+		for (; x + 8 <= w; x += 8)
+		{
+			conv_sse2_store(d + x, _mm_loadu_si128((const __m128i *)(s + 4 * x)),
+							_mm_loadu_si128((const __m128i *)(s + 4 * x + 16)), dither, flags);
+		}
+	}
+#if CONV_SSSE3
+	else
+	{
+		/*The second 16 byte load reads up to 5 pixels past the 8*/
+		for (; x + 10 <= w; x += 8)
+		{
+			conv_sse2_store(d + x, conv_ssse3_rgb(s + 3 * x), conv_ssse3_rgb(s + 3 * x + 12), dither, flags);
+		}
+	}
+#endif
+	return x;
+}
+
+#elif CONV_NEON
+static inline uint16x8_t conv_neon_565(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+	uint16x8_t p = vshll_n_u8(r, 8);
+
+	p = vsriq_n_u16(p, vshll_n_u8(g, 8), 5);
+	return vsriq_n_u16(p, vshll_n_u8(b, 8), 11);
+}
+
+static inline void conv_neon_store(uint16_t *d, uint8x16_t r, uint8x16_t g, uint8x16_t b, uint32_t flags)
+{
+	uint16x8_t lo = conv_neon_565(vget_low_u8(r), vget_low_u8(g), vget_low_u8(b));
+	uint16x8_t hi = conv_neon_565(vget_high_u8(r), vget_high_u8(g), vget_high_u8(b));
+
+	if (flags & BSP_LCD_CONV_SWAP)
+	{
+		lo = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(lo)));
+		hi = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(hi)));
+	}
+	vst1q_u16(d, lo);
+	vst1q_u16(d + 8, hi);
+}
+
+static uint32_t conv_row_simd(uint16_t *d, const uint8_t *s, uint32_t w, uint32_t bpp,
+							  const uint8_t *bayer, uint32_t flags)
+{
+	uint8_t d5_bytes[16] = {0}, d6_bytes[16] = {0};
+	uint8x16_t d5, d6;
+	uint32_t x = 0;
+
+	if (flags & BSP_LCD_CONV_DITHER)
+	{
+		for (int i = 0; i < 16; i++)
+		{
+			d5_bytes[i] = bayer[i & 3] >> 1;
+			d6_bytes[i] = bayer[i & 3] >> 2;
+		}
+	}
+	d5 = vld1q_u8(d5_bytes);
+	d6 = vld1q_u8(d6_bytes);
+
+	for (; x + 16 <= w; x += 16)
+	{
+		if (bpp == 4)
+		{
+			/*B, G, R, A*/
+			uint8x16x4_t v = vld4q_u8(s + 4 * x);
+
+			conv_neon_store(d + x, vqaddq_u8(v.val[2], d5), vqaddq_u8(v.val[1], d6), vqaddq_u8(v.val[0], d5), flags);
+		}
+		else
+		{
+			uint8x16x3_t v = vld3q_u8(s + 3 * x);
+
+			conv_neon_store(d + x, vqaddq_u8(v.val[0], d5), vqaddq_u8(v.val[1], d6), vqaddq_u8(v.val[2], d5), flags);
+		}
+	}
+	return x;
+}
+#endif
+
+static void conv_row(uint16_t *d, const uint8_t *s, uint32_t w, uint32_t bpp, uint32_t y, uint32_t flags)
+{
+	const uint8_t *bayer = conv_bayer[y & 3];
+	uint32_t x = 0;
+
+#if CONV_AVX2 || CONV_SSE2 || CONV_NEON
+	/*Groups start on multiples of 4 pixels, so the dither pattern lines up*/
+	x = conv_row_simd(d, s, w, bpp, bayer, flags);
+#endif
+
+	for (; x < w; x++)
+	{
+		uint32_t r, g, b, c;
+		uint16_t p;
+
+		if (bpp == 3)
+		{
+			r = s[3 * x];
+			g = s[3 * x + 1];
+			b = s[3 * x + 2];
+		}
+		else
+		{
+			memcpy(&c, s + 4 * x, sizeof(c));
+			r = (c >> 16) & 0xFFU;
+			g = (c >> 8) & 0xFFU;
+			b = c & 0xFFU;
+		}
+
+		if (flags & BSP_LCD_CONV_DITHER)
+		{
+			r += bayer[x & 3] >> 1;
+			g += bayer[x & 3] >> 2;
+			b += bayer[x & 3] >> 1;
+			if (r > 0xFFU)		r = 0xFFU;
+			if (g > 0xFFU)		g = 0xFFU;
+			if (b > 0xFFU)		b = 0xFFU;
+		}
+
+		p = (uint16_t)(((r & 0xF8U) << 8) | ((g & 0xFCU) << 3) | (b >> 3));
+		if (flags & BSP_LCD_CONV_SWAP)
+		{
+			p = (uint16_t)((p >> 8) | (p << 8));
+		}
+		d[x] = p;
+	}
+}
+
+/*
+ * Convert a width x height block of src (BSP_LCD_CONV_RGB888 or
+ * BSP_LCD_CONV_ARGB8888) into RGB565 at dst. Strides are in bytes and may
+ * leave gaps between rows, so a window of a larger image can be converted
+ * straight into a draw buffer or the shared framebuffer. The dither pattern
+ * is anchored at the top left pixel of the block. Returns 0, or -1 if the
+ * arguments are invalid.
+ */
+int bsp_lcd_convert(void *dst, uint32_t dst_stride, const void *src, uint32_t src_stride,
+					uint32_t width, uint32_t height, uint8_t format, uint32_t flags)
+{
+	uint32_t bpp;
+
+	if (format == BSP_LCD_CONV_RGB888)			bpp = 3;
+	else if (format == BSP_LCD_CONV_ARGB8888)	bpp = 4;
+	else										return -1;
+
+	if (dst == NULL || src == NULL || ((uintptr_t)dst & 1U) || (dst_stride & 1U) ||
+		dst_stride < width * 2U || src_stride < width * bpp)
+	{
+		return -1;
+	}
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		conv_row((uint16_t *)((uint8_t *)dst + (size_t)y * dst_stride),
+				 (const uint8_t *)src + (size_t)y * src_stride, width, bpp, y, flags);
+	}
+	return 0;
+}
@@ -0,0 +1,775 @@
+/*
+ * ili9341_emu.c
+ *
+ * In-memory ILI9341 panel behind the lcd_transport_t interface. Writes are
+ * decoded exactly as the kernel driver would execute them, and the resulting
+ * command/data bytes drive a model of the controller's address counter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "ili9341.h"
+#include "ili9341_emu.h"
+
+#define EMU_W                       ILI9341_FB_WIDTH
+#define EMU_H                       ILI9341_FB_HEIGHT
+/*Size of the driver's fill buffer (one page), sets the transfers per repeat*/
+#define EMU_FILL_BUF_SIZE           4096U
+/*Clock of register reads, the driver's ILI9341_READ_SPEED_HZ*/
+#define EMU_READ_HZ                 6000000U
+
+typedef struct{
+	lcd_emu_config_t cfg;
+	lcd_emu_stats_t stats;
+	uint16_t gram[EMU_W * EMU_H];
+	uint8_t *fb;
+
+	/*Controller state*/
+	uint8_t cmd;
+	uint8_t params[16];
+	uint32_t nparams;
+	uint8_t madctl;
+	uint8_t pixfmt;
+	uint16_t sc, ec, sp, ep;
+	uint16_t col, page;
+	uint16_t tfa, vsa, bfa, vsp;
+	uint8_t pix[3];
+	uint32_t npix;
+	uint8_t te_on;          /*TEON or STE received since the last reset*/
+	uint8_t sleep_out;
+	uint8_t display_on;
+	uint64_t te_start;      /*TE edge 0, edges follow every 1 / te_hz*/
+
+	/*Queued non-blocking writes, oldest first, by the time their transfer ends*/
+	uint64_t queue_end[ILI9341_QUEUE_DEPTH];
+	uint32_t queue_head;
+	uint32_t queued;
+}lcd_emu_t;
+
+/*One transfer at hz; word size and clock travel with it, nothing is reconfigured*/
+static void emu_charge(lcd_emu_t *e, uint64_t nbytes, uint32_t hz)
+{
+	e->stats.transfers++;
+	e->stats.bytes += nbytes;
+	e->stats.busy_ns += e->cfg.xfer_ns + (nbytes * 8ULL * 1000000000ULL) / hz;
+}
+
+/*GRAM position a column/page address lands on under the current MADCTL*/
+static void emu_map(const lcd_emu_t *e, uint32_t col, uint32_t page, uint32_t *x, uint32_t *y)
+{
+	*x = col;
+	*y = page;
+	if (e->madctl & MADCTL_MV)
+	{
+		*x = page;
+		*y = col;
+	}
+	if (e->madctl & MADCTL_MX)      *x = EMU_W - 1 - *x;
+	if (e->madctl & MADCTL_MY)      *y = EMU_H - 1 - *y;
+}
+
+/*Store a pixel at the address counter and advance it like the controller*/
+static void emu_put_pixel(lcd_emu_t *e, uint16_t color)
+{
+	uint32_t x, y;
+
+	emu_map(e, e->col, e->page, &x, &y);
+	if (x < EMU_W && y < EMU_H)
+	{
+		e->gram[y * EMU_W + x] = color;
+	}
+	e->stats.pixels++;
+
+	if (++e->col > e->ec)
+	{
+		e->col = e->sc;
+		if (++e->page > e->ep)
+		{
+			e->page = e->sp;
+		}
+	}
+}
+
+static void emu_cmd(lcd_emu_t *e, uint8_t cmd)
+{
+	e->cmd = cmd;
+	e->nparams = 0;
+	e->npix = 0;
+	e->stats.cmds++;
+	emu_charge(e, 1, e->cfg.cmd_hz);
+
+	if (cmd == ILI9341_GRAM)
+	{
+		e->col = e->sc;
+		e->page = e->sp;
+	}
+	else if (cmd == ILI9341_SWRESET)
+	{
+		e->madctl = 0;
+		e->pixfmt = 0x66;
+		e->sc = 0;
+		e->ec = EMU_W - 1;
+		e->sp = 0;
+		e->ep = EMU_H - 1;
+		e->tfa = 0;
+		e->vsa = EMU_H;
+		e->bfa = 0;
+		e->vsp = 0;
+		e->te_on = 0;
+		e->sleep_out = 0;
+		e->display_on = 0;
+	}
+	else if (cmd == ILI9341_SPLIN || cmd == ILI9341_SLEEP_OUT)
+	{
+		e->sleep_out = (cmd == ILI9341_SLEEP_OUT);
+	}
+	else if (cmd == ILI9341_DISPLAY_OFF || cmd == ILI9341_DISPLAY_ON)
+	{
+		e->display_on = (cmd == ILI9341_DISPLAY_ON);
+	}
+	else if (cmd == ILI9341_TEON || cmd == ILI9341_SET_TEAR_SCANLINE)
+	{
+		e->te_on = 1;
+	}
+	else if (cmd == ILI9341_TEOFF)
+	{
+		e->te_on = 0;
+	}
+}
+
+static uint16_t emu_be16(const uint8_t *p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void emu_param_done(lcd_emu_t *e)
+{
+	const uint8_t *p = e->params;
+
+	switch (e->cmd)
+	{
+	case ILI9341_CASET:
+		if (e->nparams == 4)    { e->sc = emu_be16(p); e->ec = emu_be16(p + 2); }
+		break;
+	case ILI9341_RASET:
+		if (e->nparams == 4)    { e->sp = emu_be16(p); e->ep = emu_be16(p + 2); }
+		break;
+	case ILI9341_MAC:
+		if (e->nparams == 1)    e->madctl = p[0];
+		break;
+	case ILI9341_PIXEL_FORMAT:
+		if (e->nparams == 1)    e->pixfmt = p[0];
+		break;
+	case ILI9341_VSCRDEF:
+		if (e->nparams == 6)
+		{
+			e->tfa = emu_be16(p);
+			e->vsa = emu_be16(p + 2);
+			e->bfa = emu_be16(p + 4);
+		}
+		break;
+	case ILI9341_VSCRSADD:
+		if (e->nparams == 2)    e->vsp = emu_be16(p);
+		break;
+	default:
+		break;
+	}
+}
+
+/*Feed data bytes in wire order to the current command*/
+static void emu_bytes(lcd_emu_t *e, const uint8_t *data, uint32_t len)
+{
+	uint32_t bpp = ((e->pixfmt & 0x07) == 0x06) ? 3 : 2;
+
+	for (uint32_t i = 0; i < len; i++)
+	{
+		if (e->cmd == ILI9341_GRAM || e->cmd == ILI9341_WRITE_MEM_CONTINUE)
+		{
+			e->pix[e->npix++] = data[i];
+			if (e->npix == bpp)
+			{
+				if (bpp == 2)
+				{
+					emu_put_pixel(e, emu_be16(e->pix));
+				}
+				else
+				{
+					emu_put_pixel(e, (uint16_t)(((e->pix[0] & 0xF8) << 8) |
+												((e->pix[1] & 0xFC) << 3) | (e->pix[2] >> 3)));
+				}
+				e->npix = 0;
+			}
+		}
+		else if (e->nparams < sizeof(e->params))
+		{
+			e->params[e->nparams++] = data[i];
+			emu_param_done(e);
+		}
+	}
+}
+
+/*Parameters of the current command, sent at the command clock*/
+static void emu_params(lcd_emu_t *e, const uint8_t *params, uint32_t len)
+{
+	emu_charge(e, len, e->cfg.cmd_hz);
+	emu_bytes(e, params, len);
+}
+
+/*One data transfer; 16 bit frames carry host-order words sent MSB first*/
+static void emu_data(lcd_emu_t *e, const uint8_t *data, uint32_t len, int frame_16b)
+{
+	emu_charge(e, len, e->cfg.spi_hz);
+
+	if (!frame_16b)
+	{
+		emu_bytes(e, data, len);
+		return;
+	}
+
+	for (uint32_t i = 0; i + 1 < len; i += 2)
+	{
+		uint16_t word;
+		uint8_t wire[2];
+
+		memcpy(&word, data + i, 2);
+		wire[0] = word >> 8;
+		wire[1] = word & 0xFF;
+		emu_bytes(e, wire, 2);
+	}
+}
+
+/*
+ * ILI9341_REC_REPEAT payload: the driver replicates the pattern into a one
+ * page fill buffer and sends that buffer until count copies have gone out.
+ */
+static int emu_repeat(lcd_emu_t *e, const uint8_t *payload, uint32_t len, int frame_16b)
+{
+	uint8_t chunk_buf[EMU_FILL_BUF_SIZE];
+	uint32_t count, plen;
+	uint64_t remaining;
+	size_t chunk;
+
+	if (len < sizeof(count))		return -1;
+	memcpy(&count, payload, sizeof(count));
+	plen = len - sizeof(count);
+	remaining = (uint64_t)plen * count;
+	if (!plen || plen > ILI9341_REPEAT_MAX_PATTERN || (frame_16b && (plen & 1)) ||
+		remaining > ILI9341_FB_SIZE)
+	{
+		return -1;
+	}
+
+	chunk = (EMU_FILL_BUF_SIZE / plen) * plen;
+	if (chunk > remaining)		chunk = remaining;
+	for (size_t i = 0; i < chunk; i += plen)
+	{
+		memcpy(chunk_buf + i, payload + sizeof(count), plen);
+	}
+
+	while (remaining)
+	{
+		if (chunk > remaining)	chunk = remaining;
+		emu_data(e, chunk_buf, chunk, frame_16b);
+		remaining -= chunk;
+	}
+	return 0;
+}
+
+/*Same record walk and validation as ili9341_exec_stream() in the driver*/
+static int emu_stream(lcd_emu_t *e, const uint8_t *buf, size_t len)
+{
+	struct ili9341_rec_hdr rec;
+	size_t params_len, data_len;
+	unsigned int delay_ms = 0;
+
+	while (len >= sizeof(rec))
+	{
+		memcpy(&rec, buf, sizeof(rec));
+		buf += sizeof(rec);
+		len -= sizeof(rec);
+
+		if (rec.nparams > ILI9341_REC_MAX_PARAMS || rec.len > ILI9341_REC_MAX_LEN)
+		{
+			return -1;
+		}
+		params_len = ILI9341_REC_ALIGN((size_t)rec.nparams);
+		data_len = ILI9341_REC_ALIGN((size_t)rec.len);
+		if (params_len + data_len > len)
+		{
+			return -1;
+		}
+
+		if (!(rec.flags & ILI9341_REC_NO_CMD))      emu_cmd(e, rec.cmd);
+		if (rec.nparams)                            emu_params(e, buf, rec.nparams);
+		buf += params_len;
+		if (rec.flags & ILI9341_REC_REPEAT)
+		{
+			if (emu_repeat(e, buf, rec.len, rec.flags & ILI9341_REC_DATA_16B) < 0)     return -1;
+		}
+		else if (rec.len)   emu_data(e, buf, rec.len, rec.flags & ILI9341_REC_DATA_16B);
+		delay_ms += rec.delay_ms;
+		if (delay_ms > ILI9341_STREAM_MAX_DELAY_MS)		return -1;
+		e->stats.busy_ns += rec.delay_ms * 1000000ULL;
+		buf += data_len;
+		len -= params_len + data_len;
+	}
+
+	return len ? -1 : 0;
+}
+
+static void emu_sleep(uint64_t ns)
+{
+	struct timespec ts = { (time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL) };
+
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+static uint64_t emu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * TE output of a panel refreshing at exactly te_hz, on the real clock so
+ * frame pacing can be tested without hardware. The scan position is not
+ * modelled against the writes, only when each frame starts.
+ */
+static int emu_wait_vsync(lcd_transport_t *t, struct ili9341_event *ev, int timeout_ms)
+{
+	lcd_emu_t *e = t->priv;
+	uint64_t frame_ns, now, seq, edge;
+
+	if (e->cfg.te_hz == 0 || !e->te_on)
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	frame_ns = 1000000000ULL / e->cfg.te_hz;
+	now = emu_now();
+	seq = (now - e->te_start) / frame_ns + 1;
+	edge = e->te_start + seq * frame_ns;
+	if (timeout_ms >= 0 && edge - now > (uint64_t)timeout_ms * 1000000ULL)
+	{
+		emu_sleep((uint64_t)timeout_ms * 1000000ULL);
+		return 0;
+	}
+
+	emu_sleep(edge - now);
+	ev->type = ILI9341_EVENT_VSYNC;
+	ev->sequence = (uint32_t)seq;
+	ev->timestamp_ns = edge;
+	return 1;
+}
+
+static ssize_t emu_writev(lcd_transport_t *t, const struct iovec *iov, int iovcnt)
+{
+	lcd_emu_t *e = t->priv;
+	uint64_t busy = e->stats.busy_ns;
+	size_t size = 0;
+	uint8_t *buf, *p;
+	uint8_t mode;
+	int ret = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+	{
+		size += iov[i].iov_len;
+	}
+	if (size < 2)
+	{
+		return size;
+	}
+
+	buf = malloc(size);
+	if (buf == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	for (int i = 0, off = 0; i < iovcnt; off += iov[i].iov_len, i++)
+	{
+		memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+	}
+
+	e->stats.writes++;
+	mode = buf[0];
+	p = buf + 1;
+	if (mode & SPI_SEND_STREAM)                 ret = emu_stream(e, p, size - 1);
+	else if ((mode & 1) == SPI_SEND_CMD)        emu_cmd(e, p[0]);
+	else                                        emu_data(e, p, size - 1, mode & FRAME_16_B);
+	free(buf);
+
+	if (e->cfg.realtime)
+	{
+		emu_sleep(e->stats.busy_ns - busy);
+	}
+
+	if (ret < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return size;
+}
+
+/*
+ * A queued write changes GRAM at once but is only complete once the bus time
+ * of everything queued before it and its own has passed, so rendering can
+ * overlap the transfer like it does with the driver's queue.
+ */
+static ssize_t emu_writev_async(lcd_transport_t *t, const struct iovec *iov, int iovcnt)
+{
+	lcd_emu_t *e = t->priv;
+	uint64_t busy = e->stats.busy_ns;
+	uint64_t start = emu_now();
+	uint64_t last;
+	uint8_t realtime = e->cfg.realtime;
+	ssize_t ret;
+
+	if (e->queued >= ILI9341_QUEUE_DEPTH)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	e->cfg.realtime = 0;
+	ret = emu_writev(t, iov, iovcnt);
+	e->cfg.realtime = realtime;
+	if (ret < 0)
+	{
+		return ret;
+	}
+
+	if (e->queued)
+	{
+		last = e->queue_end[(e->queue_head + e->queued - 1) % ILI9341_QUEUE_DEPTH];
+		if (last > start)		start = last;
+	}
+	e->queue_end[(e->queue_head + e->queued) % ILI9341_QUEUE_DEPTH] =
+		start + (realtime ? e->stats.busy_ns - busy : 0);
+	e->queued++;
+	return ret;
+}
+
+static int emu_wait_async(lcd_transport_t *t, int timeout_ms)
+{
+	lcd_emu_t *e = t->priv;
+	uint64_t now = emu_now();
+	uint64_t end;
+	int done = 0;
+
+	if (e->queued == 0)
+	{
+		return 0;
+	}
+
+	end = e->queue_end[e->queue_head];
+	if (end > now && timeout_ms != 0)
+	{
+		if (timeout_ms > 0 && end - now > (uint64_t)timeout_ms * 1000000ULL)
+		{
+			emu_sleep((uint64_t)timeout_ms * 1000000ULL);
+			return 0;
+		}
+		emu_sleep(end - now);
+		now = end;
+	}
+
+	while (e->queued && e->queue_end[e->queue_head] <= now)
+	{
+		e->queue_head = (e->queue_head + 1) % ILI9341_QUEUE_DEPTH;
+		e->queued--;
+		done++;
+	}
+	return done;
+}
+
+/*CASET, RASET and RAMWR of a window, as the driver's ioctls send them*/
+static void emu_window(lcd_emu_t *e, uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2)
+{
+	uint8_t params[4];
+
+	emu_cmd(e, ILI9341_CASET);
+	params[0] = x1 >> 8;  params[1] = x1 & 0xFF;
+	params[2] = x2 >> 8;  params[3] = x2 & 0xFF;
+	emu_params(e, params, 4);
+	emu_cmd(e, ILI9341_RASET);
+	params[0] = y1 >> 8;  params[1] = y1 & 0xFF;
+	params[2] = y2 >> 8;  params[3] = y2 & 0xFF;
+	emu_params(e, params, 4);
+	emu_cmd(e, ILI9341_GRAM);
+}
+
+/*Inside panel memory in either orientation, as ili9341_window_valid() in the driver*/
+static int emu_window_valid(uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2)
+{
+	if (x2 < x1 || y2 < y1)		return 0;
+	return (x2 < ILI9341_FB_WIDTH && y2 < ILI9341_FB_HEIGHT) ||
+		   (x2 < ILI9341_FB_HEIGHT && y2 < ILI9341_FB_WIDTH);
+}
+
+static int emu_flush_rect(lcd_emu_t *e, const struct ili9341_flush_rect *rect)
+{
+	uint32_t row_bytes, rows;
+	const uint8_t *src;
+
+	if (e->fb == NULL || !emu_window_valid(rect->x1, rect->x2, rect->y1, rect->y2) ||
+		(rect->flags & ~ILI9341_REC_DATA_16B))
+	{
+		return -1;
+	}
+	row_bytes = (rect->x2 - rect->x1 + 1U) * 2U;
+	rows = rect->y2 - rect->y1 + 1U;
+	if (rect->stride < row_bytes || rect->stride > ILI9341_FB_SIZE || rect->offset > ILI9341_FB_SIZE ||
+		(uint64_t)(rows - 1U) * rect->stride + row_bytes > ILI9341_FB_SIZE - rect->offset)
+	{
+		return -1;
+	}
+
+	emu_window(e, rect->x1, rect->x2, rect->y1, rect->y2);
+
+	src = e->fb + rect->offset;
+	if (rect->stride == row_bytes)
+	{
+		emu_data(e, src, row_bytes * rows, rect->flags & ILI9341_REC_DATA_16B);
+		return 0;
+	}
+	while (rows--)
+	{
+		emu_data(e, src, row_bytes, rect->flags & ILI9341_REC_DATA_16B);
+		src += rect->stride;
+	}
+	return 0;
+}
+
+/*ILI9341_IOC_FILL_RECT and ILI9341_IOC_PATTERN_RECT, through the repeat record path*/
+static int emu_fill_window(lcd_emu_t *e, uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2,
+						   const uint8_t *pattern, uint32_t len, uint32_t count, uint32_t flags)
+{
+	uint8_t payload[sizeof(uint32_t) + ILI9341_REPEAT_MAX_PATTERN];
+	int frame_16b = flags & ILI9341_REC_DATA_16B;
+
+	if (!emu_window_valid(x1, x2, y1, y2) || (flags & ~ILI9341_REC_DATA_16B) ||
+		!len || len > ILI9341_REPEAT_MAX_PATTERN || (frame_16b && (len & 1)) ||
+		(uint64_t)len * count > (uint64_t)(x2 - x1 + 1U) * (y2 - y1 + 1U) * 2U)
+	{
+		return -1;
+	}
+
+	memcpy(payload, &count, sizeof(count));
+	memcpy(payload + sizeof(count), pattern, len);
+	emu_window(e, x1, x2, y1, y2);
+	return emu_repeat(e, payload, sizeof(count) + len, frame_16b);
+}
+
+/*Status reads the library relies on, answered from the modelled state*/
+static int emu_read_reg(lcd_emu_t *e, struct ili9341_read_reg *reg)
+{
+	uint8_t data[4] = { 0 };
+
+	if (reg->len == 0 || reg->len > sizeof(reg->data))
+	{
+		return -1;
+	}
+
+	switch (reg->cmd)
+	{
+	case ILI9341_RDDST:
+		data[0] = e->madctl & 0xFC;
+		data[1] = (uint8_t)((e->pixfmt & 0x07) << 4) | (e->sleep_out ? 0x02 : 0) | 0x01;
+		data[2] = (e->display_on ? 0x04 : 0) | (e->te_on ? 0x02 : 0);
+		break;
+	case ILI9341_RDDPM:
+		data[0] = ILI9341_DPM_NORON | (e->sleep_out ? ILI9341_DPM_BSTON | ILI9341_DPM_SLPOUT : 0) |
+				  (e->display_on ? ILI9341_DPM_DISON : 0);
+		break;
+	case ILI9341_RDDMADCTL:
+		data[0] = e->madctl;
+		break;
+	case ILI9341_RDDCOLMOD:
+		data[0] = e->pixfmt;
+		break;
+	default:
+		return -1;
+	}
+
+	e->stats.cmds++;
+	emu_charge(e, 1, e->cfg.cmd_hz);
+	emu_charge(e, reg->len, (e->cfg.cmd_hz < EMU_READ_HZ) ? e->cfg.cmd_hz : EMU_READ_HZ);
+	memcpy(reg->data, data, reg->len);
+	return 0;
+}
+
+static int emu_ioctl(lcd_transport_t *t, unsigned long request, void *arg)
+{
+	lcd_emu_t *e = t->priv;
+	uint64_t busy = e->stats.busy_ns;
+	int ret;
+
+	switch (request)
+	{
+	case ILI9341_IOC_FLUSH_RECT:
+		e->stats.writes++;
+		ret = emu_flush_rect(e, arg);
+		break;
+	case ILI9341_IOC_READ_REG:
+		e->stats.writes++;
+		ret = emu_read_reg(e, arg);
+		break;
+	case ILI9341_IOC_FILL_RECT:
+	{
+		const struct ili9341_fill_rect *fill = arg;
+
+		e->stats.writes++;
+		ret = emu_fill_window(e, fill->x1, fill->x2, fill->y1, fill->y2, (const uint8_t*)&fill->color,
+							  sizeof(fill->color), (fill->x2 - fill->x1 + 1U) * (fill->y2 - fill->y1 + 1U), fill->flags);
+		break;
+	}
+	case ILI9341_IOC_PATTERN_RECT:
+	{
+		const struct ili9341_pattern_rect *pat = arg;
+
+		e->stats.writes++;
+		ret = emu_fill_window(e, pat->x1, pat->x2, pat->y1, pat->y2, pat->pattern, pat->len, pat->count, pat->flags);
+		break;
+	}
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+
+	if (e->cfg.realtime)
+	{
+		emu_sleep(e->stats.busy_ns - busy);
+	}
+	if (ret < 0)
+	{
+		errno = EINVAL;
+	}
+	return ret;
+}
+
+static void *emu_map_fb(lcd_transport_t *t)
+{
+	lcd_emu_t *e = t->priv;
+
+	if (e->fb == NULL)
+	{
+		e->fb = aligned_alloc(4096, ILI9341_FB_SIZE);
+	}
+	return e->fb;
+}
+
+static void emu_unmap_fb(lcd_transport_t *t, void *fb)
+{
+	lcd_emu_t *e = t->priv;
+
+	(void)fb;
+	free(e->fb);
+	e->fb = NULL;
+}
+
+static void emu_destroy(lcd_transport_t *t)
+{
+	lcd_emu_t *e = t->priv;
+
+	free(e->fb);
+	free(e);
+	free(t);
+}
+
+static const lcd_transport_ops_t emu_ops = {
+	.name = "emu",
+	.writev = emu_writev,
+	.ioctl = emu_ioctl,
+	.map_fb = emu_map_fb,
+	.unmap_fb = emu_unmap_fb,
+	.wait_vsync = emu_wait_vsync,
+	.writev_async = emu_writev_async,
+	.wait_async = emu_wait_async,
+	.destroy = emu_destroy,
+};
+
+lcd_transport_t *lcd_emu_create(const lcd_emu_config_t *cfg)
+{
+	lcd_transport_t *t = calloc(1, sizeof(*t));
+	lcd_emu_t *e = calloc(1, sizeof(*e));
+
+	if (t == NULL || e == NULL)
+	{
+		free(t);
+		free(e);
+		return NULL;
+	}
+
+	e->cfg.spi_hz = LCD_EMU_DEFAULT_SPI_HZ;
+	e->cfg.xfer_ns = LCD_EMU_DEFAULT_XFER_NS;
+	if (cfg != NULL)
+	{
+		e->cfg = *cfg;
+		if (e->cfg.spi_hz == 0)     e->cfg.spi_hz = LCD_EMU_DEFAULT_SPI_HZ;
+	}
+	if (e->cfg.cmd_hz == 0)         e->cfg.cmd_hz = LCD_EMU_DEFAULT_CMD_HZ;
+	if (e->cfg.cmd_hz > e->cfg.spi_hz)  e->cfg.cmd_hz = e->cfg.spi_hz;
+
+	e->te_start = emu_now();
+
+	/*Power-on state equals the state after a software reset*/
+	emu_cmd(e, ILI9341_SWRESET);
+	memset(&e->stats, 0, sizeof(e->stats));
+
+	t->ops = &emu_ops;
+	t->fd = -1;
+	t->priv = e;
+	return t;
+}
+
+/*Raw GRAM, EMU_W x EMU_H in panel order*/
+const uint16_t *lcd_emu_gram(lcd_transport_t *t)
+{
+	return ((lcd_emu_t*)t->priv)->gram;
+}
+
+/*
+ * Displayed image in the current orientation (EMU_H x EMU_W when MADCTL_MV
+ * is set), with the vertical scroll applied to the scanned-out GRAM lines
+ */
+void lcd_emu_snapshot(lcd_transport_t *t, uint16_t *out)
+{
+	lcd_emu_t *e = t->priv;
+	uint32_t w = (e->madctl & MADCTL_MV) ? EMU_H : EMU_W;
+	uint32_t h = (e->madctl & MADCTL_MV) ? EMU_W : EMU_H;
+	uint32_t vsa = (e->tfa + e->vsa <= EMU_H) ? e->vsa : EMU_H - e->tfa;
+	uint32_t x, y;
+
+	for (uint32_t page = 0; page < h; page++)
+	{
+		for (uint32_t col = 0; col < w; col++)
+		{
+			emu_map(e, col, page, &x, &y);
+			if (vsa && y >= e->tfa && y < e->tfa + vsa)
+			{
+				y = e->tfa + (y - e->tfa + (e->vsp >= e->tfa ? e->vsp - e->tfa : 0)) % vsa;
+			}
+			out[page * w + col] = e->gram[y * EMU_W + x];
+		}
+	}
+}
+
+void lcd_emu_get_stats(lcd_transport_t *t, lcd_emu_stats_t *stats)
+{
+	*stats = ((lcd_emu_t*)t->priv)->stats;
+}
+
+void lcd_emu_reset_stats(lcd_transport_t *t)
+{
+	memset(&((lcd_emu_t*)t->priv)->stats, 0, sizeof(lcd_emu_stats_t));
+}
@@ -0,0 +1,556 @@
+/*
+ * ili9341_spidev.c
+ *
+ * Backend for a panel on a stock spidev node, with DC on a line of the GPIO
+ * character device, so no ili9341 module is needed. Writes are decoded like
+ * the driver does, and the bytes of each DC phase are sent straight from the
+ * caller's buffers as the transfers of one SPI_IOC_MESSAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <linux/gpio.h>
+
+#include "ili9341.h"
+#include "ili9341_transport.h"
+
+/*Transfers batched into one SPI_IOC_MESSAGE*/
+#define SPIDEV_MAX_XFERS            64U
+/*spidev's bufsiz module parameter, the most bytes one message may carry*/
+#define SPIDEV_BUFSIZ_PATH          "/sys/module/spidev/parameters/bufsiz"
+#define SPIDEV_DEFAULT_BUFSIZ       4096U
+/*Pattern buffer of ILI9341_REC_REPEAT records, each transfer sends it once*/
+#define SPIDEV_FILL_BUF_SIZE        4096U
+/*Register reads need a slower clock than writes*/
+#define SPIDEV_READ_SPEED_HZ        6000000U
+#define SPIDEV_DC_CONSUMER          "ili9341-dc"
+
+typedef struct{
+	int spi_fd;
+	int dc_fd;              /*Line request of the DC GPIO*/
+	int dc;                 /*Level DC was last set to*/
+	uint32_t speed_hz;
+	uint32_t bufsiz;
+	/*Message being built, all of it at level msg_dc*/
+	struct spi_ioc_transfer xfer[SPIDEV_MAX_XFERS];
+	uint8_t cmd[SPIDEV_MAX_XFERS];  /*Command bytes, one per transfer slot*/
+	uint32_t nxfers;
+	uint32_t nbytes;
+	int msg_dc;
+	uint8_t fill[SPIDEV_FILL_BUF_SIZE];
+}lcd_spidev_t;
+
+/*Walks a write's iovecs so payloads can be sent in place*/
+typedef struct{
+	const struct iovec *iov;
+	int iovcnt;
+	int idx;
+	size_t off;
+	size_t left;
+}spidev_cursor_t;
+
+static int spidev_set_dc(lcd_spidev_t *s, int level)
+{
+	struct gpio_v2_line_values values = { .bits = (uint64_t)level, .mask = 1 };
+
+	if (s->dc == level)
+	{
+		return 0;
+	}
+	if (ioctl(s->dc_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0)
+	{
+		return -1;
+	}
+	s->dc = level;
+	return 0;
+}
+
+/*Send the message built so far*/
+static int spidev_flush(lcd_transport_t *t)
+{
+	lcd_spidev_t *s = t->priv;
+	int ret;
+
+	if (s->nxfers == 0)
+	{
+		return 0;
+	}
+
+	ret = spidev_set_dc(s, s->msg_dc);
+	if (ret == 0)
+	{
+		ret = ioctl(s->spi_fd, SPI_IOC_MESSAGE(s->nxfers), s->xfer);
+	}
+	s->nxfers = 0;
+	s->nbytes = 0;
+	return (ret < 0) ? -1 : 0;
+}
+
+/*
+ * Queue len bytes at DC level dc. buf has to stay untouched until the
+ * message is flushed, which happens before the write returns.
+ */
+static int spidev_queue(lcd_transport_t *t, int dc, const uint8_t *buf, size_t len, uint8_t bits)
+{
+	lcd_spidev_t *s = t->priv;
+
+	if (s->nxfers && s->msg_dc != dc && spidev_flush(t) < 0)
+	{
+		return -1;
+	}
+	s->msg_dc = dc;
+
+	while (len)
+	{
+		size_t chunk = len;
+		struct spi_ioc_transfer *x;
+
+		if (s->nxfers == SPIDEV_MAX_XFERS || s->nbytes == s->bufsiz)
+		{
+			if (spidev_flush(t) < 0)	return -1;
+		}
+		if (chunk > s->bufsiz - s->nbytes)
+		{
+			chunk = (s->bufsiz - s->nbytes) & ~1U;
+			if (chunk == 0)
+			{
+				if (spidev_flush(t) < 0)	return -1;
+				continue;
+			}
+		}
+
+		x = &s->xfer[s->nxfers++];
+		memset(x, 0, sizeof(*x));
+		x->tx_buf = (uintptr_t)buf;
+		x->len = chunk;
+		x->speed_hz = s->speed_hz;
+		x->bits_per_word = bits;
+		s->nbytes += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int spidev_queue_cmd(lcd_transport_t *t, uint8_t cmd)
+{
+	lcd_spidev_t *s = t->priv;
+
+	if (s->nxfers && (s->msg_dc != 0 || s->nxfers == SPIDEV_MAX_XFERS || s->nbytes == s->bufsiz))
+	{
+		if (spidev_flush(t) < 0)	return -1;
+	}
+	/*The slot the command is queued into owns its byte*/
+	s->cmd[s->nxfers] = cmd;
+	return spidev_queue(t, 0, &s->cmd[s->nxfers], 1, 8);
+}
+
+static int cursor_copy(spidev_cursor_t *c, void *dst, size_t len)
+{
+	uint8_t *p = dst;
+
+	if (len > c->left)
+	{
+		return -1;
+	}
+	c->left -= len;
+	while (len)
+	{
+		size_t n = c->iov[c->idx].iov_len - c->off;
+
+		if (n > len)	n = len;
+		memcpy(p, (const uint8_t*)c->iov[c->idx].iov_base + c->off, n);
+		p += n;
+		len -= n;
+		c->off += n;
+		if (c->off == c->iov[c->idx].iov_len)
+		{
+			c->idx++;
+			c->off = 0;
+		}
+	}
+	return 0;
+}
+
+static int cursor_skip(spidev_cursor_t *c, size_t len)
+{
+	if (len > c->left)
+	{
+		return -1;
+	}
+	c->left -= len;
+	while (len)
+	{
+		size_t n = c->iov[c->idx].iov_len - c->off;
+
+		if (n > len)	n = len;
+		len -= n;
+		c->off += n;
+		if (c->off == c->iov[c->idx].iov_len)
+		{
+			c->idx++;
+			c->off = 0;
+		}
+	}
+	return 0;
+}
+
+/*Queue the next len bytes as data, one transfer per iovec they span*/
+static int cursor_send(lcd_transport_t *t, spidev_cursor_t *c, size_t len, uint8_t bits)
+{
+	if (len > c->left)
+	{
+		return -1;
+	}
+	c->left -= len;
+	while (len)
+	{
+		size_t n = c->iov[c->idx].iov_len - c->off;
+
+		if (n > len)	n = len;
+		if (spidev_queue(t, 1, (const uint8_t*)c->iov[c->idx].iov_base + c->off, n, bits) < 0)
+		{
+			return -1;
+		}
+		len -= n;
+		c->off += n;
+		if (c->off == c->iov[c->idx].iov_len)
+		{
+			c->idx++;
+			c->off = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * ILI9341_REC_REPEAT payload: the pattern is replicated into the fill buffer
+ * once and every transfer points at it, so a message carries up to bufsiz
+ * bytes of the fill.
+ */
+static int spidev_repeat(lcd_transport_t *t, spidev_cursor_t *c, uint32_t len, uint8_t bits)
+{
+	lcd_spidev_t *s = t->priv;
+	uint8_t payload[sizeof(uint32_t) + ILI9341_REPEAT_MAX_PATTERN];
+	uint32_t count, plen;
+	uint64_t remaining;
+	size_t chunk;
+
+	if (len < sizeof(count) || len > sizeof(payload) || cursor_copy(c, payload, len) < 0)
+	{
+		return -1;
+	}
+	memcpy(&count, payload, sizeof(count));
+	plen = len - sizeof(count);
+	remaining = (uint64_t)plen * count;
+	if (!plen || (bits == 16 && (plen & 1)) || remaining > ILI9341_FB_SIZE)
+	{
+		return -1;
+	}
+
+	/*The fill buffer may still be queued from an earlier record*/
+	if (spidev_flush(t) < 0)
+	{
+		return -1;
+	}
+
+	chunk = (sizeof(s->fill) / plen) * plen;
+	if (chunk > remaining)		chunk = remaining;
+	for (size_t i = 0; i < chunk; i += plen)
+	{
+		memcpy(s->fill + i, payload + sizeof(count), plen);
+	}
+
+	while (remaining)
+	{
+		if (chunk > remaining)	chunk = remaining;
+		if (spidev_queue(t, 1, s->fill, chunk, bits) < 0)	return -1;
+		remaining -= chunk;
+	}
+	return 0;
+}
+
+/*Same record walk and validation as ili9341_exec_stream() in the driver*/
+static int spidev_stream(lcd_transport_t *t, spidev_cursor_t *c)
+{
+	struct ili9341_rec_hdr rec;
+	size_t params_len, data_len;
+	unsigned int delay_ms = 0;
+	uint8_t bits;
+
+	while (c->left >= sizeof(rec))
+	{
+		cursor_copy(c, &rec, sizeof(rec));
+
+		if (rec.nparams > ILI9341_REC_MAX_PARAMS || rec.len > ILI9341_REC_MAX_LEN)
+		{
+			return -1;
+		}
+		params_len = ILI9341_REC_ALIGN((size_t)rec.nparams);
+		data_len = ILI9341_REC_ALIGN((size_t)rec.len);
+		if (params_len + data_len > c->left)
+		{
+			return -1;
+		}
+		bits = (rec.flags & ILI9341_REC_DATA_16B) ? 16 : 8;
+
+		if (!(rec.flags & ILI9341_REC_NO_CMD))
+		{
+			if (spidev_queue_cmd(t, rec.cmd) < 0)						return -1;
+		}
+		if (cursor_send(t, c, rec.nparams, 8) < 0)						return -1;
+		cursor_skip(c, params_len - rec.nparams);
+		if (rec.flags & ILI9341_REC_REPEAT)
+		{
+			if (spidev_repeat(t, c, rec.len, bits) < 0)					return -1;
+		}
+		else if (cursor_send(t, c, rec.len, bits) < 0)					return -1;
+		cursor_skip(c, data_len - rec.len);
+
+		if (rec.delay_ms)
+		{
+			delay_ms += rec.delay_ms;
+			if (delay_ms > ILI9341_STREAM_MAX_DELAY_MS)					return -1;
+			if (spidev_flush(t) < 0)									return -1;
+			usleep(rec.delay_ms * 1000U);
+		}
+	}
+
+	return c->left ? -1 : 0;
+}
+
+static ssize_t spidev_writev(lcd_transport_t *t, const struct iovec *iov, int iovcnt)
+{
+	spidev_cursor_t c = { iov, iovcnt, 0, 0, 0 };
+	size_t size = 0;
+	uint8_t mode, cmd;
+	int ret;
+
+	for (int i = 0; i < iovcnt; i++)
+	{
+		size += iov[i].iov_len;
+	}
+	if (size < 2)
+	{
+		return size;
+	}
+
+	c.left = size;
+
+	cursor_copy(&c, &mode, 1);
+	if (mode & SPI_SEND_STREAM)
+	{
+		ret = spidev_stream(t, &c);
+	}
+	else if ((mode & 1) == SPI_SEND_CMD)
+	{
+		cursor_copy(&c, &cmd, 1);
+		ret = spidev_queue_cmd(t, cmd);
+		c.left = 0;
+	}
+	else
+	{
+		ret = cursor_send(t, &c, c.left, (mode & FRAME_16_B) ? 16 : 8);
+	}
+
+	/*Nothing may stay queued once the caller gets its buffers back*/
+	if (spidev_flush(t) < 0 || ret < 0)
+	{
+		((lcd_spidev_t*)t->priv)->nxfers = 0;
+		if (ret < 0)	errno = EINVAL;
+		return -1;
+	}
+	return size;
+}
+
+/*Command with DC low, then the reply clocked in slowly, like ili9341_read_reg()*/
+static int spidev_read_reg(lcd_transport_t *t, struct ili9341_read_reg *reg)
+{
+	lcd_spidev_t *s = t->priv;
+	int dummy = (reg->cmd == ILI9341_READ_DISPLAY_ID || reg->cmd == ILI9341_RDDST);
+	uint8_t rx[sizeof(reg->data) + 1];
+	struct spi_ioc_transfer xfer[2];
+
+	if (reg->len == 0 || reg->len > sizeof(reg->data))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(xfer, 0, sizeof(xfer));
+	xfer[0].tx_buf = (uintptr_t)&reg->cmd;
+	xfer[0].len = 1;
+	xfer[0].speed_hz = s->speed_hz;
+	xfer[0].bits_per_word = 8;
+	xfer[1].rx_buf = (uintptr_t)rx;
+	xfer[1].len = reg->len + dummy;
+	xfer[1].speed_hz = (s->speed_hz < SPIDEV_READ_SPEED_HZ) ? s->speed_hz : SPIDEV_READ_SPEED_HZ;
+	xfer[1].bits_per_word = 8;
+
+	if (spidev_set_dc(s, 0) < 0 || ioctl(s->spi_fd, SPI_IOC_MESSAGE(2), xfer) < 0)
+	{
+		return -1;
+	}
+
+	for (int i = 0; i < reg->len; i++)
+	{
+		reg->data[i] = dummy ? (uint8_t)((rx[i] << 1) | (rx[i + 1] >> 7)) : rx[i];
+	}
+	return 0;
+}
+
+static int spidev_ioctl(lcd_transport_t *t, unsigned long request, void *arg)
+{
+	if (request == ILI9341_IOC_READ_REG)
+	{
+		return spidev_read_reg(t, arg);
+	}
+	errno = ENOTTY;
+	return -1;
+}
+
+static void *spidev_map_fb(lcd_transport_t *t)
+{
+	(void)t;
+	return NULL;
+}
+
+static void spidev_unmap_fb(lcd_transport_t *t, void *fb)
+{
+	(void)t;
+	(void)fb;
+}
+
+static int spidev_wait_vsync(lcd_transport_t *t, struct ili9341_event *ev, int timeout_ms)
+{
+	(void)t;
+	(void)ev;
+	(void)timeout_ms;
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+static void spidev_destroy(lcd_transport_t *t)
+{
+	lcd_spidev_t *s = t->priv;
+
+	close(s->dc_fd);
+	close(s->spi_fd);
+	free(s);
+	free(t);
+}
+
+static const lcd_transport_ops_t spidev_ops = {
+	.name = "spidev",
+	.writev = spidev_writev,
+	.ioctl = spidev_ioctl,
+	.map_fb = spidev_map_fb,
+	.unmap_fb = spidev_unmap_fb,
+	.wait_vsync = spidev_wait_vsync,
+	.destroy = spidev_destroy,
+};
+
+static uint32_t spidev_bufsiz(void)
+{
+	FILE *f = fopen(SPIDEV_BUFSIZ_PATH, "r");
+	unsigned long bufsiz = 0;
+
+	if (f != NULL)
+	{
+		if (fscanf(f, "%lu", &bufsiz) != 1)		bufsiz = 0;
+		fclose(f);
+	}
+	return (bufsiz >= 2 && bufsiz <= UINT32_MAX) ? (uint32_t)bufsiz : SPIDEV_DEFAULT_BUFSIZ;
+}
+
+/*Request line dc_line of gpiochip as an output, driven high (data) until the first command*/
+static int spidev_request_dc(const char *gpiochip, uint32_t dc_line)
+{
+	struct gpio_v2_line_request req;
+	int chip, ret;
+
+	chip = open(gpiochip, O_RDWR | O_CLOEXEC);
+	if (chip < 0)
+	{
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = dc_line;
+	req.num_lines = 1;
+	strncpy(req.consumer, SPIDEV_DC_CONSUMER, sizeof(req.consumer) - 1);
+	req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	req.config.num_attrs = 1;
+	req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	req.config.attrs[0].attr.values = 1;
+	req.config.attrs[0].mask = 1;
+
+	ret = ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req);
+	close(chip);
+	return (ret < 0) ? -1 : req.fd;
+}
+
+/*
+ * spidev: SPI device node, e.g. /dev/spidev0.0
+ * gpiochip, dc_line: GPIO character device and line offset of the DC pin
+ * speed_hz: SPI clock of the writes
+ */
+lcd_transport_t *lcd_spidev_transport_create(const char *spidev, const char *gpiochip,
+                                             uint32_t dc_line, uint32_t speed_hz)
+{
+	lcd_transport_t *t = calloc(1, sizeof(*t));
+	lcd_spidev_t *s = calloc(1, sizeof(*s));
+	uint8_t mode = SPI_MODE_0, bits = 8;
+	int err;
+
+	if (t == NULL || s == NULL)
+	{
+		free(t);
+		free(s);
+		return NULL;
+	}
+
+	s->spi_fd = open(spidev, O_RDWR | O_CLOEXEC);
+	if (s->spi_fd < 0)
+	{
+		free(t);
+		free(s);
+		return NULL;
+	}
+	if (ioctl(s->spi_fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+		ioctl(s->spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+		ioctl(s->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0)
+	{
+		goto err_spi;
+	}
+
+	s->dc_fd = spidev_request_dc(gpiochip, dc_line);
+	if (s->dc_fd < 0)
+	{
+		goto err_spi;
+	}
+	s->dc = 1;
+	s->speed_hz = speed_hz;
+	s->bufsiz = spidev_bufsiz();
+
+	t->ops = &spidev_ops;
+	/*Writes are decoded here, spidev would take them as raw bytes*/
+	t->fd = -1;
+	t->priv = s;
+	return t;
+
+err_spi:
+	err = errno;
+	close(s->spi_fd);
+	free(t);
+	free(s);
+	errno = err;
+	return NULL;
+}
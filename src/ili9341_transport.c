@@ -0,0 +1,346 @@
+/*
+ * ili9341_transport.c
+ *
+ * Chardev and record-to-file backends, and backend selection by name.
+ * The spidev backend lives in ili9341_spidev.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "ili9341_user_lib.h"
+#include "ili9341_transport.h"
+#include "ili9341_emu.h"
+
+/* /dev/ili9341 */
+
+typedef struct{
+	int fd;             /*Second descriptor, O_NONBLOCK, carrying the queued writes*/
+	uint32_t done;      /*Its completed writes already reported*/
+	int no_te;          /*The panel has no TE line, found out at open*/
+}chardev_async_t;
+
+static ssize_t chardev_writev(lcd_transport_t *t, const struct iovec *iov, int iovcnt)
+{
+	return writev(t->fd, iov, iovcnt);
+}
+
+static int chardev_ioctl(lcd_transport_t *t, unsigned long request, void *arg)
+{
+	return ioctl(t->fd, request, arg);
+}
+
+static void *chardev_map_fb(lcd_transport_t *t)
+{
+	void *fb = mmap(NULL, ILI9341_FB_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+
+	return (fb == MAP_FAILED) ? NULL : fb;
+}
+
+static void chardev_unmap_fb(lcd_transport_t *t, void *fb)
+{
+	(void)t;
+	munmap(fb, ILI9341_FB_SIZE);
+}
+
+static int chardev_wait_vsync(lcd_transport_t *t, struct ili9341_event *ev, int timeout_ms)
+{
+	chardev_async_t *a = t->priv;
+	struct pollfd pfd = { t->fd, POLLIN, 0 };
+	int ret;
+
+	/*poll() would only time out*/
+	if (a->no_te)
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	/*An edge from before the call is already history*/
+	while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+	{
+		if (read(t->fd, ev, sizeof(*ev)) != sizeof(*ev))	return -1;
+	}
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret <= 0)
+	{
+		return ret;
+	}
+	return (read(t->fd, ev, sizeof(*ev)) == sizeof(*ev)) ? 1 : -1;
+}
+
+/*
+ * Queued writes go through their own file, so their completions never mix
+ * with the TE events lcd_wait_vsync() reads. Blocking writes on t->fd wait
+ * for them in the driver, which keeps both in submission order.
+ */
+static ssize_t chardev_writev_async(lcd_transport_t *t, const struct iovec *iov, int iovcnt)
+{
+	chardev_async_t *a = t->priv;
+
+	return writev(a->fd, iov, iovcnt);
+}
+
+static int chardev_wait_async(lcd_transport_t *t, int timeout_ms)
+{
+	chardev_async_t *a = t->priv;
+	struct pollfd pfd = { a->fd, POLLIN, 0 };
+	struct ili9341_event ev;
+	uint32_t done;
+	int ret;
+
+	for (;;)
+	{
+		/*Completions are returned before TE edges, which are of no interest here*/
+		while (read(a->fd, &ev, sizeof(ev)) == sizeof(ev))
+		{
+			if (ev.type == ILI9341_EVENT_FLUSH_DONE)
+			{
+				done = ev.sequence - a->done;
+				a->done = ev.sequence;
+				return (int)done;
+			}
+		}
+		if (errno != EAGAIN)
+		{
+			return -1;
+		}
+
+		ret = poll(&pfd, 1, timeout_ms);
+		if (ret <= 0)
+		{
+			return ret;
+		}
+	}
+}
+
+static void chardev_destroy(lcd_transport_t *t)
+{
+	chardev_async_t *a = t->priv;
+
+	close(a->fd);
+	free(a);
+	close(t->fd);
+	free(t);
+}
+
+static const lcd_transport_ops_t chardev_ops = {
+	.name = "chardev",
+	.writev = chardev_writev,
+	.ioctl = chardev_ioctl,
+	.map_fb = chardev_map_fb,
+	.unmap_fb = chardev_unmap_fb,
+	.wait_vsync = chardev_wait_vsync,
+	.writev_async = chardev_writev_async,
+	.wait_async = chardev_wait_async,
+	.destroy = chardev_destroy,
+};
+
+lcd_transport_t *lcd_chardev_transport_create(const char *path)
+{
+	lcd_transport_t *t = calloc(1, sizeof(*t));
+	chardev_async_t *a = calloc(1, sizeof(*a));
+	struct ili9341_event ev;
+
+	if (t == NULL || a == NULL)
+	{
+		free(t);
+		free(a);
+		return NULL;
+	}
+
+	t->fd = open(path, O_RDWR | O_CLOEXEC);
+	a->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (t->fd < 0 || a->fd < 0)
+	{
+		if (t->fd >= 0)		close(t->fd);
+		if (a->fd >= 0)		close(a->fd);
+		free(a);
+		free(t);
+		return NULL;
+	}
+
+	/*Nothing is queued on a->fd yet, so read() only fails with EOPNOTSUPP without TE*/
+	if (read(a->fd, &ev, sizeof(ev)) < 0 && errno == EOPNOTSUPP)
+	{
+		a->no_te = 1;
+	}
+
+	t->ops = &chardev_ops;
+	t->priv = a;
+	return t;
+}
+
+/*
+ * Record to file: every write is stored as a native-endian uint32_t length
+ * followed by the bytes the driver would have received, so a capture keeps
+ * the write boundaries and can be replayed or decoded offline.
+ */
+
+static ssize_t file_writev(lcd_transport_t *t, const struct iovec *iov, int iovcnt)
+{
+	struct iovec rec[LCD_TXN_MAX_IOV + 1];
+	uint32_t len = 0;
+	ssize_t ret;
+
+	if (iovcnt < 0 || (uint32_t)iovcnt > LCD_TXN_MAX_IOV)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < iovcnt; i++)
+	{
+		len += iov[i].iov_len;
+		rec[i + 1] = iov[i];
+	}
+	rec[0].iov_base = &len;
+	rec[0].iov_len = sizeof(len);
+
+	ret = writev((int)(intptr_t)t->priv, rec, iovcnt + 1);
+	return (ret < 0) ? ret : (ssize_t)len;
+}
+
+static int file_ioctl(lcd_transport_t *t, unsigned long request, void *arg)
+{
+	(void)t;
+	(void)request;
+	(void)arg;
+	errno = ENOTTY;
+	return -1;
+}
+
+static void *file_map_fb(lcd_transport_t *t)
+{
+	(void)t;
+	return NULL;
+}
+
+static void file_unmap_fb(lcd_transport_t *t, void *fb)
+{
+	(void)t;
+	(void)fb;
+}
+
+static int file_wait_vsync(lcd_transport_t *t, struct ili9341_event *ev, int timeout_ms)
+{
+	(void)t;
+	(void)ev;
+	(void)timeout_ms;
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+static void file_destroy(lcd_transport_t *t)
+{
+	close((int)(intptr_t)t->priv);
+	free(t);
+}
+
+static const lcd_transport_ops_t file_ops = {
+	.name = "file",
+	.writev = file_writev,
+	.ioctl = file_ioctl,
+	.map_fb = file_map_fb,
+	.unmap_fb = file_unmap_fb,
+	.wait_vsync = file_wait_vsync,
+	.destroy = file_destroy,
+};
+
+lcd_transport_t *lcd_file_transport_create(const char *path)
+{
+	lcd_transport_t *t = calloc(1, sizeof(*t));
+	int fd;
+
+	if (t == NULL)
+	{
+		return NULL;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		free(t);
+		return NULL;
+	}
+
+	t->ops = &file_ops;
+	/*Writes must go through file_writev to be framed, never straight to fd*/
+	t->fd = -1;
+	t->priv = (void*)(intptr_t)fd;
+	return t;
+}
+
+/*
+ * Create a backend from a spec string:
+ *   NULL, "" or "chardev[:path]"   the kernel driver (default DEVICE_PATH)
+ *   "file:path"                    record every write to path
+ *   "spidev:dev:gpiochip:dc[:hz]"  stock spidev node, DC on line dc of gpiochip,
+ *                                  e.g. "spidev:/dev/spidev0.0:/dev/gpiochip0:25"
+ *   "emu[:spi_hz[:te_hz]]"         in-memory panel emulator, te_hz > 0 adds a TE line
+ */
+lcd_transport_t *lcd_transport_create(const char *spec)
+{
+	const char *arg;
+	lcd_emu_config_t cfg = { LCD_EMU_DEFAULT_SPI_HZ, LCD_EMU_DEFAULT_XFER_NS, 0, 0, LCD_EMU_DEFAULT_CMD_HZ };
+
+	if (spec == NULL || *spec == '\0')
+	{
+		return lcd_chardev_transport_create(DEVICE_PATH);
+	}
+
+	arg = strchr(spec, ':');
+	arg = (arg != NULL) ? arg + 1 : NULL;
+
+	if (strncmp(spec, "chardev", 7) == 0)
+	{
+		return lcd_chardev_transport_create(arg ? arg : DEVICE_PATH);
+	}
+	if (strncmp(spec, "file", 4) == 0 && arg != NULL)
+	{
+		return lcd_file_transport_create(arg);
+	}
+	if (strncmp(spec, "spidev", 6) == 0 && arg != NULL)
+	{
+		char buf[128];
+		char *dev, *chip, *line, *hz;
+
+		snprintf(buf, sizeof(buf), "%s", arg);
+		dev = strtok(buf, ":");
+		chip = strtok(NULL, ":");
+		line = strtok(NULL, ":");
+		hz = strtok(NULL, ":");
+		if (dev != NULL && chip != NULL && line != NULL)
+		{
+			return lcd_spidev_transport_create(dev, chip, strtoul(line, NULL, 0),
+											   hz ? strtoul(hz, NULL, 0) : LCD_SPIDEV_DEFAULT_HZ);
+		}
+	}
+	if (strncmp(spec, "emu", 3) == 0)
+	{
+		if (arg != NULL)	cfg.spi_hz = strtoul(arg, NULL, 0);
+		arg = (arg != NULL) ? strchr(arg, ':') : NULL;
+		if (arg != NULL)	cfg.te_hz = strtoul(arg + 1, NULL, 0);
+		return lcd_emu_create(&cfg);
+	}
+
+	errno = EINVAL;
+	return NULL;
+}
+
+void lcd_transport_destroy(lcd_transport_t *t)
+{
+	if (t != NULL)
+	{
+		t->ops->destroy(t);
+	}
+}
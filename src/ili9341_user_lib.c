@@ -2,215 +2,1333 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 #include "ili9341_user_lib.h"
+#include "ili9341_transport.h"
 #include "ili9341.h"
 
+#if BSP_LCD_USE_IO_URING
+#include <liburing.h>
+#endif
+
 #define HIGH_16(x)     					((((uint16_t)x) >> 8U) & 0xFFU)
 #define LOW_16(x)      					((((uint16_t)x) >> 0U) & 0xFFU)
 
-bsp_lcd_t lcd_handle;
+/* How pixel payloads are stored and sent, see BSP_LCD_PIXEL_SWAP */
+#if BSP_LCD_PIXEL_SWAP
+#define LCD_PIXEL(c)					((uint16_t)(((c) >> 8) | ((c) << 8)))
+#define LCD_PIXEL_FLAGS					0U
+#define LCD_PIXEL_MODE					FRAME_8_B
+#else
+#define LCD_PIXEL(c)					(c)
+#define LCD_PIXEL_FLAGS					ILI9341_REC_DATA_16B
+#define LCD_PIXEL_MODE					FRAME_16_B
+#endif
+
+bsp_lcd_t lcd_handle = { .transport = NULL, .fb = NULL, .uring = NULL,
+						  .db_count = BSP_LCD_DB_COUNT, .db_size = BSP_LCD_DB_SIZE };
 bsp_lcd_t *hlcd = &lcd_handle;
 
-#define DB_SIZE 					(10UL * 1024UL)
-uint8_t bsp_db[DB_SIZE];
-uint8_t bsp_wb[DB_SIZE];
+/*Room in front of each draw buffer for the stream prefix of an async flush*/
+#define DB_HDR_SIZE					40UL
+
+#if BSP_LCD_USE_SHADOW_FB
+typedef struct{
+	/*Last content sent to each pixel, indexed by its memory address in the active orientation*/
+	uint16_t fb[ILI9341_FB_WIDTH * ILI9341_FB_HEIGHT];
+	/*Rows whose whole width is known to match the panel*/
+	uint8_t row_valid[ILI9341_FB_HEIGHT];
+}lcd_shadow_t;
+
+/*
+ * Starting a new window costs its CASET/RASET/RAMWR bytes plus six transfers
+ * (command and data phase of each). Unchanged pixels cheaper than that are
+ * sent along instead of splitting the window.
+ */
+#define LCD_DIFF_SPLIT_COST		(BSP_LCD_DIFF_WINDOW_BYTES + 6U * BSP_LCD_DIFF_XFER_BYTES)
+#define LCD_DIFF_MAX_RECTS		(LCD_TXN_MAX_RECS / 3)
+#endif
+
+static int lcd_writev(bsp_lcd_t *lcd, const struct iovec *iov, int iovcnt)
+{
+	if (lcd->transport == NULL)
+	{
+		return -1;
+	}
+
+	return lcd->transport->ops->writev(lcd->transport, iov, iovcnt);
+}
+
+static int spi_write(bsp_lcd_t *lcd, uint8_t MODE, uint8_t *data, uint32_t len)
+{
+    struct iovec iov[2];
+
+    /* Mode byte and payload are gathered by the driver in one write */
+    iov[0].iov_base = &MODE;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+
+    return lcd_writev(lcd, iov, 2);
+}
+
+static const uint8_t rec_pad[4];
 
-static int spi_write(uint8_t MODE, uint8_t *data, uint32_t len)
+void lcd_txn_init(lcd_txn_t *txn)
 {
-    uint8_t data_to_send[len + 1];
-    int fd;
-    int ret;
+	txn->mode = SPI_SEND_STREAM;
+	txn->nrecs = 0;
+	txn->iov[0].iov_base = &txn->mode;
+	txn->iov[0].iov_len = 1;
+	txn->niov = 1;
+}
 
-    data_to_send[0] = MODE;
+static void lcd_txn_push(lcd_txn_t *txn, const void *base, uint32_t len)
+{
+	txn->iov[txn->niov].iov_base = (void*)base;
+	txn->iov[txn->niov].iov_len = len;
+	txn->niov++;
+}
 
-    for (uint32_t i = 0; i < len; i++)
-    {
-        data_to_send[i + 1] = data[i];
-    }
+static void lcd_txn_push_pad(lcd_txn_t *txn, uint32_t len)
+{
+	if (ILI9341_REC_ALIGN(len) != len)
+	{
+		lcd_txn_push(txn, rec_pad, ILI9341_REC_ALIGN(len) - len);
+	}
+}
+
+static struct ili9341_rec_hdr *lcd_txn_new_rec(lcd_txn_t *txn, uint8_t cmd, uint8_t nparams, uint32_t len, uint8_t flags)
+{
+	struct ili9341_rec_hdr *rec = &txn->hdr[txn->nrecs++];
+
+	rec->cmd = cmd;
+	rec->flags = flags;
+	rec->nparams = nparams;
+	rec->delay_ms = 0;
+	rec->len = len;
+	lcd_txn_push(txn, rec, sizeof(*rec));
+	return rec;
+}
+
+/*
+ * Queue one record. Parameters are copied into the transaction, the payload
+ * is only referenced and must stay valid until lcd_txn_submit().
+ */
+int lcd_txn_add(lcd_txn_t *txn, uint8_t cmd, const uint8_t *params, uint8_t nparams, const void *data, uint32_t len, uint8_t flags)
+{
+	struct ili9341_rec_hdr *rec;
+	uint8_t *rec_params;
+
+	if (txn->nrecs >= LCD_TXN_MAX_RECS || nparams > ILI9341_REC_MAX_PARAMS ||
+	    txn->niov + 4 > LCD_TXN_MAX_IOV)
+	{
+		return -1;
+	}
 
-    fd = open(DEVICE_PATH, O_RDWR);
+	rec_params = txn->params[txn->nrecs];
+	rec = lcd_txn_new_rec(txn, cmd, nparams, (data != NULL) ? len : 0, flags);
 
-    ret = write(fd, data_to_send, len + 1);
+	if (nparams)
+	{
+		for (uint32_t i = 0; i < ILI9341_REC_ALIGN(nparams); i++)
+		{
+			rec_params[i] = (i < nparams) ? params[i] : 0;
+		}
+		lcd_txn_push(txn, rec_params, ILI9341_REC_ALIGN(nparams));
+	}
 
-    close(fd);
+	if (rec->len)
+	{
+		lcd_txn_push(txn, data, rec->len);
+		lcd_txn_push_pad(txn, rec->len);
+	}
 
-    return ret;
+	return 0;
 }
 
-int lcd_write_data(uint8_t *data, uint32_t size)
+/*
+ * Queue a record whose payload the driver sends as count copies of pattern
+ * (see ILI9341_REC_REPEAT). pattern must stay valid until lcd_txn_submit().
+ */
+int lcd_txn_add_repeat(lcd_txn_t *txn, uint8_t cmd, const void *pattern, uint32_t len, uint32_t count, uint8_t flags)
 {
-    return spi_write(DATA_MODE, data, size);
+	uint32_t *rec_count;
+
+	if (txn->nrecs >= LCD_TXN_MAX_RECS || len == 0 || len > ILI9341_REPEAT_MAX_PATTERN ||
+	    txn->niov + 4 > LCD_TXN_MAX_IOV)
+	{
+		return -1;
+	}
+
+	rec_count = &txn->repeat[txn->nrecs];
+	*rec_count = count;
+	lcd_txn_new_rec(txn, cmd, 0, sizeof(*rec_count) + len, flags | ILI9341_REC_REPEAT);
+	lcd_txn_push(txn, rec_count, sizeof(*rec_count));
+	lcd_txn_push(txn, pattern, len);
+	lcd_txn_push_pad(txn, sizeof(*rec_count) + len);
+
+	return 0;
 }
 
-int lcd_write_cmd(uint8_t cmd)
+/* Number of rows lcd_txn_add_rows() can still gather into this transaction */
+uint32_t lcd_txn_rows_free(const lcd_txn_t *txn)
 {
-    return spi_write(CMD_MODE, &cmd, 1);
+	if (txn->nrecs >= LCD_TXN_MAX_RECS || txn->niov + 2 >= LCD_TXN_MAX_IOV)
+	{
+		return 0;
+	}
+	return LCD_TXN_MAX_IOV - txn->niov - 2;
 }
 
-void lcd_config(void)
+/*
+ * Queue rows of row_len bytes spaced stride bytes apart as the payload of a
+ * single record. Contiguous rows are referenced as one segment, others are
+ * gathered row by row by the writev() in lcd_txn_submit().
+ */
+int lcd_txn_add_rows(lcd_txn_t *txn, uint8_t cmd, const uint8_t *data, uint32_t row_len, uint32_t rows, uint32_t stride, uint8_t flags)
 {
-	uint8_t params[15];
-	lcd_write_cmd(ILI9341_SWRESET);
-	lcd_write_cmd(ILI9341_POWERB);
-	params[0] = 0x00;
-	params[1] = 0xD9;
-	params[2] = 0x30;
-	lcd_write_data(params, 3);
-
-	lcd_write_cmd(ILI9341_POWER_SEQ);
-	params[0]= 0x64;
-	params[1]= 0x03;
-	params[2]= 0X12;
-	params[3]= 0X81;
-	lcd_write_data(params, 4);
-
-	lcd_write_cmd(ILI9341_DTCA);
-	params[0]= 0x85;
-	params[1]= 0x10;
-	params[2]= 0x7A;
-	lcd_write_data(params, 3);
-
-	lcd_write_cmd(ILI9341_POWERA);
-	params[0]= 0x39;
-	params[1]= 0x2C;
-	params[2]= 0x00;
-	params[3]= 0x34;
-	params[4]= 0x02;
-	lcd_write_data(params, 5);
-
-	lcd_write_cmd(ILI9341_PRC);
-	params[0]= 0x20;
-	lcd_write_data(params, 1);
-
-	lcd_write_cmd(ILI9341_DTCB);
-	params[0]= 0x00;
-	params[1]= 0x00;
-	lcd_write_data(params, 2);
-
-	lcd_write_cmd(ILI9341_POWER1);
-	params[0]= 0x1B;
-	lcd_write_data(params, 1);
-
-	lcd_write_cmd(ILI9341_POWER2);
-	params[0]= 0x12;
-	lcd_write_data(params, 1);
-
-	lcd_write_cmd(ILI9341_VCOM1);
-	params[0]= 0x08;
-	params[1]= 0x26;
-	lcd_write_data(params, 2);
-
-	lcd_write_cmd(ILI9341_VCOM2);
-	params[0]= 0XB7;
-	lcd_write_data(params, 1);
-
-
-	lcd_write_cmd(ILI9341_PIXEL_FORMAT);
-	params[0]= 0x55; //select RGB565
-	lcd_write_data(params, 1);
-
-	lcd_write_cmd(ILI9341_FRMCTR1);
-	params[0]= 0x00;
-	params[1]= 0x1B;//frame rate = 70
-	lcd_write_data(params, 2);
-
-	lcd_write_cmd(ILI9341_DFC);    // Display Function Control
-	params[0]= 0x0A;
-	params[1]= 0xA2;
-	lcd_write_data(params, 2);
-
-	lcd_write_cmd(ILI9341_3GAMMA_EN);    // 3Gamma Function Disable
-	params[0]= 0x02; //LCD_WR_DATA(0x00);
-	lcd_write_data(params, 1);
-
-	lcd_write_cmd(ILI9341_GAMMA);
-	params[0]= 0x01;
-	lcd_write_data(params, 1);
-
-	lcd_write_cmd(ILI9341_PGAMMA);    //Set Gamma
-	params[0]= 0x0F;
-	params[1]= 0x1D;
-	params[2]= 0x1A;
-	params[3]= 0x0A;
-	params[4]= 0x0D;
-	params[5]= 0x07;
-	params[6]= 0x49;
-	params[7]= 0X66;
-	params[8]= 0x3B;
-	params[9]= 0x07;
-	params[10]= 0x11;
-	params[11]= 0x01;
-	params[12]= 0x09;
-	params[13]= 0x05;
-	params[14]= 0x04;
-	lcd_write_data(params, 15);
-
-	lcd_write_cmd(ILI9341_NGAMMA);
-	params[0]= 0x00;
-	params[1]= 0x18;
-	params[2]= 0x1D;
-	params[3]= 0x02;
-	params[4]= 0x0F;
-	params[5]= 0x04;
-	params[6]= 0x36;
-	params[7]= 0x13;
-	params[8]= 0x4C;
-	params[9]= 0x07;
-	params[10]= 0x13;
-	params[11]= 0x0F;
-	params[12]= 0x2E;
-	params[13]= 0x2F;
-	params[14]= 0x05;
-	lcd_write_data(params, 15);
-
-	lcd_write_cmd(ILI9341_SLEEP_OUT); //Exit Sleep
-	delay_50ms();
-	delay_50ms();
-	lcd_write_cmd(ILI9341_DISPLAY_ON); //display on
-}
-
-void lcd_set_display_area(lcd_area_t *area)
+	if (rows == 1 || stride == row_len)
+	{
+		return lcd_txn_add(txn, cmd, NULL, 0, data, row_len * rows, flags);
+	}
+
+	if (rows > lcd_txn_rows_free(txn))
+	{
+		return -1;
+	}
+
+	lcd_txn_new_rec(txn, cmd, 0, row_len * rows, flags);
+	for (uint32_t i = 0; i < rows; i++)
+	{
+		lcd_txn_push(txn, data, row_len);
+		data += stride;
+	}
+	lcd_txn_push_pad(txn, row_len * rows);
+
+	return 0;
+}
+
+int lcd_txn_add_area(lcd_txn_t *txn, const lcd_area_t *area)
 {
 	uint8_t params[4];
+
 	/*Column address set(2Ah) */
 	params[0] = HIGH_16(area->x1);
 	params[1] = LOW_16(area->x1);
 	params[2] = HIGH_16(area->x2);
 	params[3] = LOW_16(area->x2);
-	lcd_write_cmd(ILI9341_CASET);
-	lcd_write_data(params, 4);
+	if (lcd_txn_add(txn, ILI9341_CASET, params, 4, NULL, 0, 0) < 0)		return -1;
+
+	/*Page address set(2Bh) */
+	params[0] = HIGH_16(area->y1);
+	params[1] = LOW_16(area->y1);
+	params[2] = HIGH_16(area->y2);
+	params[3] = LOW_16(area->y2);
+	return lcd_txn_add(txn, ILI9341_RASET, params, 4, NULL, 0, 0);
+}
+
+/* Make the driver wait ms milliseconds after the last queued record */
+int lcd_txn_add_delay(lcd_txn_t *txn, uint8_t ms)
+{
+	if (txn->nrecs == 0)
+	{
+		return -1;
+	}
+
+	txn->hdr[txn->nrecs - 1].delay_ms = ms;
+	return 0;
+}
+
+int lcd_txn_submit(bsp_lcd_t *lcd, lcd_txn_t *txn)
+{
+	int ret = 0;
+
+	if (txn->nrecs)
+	{
+		ret = lcd_writev(lcd, txn->iov, txn->niov);
+	}
+
+	lcd_txn_init(txn);
+	return ret;
+}
+
+int lcd_write_data(bsp_lcd_t *lcd, uint8_t *data, uint32_t size)
+{
+    return spi_write(lcd, DATA_MODE, data, size);
+}
+
+int lcd_write_cmd(bsp_lcd_t *lcd, uint8_t cmd)
+{
+    return spi_write(lcd, CMD_MODE, &cmd, 1);
+}
+
+static const struct ili9341_init_cmd lcd_init_seq[] = ILI9341_INIT_SEQ;
+
+static int lcd_txn_add_scroll(lcd_txn_t *txn, bsp_lcd_t *lcd);
+
+static int lcd_read_reg(bsp_lcd_t *lcd, uint8_t cmd, uint8_t *data, uint8_t len)
+{
+	struct ili9341_read_reg reg = { .cmd = cmd, .len = len };
+
+	if (lcd->transport == NULL || lcd->transport->ops->ioctl(lcd->transport, ILI9341_IOC_READ_REG, &reg) < 0)
+	{
+		return -1;
+	}
+	memcpy(data, reg.data, len);
+	return 0;
+}
+
+/*
+ * The panel kept its setup from the kernel driver or an earlier process:
+ * powered up, awake, displaying in normal mode with 16 bit pixels. A panel
+ * that cannot be read (no MISO, file backend) reads as 0x00 or 0xFF and
+ * always counts as unconfigured.
+ */
+int lcd_is_configured(bsp_lcd_t *lcd)
+{
+	uint8_t dpm, dst[4];
+
+	if (lcd_read_reg(lcd, ILI9341_RDDPM, &dpm, 1) < 0 || lcd_read_reg(lcd, ILI9341_RDDST, dst, 4) < 0)
+	{
+		return 0;
+	}
+
+	return dpm != 0xFF && (dpm & ILI9341_DPM_READY) == ILI9341_DPM_READY &&
+		   ILI9341_DST_PIXFMT(dst) == 0x05 && !(dst[1] & ILI9341_DST_IDLE);
+}
+
+void lcd_config(bsp_lcd_t *lcd)
+{
+	lcd_txn_t txn;
+
+	lcd_txn_init(&txn);
+
+#if BSP_LCD_FAST_BOOT
+	if (lcd_is_configured(lcd))
+	{
+		uint8_t param = 0x00;
+
+		/*Only undo what the last user may have changed at run time: tear line and scrolling*/
+		lcd->scroll_height = 0;
+		lcd_txn_add(&txn, ILI9341_TEON, &param, 1, NULL, 0, 0);
+		lcd_txn_add_scroll(&txn, lcd);
+		lcd_txn_submit(lcd, &txn);
+		return;
+	}
+#endif
+
+	/*The whole sequence goes out in one write, the driver waits after SWRESET and SLEEP_OUT*/
+	for (uint32_t i = 0; i < sizeof(lcd_init_seq) / sizeof(lcd_init_seq[0]); i++)
+	{
+		lcd_txn_add(&txn, lcd_init_seq[i].cmd, lcd_init_seq[i].params, lcd_init_seq[i].nparams, NULL, 0, 0);
+		lcd_txn_add_delay(&txn, lcd_init_seq[i].delay_ms);
+	}
+	lcd_txn_submit(lcd, &txn);
+}
+
+void lcd_set_display_area(bsp_lcd_t *lcd, lcd_area_t *area)
+{
+	lcd_txn_t txn;
+
+	lcd_txn_init(&txn);
+	lcd_txn_add_area(&txn, area);
+	lcd_txn_submit(lcd, &txn);
+}
+
+/*
+ * MADCTL for each orientation. MV swaps rows and columns, MX/MY mirror them,
+ * so the panel itself scans out the rotated picture and the active width and
+ * height simply swap.
+ */
+static const uint8_t lcd_madctl[4] = {
+	[PORTRAIT]           = MADCTL_MY | MADCTL_MX | MADCTL_BGR,
+	[LANDSCAPE]          = MADCTL_MV | MADCTL_MY | MADCTL_BGR,
+	[PORTRAIT_INVERTED]  = MADCTL_BGR,
+	[LANDSCAPE_INVERTED] = MADCTL_MV | MADCTL_MX | MADCTL_BGR,
+};
+
+void lcd_set_orientation(bsp_lcd_t *lcd, uint8_t orientation)
+{
+	lcd_txn_t txn;
+	uint8_t param = lcd_madctl[orientation & 3];
+	uint16_t scrolling = lcd->scroll_height;
+
+	lcd->orientation = orientation & 3;
+	lcd->width = (param & MADCTL_MV) ? BSP_LCD_HEIGHT : BSP_LCD_WIDTH;
+	lcd->height = (param & MADCTL_MV) ? BSP_LCD_WIDTH : BSP_LCD_HEIGHT;
+
+	/*Memory access control with the full window of the new orientation*/
+	lcd->area.x1 = 0;
+	lcd->area.x2 = lcd->width - 1;
+	lcd->area.y1 = 0;
+	lcd->area.y2 = lcd->height - 1;
+	lcd->scroll_top = 0;
+	lcd->scroll_height = 0;
+	lcd->scroll_offset = 0;
+	lcd_txn_init(&txn);
+	lcd_txn_add(&txn, ILI9341_MAC, &param, 1, NULL, 0, 0);
+	lcd_txn_add_area(&txn, &lcd->area);
+	if (scrolling)
+	{
+		lcd_txn_add_scroll(&txn, lcd);
+	}
+	lcd_txn_submit(lcd, &txn);
+}
+
+/*
+ * Vertical scrolling. Rows scroll_top..scroll_top + scroll_height - 1 of the
+ * active orientation form a ring that the panel starts showing scroll_offset
+ * rows in, so moving the picture is a single VSCRSADD. Every write is
+ * remapped through the ring (lcd_scroll_split()) and callers keep using
+ * the coordinates they see on the screen.
+ *
+ * The panel scrolls along its scan lines, which are rows only without MV.
+ * With MY the scan runs bottom to top and the offset counts the other way.
+ */
+static int lcd_txn_add_scroll(lcd_txn_t *txn, bsp_lcd_t *lcd)
+{
+	uint8_t params[6];
+	uint16_t h = lcd->scroll_height;
+	uint16_t tfa = lcd->scroll_top;
+	uint16_t vsp;
+
+	if (h == 0)
+	{
+		/*The whole panel as scroll area at offset 0 shows GRAM as it is*/
+		tfa = 0;
+		h = ILI9341_FB_HEIGHT;
+	}
+	else if (lcd_madctl[lcd->orientation] & MADCTL_MY)
+	{
+		tfa = ILI9341_FB_HEIGHT - lcd->scroll_top - h;
+	}
+	vsp = tfa + ((lcd_madctl[lcd->orientation] & MADCTL_MY) ? (h - lcd->scroll_offset) % h : lcd->scroll_offset);
+
+	/*Vertical scrolling definition(33h), top fixed, scroll and bottom fixed lines */
+	params[0] = HIGH_16(tfa);
+	params[1] = LOW_16(tfa);
+	params[2] = HIGH_16(h);
+	params[3] = LOW_16(h);
+	params[4] = HIGH_16(ILI9341_FB_HEIGHT - tfa - h);
+	params[5] = LOW_16(ILI9341_FB_HEIGHT - tfa - h);
+	if (lcd_txn_add(txn, ILI9341_VSCRDEF, params, 6, NULL, 0, 0) < 0)	return -1;
+
+	/*Vertical scrolling start address(37h) */
+	params[0] = HIGH_16(vsp);
+	params[1] = LOW_16(vsp);
+	return lcd_txn_add(txn, ILI9341_VSCRSADD, params, 2, NULL, 0, 0);
+}
+
+int lcd_set_scroll_area(bsp_lcd_t *lcd, uint16_t top, uint16_t height)
+{
+	lcd_txn_t txn;
+
+	if ((uint32_t)top + height > lcd->height || (height && (lcd_madctl[lcd->orientation] & MADCTL_MV)))
+	{
+		return -1;
+	}
+
+	lcd->scroll_top = height ? top : 0;
+	lcd->scroll_height = height;
+	lcd->scroll_offset = 0;
+	lcd_txn_init(&txn);
+	lcd_txn_add_scroll(&txn, lcd);
+	return (lcd_txn_submit(lcd, &txn) < 0) ? -1 : 0;
+}
+
+int lcd_scroll(bsp_lcd_t *lcd, int16_t dy)
+{
+	lcd_txn_t txn;
+	int32_t h = lcd->scroll_height;
 
+	if (h == 0)
+	{
+		return -1;
+	}
+
+	/*Moving the picture down by dy shows the rows stored dy rows earlier*/
+	lcd->scroll_offset = (uint16_t)((((lcd->scroll_offset - dy) % h) + h) % h);
+	lcd_txn_init(&txn);
+	lcd_txn_add_scroll(&txn, lcd);
+	return (lcd_txn_submit(lcd, &txn) < 0) ? -1 : 0;
+}
+
+/*
+ * Line 0 pulses TE in vertical blanking, any other line when the panel
+ * starts scanning it out
+ */
+int lcd_set_tear_scanline(bsp_lcd_t *lcd, uint16_t line)
+{
+	lcd_txn_t txn;
+	uint8_t params[2];
+
+	if (line >= ILI9341_FB_HEIGHT)
+	{
+		return -1;
+	}
+
+	lcd_txn_init(&txn);
+	if (line == 0)
+	{
+		params[0] = 0x00;
+		lcd_txn_add(&txn, ILI9341_TEON, params, 1, NULL, 0, 0);
+	}
+	else
+	{
+		params[0] = HIGH_16(line);
+		params[1] = LOW_16(line);
+		lcd_txn_add(&txn, ILI9341_SET_TEAR_SCANLINE, params, 2, NULL, 0, 0);
+	}
+	return (lcd_txn_submit(lcd, &txn) < 0) ? -1 : 0;
+}
+
+int lcd_wait_vsync(bsp_lcd_t *lcd, struct ili9341_event *ev, int timeout_ms)
+{
+	if (lcd->transport == NULL || lcd->transport->ops->wait_vsync == NULL)
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	return lcd->transport->ops->wait_vsync(lcd->transport, ev, timeout_ms);
+}
+
+/*
+ * Cut area where the scroll ring starts, ends or wraps, so every part is
+ * contiguous in panel memory. part[i] is where the rows starting skip[i] rows
+ * into area are stored. Returns the number of parts.
+ */
+#define LCD_SCROLL_MAX_PARTS	4
+
+static uint32_t lcd_scroll_split(bsp_lcd_t *lcd, const lcd_area_t *area, lcd_area_t *part, uint16_t *skip)
+{
+	uint32_t top = lcd->scroll_top;
+	uint32_t h = lcd->scroll_height;
+	uint32_t y = area->y1;
+	uint32_t n = 0;
+
+	while (y <= area->y2)
+	{
+		uint32_t end = area->y2;
+		uint32_t dst = y;
+
+		if (h && y < top)
+		{
+			end = (end < top - 1) ? end : top - 1;
+		}
+		else if (h && y < top + h)
+		{
+			uint32_t row = (y - top + lcd->scroll_offset) % h;
+
+			dst = top + row;
+			end = (end < y + (h - row) - 1) ? end : y + (h - row) - 1;
+			end = (end < top + h - 1) ? end : top + h - 1;
+		}
+
+		part[n].x1 = area->x1;
+		part[n].x2 = area->x2;
+		part[n].y1 = dst;
+		part[n].y2 = dst + (end - y);
+		skip[n] = y - area->y1;
+		n++;
+		y = end + 1;
+	}
+
+	return n;
+}
+
+#if BSP_LCD_USE_IO_URING
+/*
+ * Write one stream record header and its padded parameters to dst and
+ * return the number of bytes used.
+ */
+static uint32_t lcd_stream_put(uint8_t *dst, uint8_t cmd, const uint8_t *params, uint8_t nparams, uint32_t len, uint8_t flags)
+{
+	struct ili9341_rec_hdr rec = { cmd, flags, nparams, 0, len };
+	uint32_t used = sizeof(rec);
+
+	memcpy(dst, &rec, sizeof(rec));
+	for (uint32_t i = 0; i < ILI9341_REC_ALIGN(nparams); i++)
+	{
+		dst[used++] = (i < nparams) ? params[i] : 0;
+	}
+
+	return used;
+}
+
+static void lcd_uring_poll(bsp_lcd_t *lcd, int wait);
+
+typedef struct{
+	struct io_uring ring;
+	uint32_t inflight;
+}lcd_uring_t;
+
+/* Byte length of the stream prefix written in front of the pixels */
+#define LCD_URING_PREFIX	(1U + 3U * sizeof(struct ili9341_rec_hdr) + 2U * 4U)
+
+static int lcd_uring_init(bsp_lcd_t *lcd)
+{
+	lcd_uring_t *u;
+	struct iovec bufs[BSP_LCD_DB_MAX_COUNT];
+
+	for (uint32_t i = 0; i < lcd->db_count; i++)
+	{
+		bufs[i].iov_base = lcd->db_mem[i];
+		bufs[i].iov_len = DB_HDR_SIZE + ILI9341_REC_ALIGN(lcd->db_size);
+	}
+
+	u = calloc(1, sizeof(*u));
+	if (u == NULL)
+	{
+		return -1;
+	}
+
+	if (io_uring_queue_init(BSP_LCD_URING_DEPTH, &u->ring, 0) < 0)
+	{
+		free(u);
+		return -1;
+	}
+
+	/* The draw buffers are pinned once instead of on every write */
+	if (io_uring_register_buffers(&u->ring, bufs, lcd->db_count) < 0)
+	{
+		io_uring_queue_exit(&u->ring);
+		free(u);
+		return -1;
+	}
+
+	lcd->uring = u;
+	return 0;
+}
+
+static void lcd_uring_exit(bsp_lcd_t *lcd)
+{
+	lcd_uring_t *u = lcd->uring;
+
+	if (u == NULL)
+	{
+		return;
+	}
+
+	while (u->inflight)
+	{
+		lcd_uring_poll(lcd, 1);
+	}
+	io_uring_queue_exit(&u->ring);
+	free(u);
+	lcd->uring = NULL;
+}
+
+/*
+ * Queue a flush of a contiguous draw buffer. Window setup, memory write and
+ * pixels are one stream written from the registered buffer, with the stream
+ * prefix placed in the header room in front of the pixels. Returns -1 when
+ * the buffer cannot be sent this way.
+ */
+static int lcd_uring_submit(bsp_lcd_t *lcd, const lcd_area_t *area, uint8_t *buffer, uint32_t len)
+{
+	lcd_uring_t *u = lcd->uring;
+	struct io_uring_sqe *sqe;
+	uint8_t params[4];
+	uint8_t *prefix;
+	int index = -1;
+
+	for (uint32_t i = 0; i < lcd->db_count; i++)
+	{
+		if (buffer == lcd->db_mem[i] + DB_HDR_SIZE)		index = i;
+	}
+	if (index < 0)
+	{
+		return -1;
+	}
+
+	if (u->inflight >= BSP_LCD_URING_DEPTH)
+	{
+		lcd_uring_poll(lcd, 1);
+	}
+
+	sqe = io_uring_get_sqe(&u->ring);
+	if (sqe == NULL)
+	{
+		return -1;
+	}
+
+	prefix = buffer - LCD_URING_PREFIX;
+	prefix[0] = SPI_SEND_STREAM;
+	params[0] = HIGH_16(area->x1);
+	params[1] = LOW_16(area->x1);
+	params[2] = HIGH_16(area->x2);
+	params[3] = LOW_16(area->x2);
+	prefix += 1 + lcd_stream_put(prefix + 1, ILI9341_CASET, params, 4, 0, 0);
 	params[0] = HIGH_16(area->y1);
 	params[1] = LOW_16(area->y1);
 	params[2] = HIGH_16(area->y2);
 	params[3] = LOW_16(area->y2);
-	lcd_write_cmd(ILI9341_RASET);
-	lcd_write_data(params, 4);
+	prefix += lcd_stream_put(prefix, ILI9341_RASET, params, 4, 0, 0);
+	lcd_stream_put(prefix, ILI9341_GRAM, NULL, 0, len, LCD_PIXEL_FLAGS);
+
+	/* Drain keeps flushes in submission order; the driver may run them on io-wq */
+	io_uring_prep_write_fixed(sqe, lcd->transport->fd, buffer - LCD_URING_PREFIX,
+							  LCD_URING_PREFIX + ILI9341_REC_ALIGN(len), 0, index);
+	sqe->flags |= IOSQE_IO_DRAIN;
+	io_uring_sqe_set_data(sqe, buffer);
+
+	if (io_uring_submit(&u->ring) < 0)
+	{
+		return -1;
+	}
+
+	u->inflight++;
+	return 0;
+}
+
+static void lcd_uring_poll(bsp_lcd_t *lcd, int wait)
+{
+	lcd_uring_t *u = lcd->uring;
+	struct io_uring_cqe *cqe;
+	int res;
+
+	while (u != NULL && u->inflight)
+	{
+		if (wait)		res = io_uring_wait_cqe(&u->ring, &cqe);
+		else			res = io_uring_peek_cqe(&u->ring, &cqe);
+		if (res < 0)	break;
+
+		res = cqe->res;
+		io_uring_cqe_seen(&u->ring, cqe);
+		u->inflight--;
+		wait = 0;
+
+		if (res < 0 && lcd->dma_err_cb)		lcd->dma_err_cb(lcd);
+		if (lcd->dma_cplt_cb)				lcd->dma_cplt_cb(lcd);
+	}
+}
+#else
+static int lcd_uring_init(bsp_lcd_t *lcd)
+{
+	(void)lcd;
+	return -1;
 }
 
-void lcd_set_orientation(uint8_t orientation)
+static void lcd_uring_exit(bsp_lcd_t *lcd)
 {
-	uint8_t param;
+	(void)lcd;
+}
 
-	if(orientation == LANDSCAPE){
-		param = MADCTL_MV | MADCTL_MY | MADCTL_BGR; /*Memory Access Control <Landscape setting>*/
-	}else if(orientation == PORTRAIT){
-		param = MADCTL_MY| MADCTL_MX| MADCTL_BGR;  /* Memory Access Control <portrait setting> */
+static int lcd_uring_submit(bsp_lcd_t *lcd, const lcd_area_t *area, uint8_t *buffer, uint32_t len)
+{
+	(void)lcd;
+	(void)area;
+	(void)buffer;
+	(void)len;
+	return -1;
+}
+
+static void lcd_uring_poll(bsp_lcd_t *lcd, int wait)
+{
+	(void)lcd;
+	(void)wait;
+}
+#endif
+
+static int lcd_nonblock_enabled(bsp_lcd_t *lcd)
+{
+	return BSP_LCD_USE_NONBLOCK && lcd->transport->ops->writev_async != NULL;
+}
+
+/*
+ * Queue a flush of a contiguous buffer as one non-blocking write. The
+ * transport copies the write, so only the completion is deferred. Returns -1
+ * when the buffer has to be sent synchronously instead.
+ */
+static int lcd_nonblock_submit(bsp_lcd_t *lcd, const lcd_area_t *area, const uint8_t *buffer, uint32_t len)
+{
+	const lcd_transport_ops_t *ops = lcd->transport->ops;
+	lcd_txn_t txn;
+	ssize_t ret;
+
+	if (!lcd_nonblock_enabled(lcd) || len + DB_HDR_SIZE > ILI9341_QUEUE_WRITE_MAX)
+	{
+		return -1;
+	}
+
+	lcd_txn_init(&txn);
+	lcd_txn_add_area(&txn, area);
+	lcd_txn_add(&txn, ILI9341_GRAM, NULL, 0, buffer, len, LCD_PIXEL_FLAGS);
+
+	/*A full queue frees up as soon as its oldest write completes*/
+	while ((ret = ops->writev_async(lcd->transport, txn.iov, txn.niov)) < 0 &&
+	       errno == EAGAIN && lcd->inflight)
+	{
+		lcd_poll(lcd, 1);
+	}
+
+	if (ret < 0)
+	{
+		/*
+		 * The driver returns the error of an earlier queued write here. That
+		 * one already completed, this buffer is sent synchronously and
+		 * reports its own result.
+		 */
+		if (errno != EAGAIN)		lcd->async_err = errno;
+		return -1;
 	}
 
-	lcd_write_cmd(ILI9341_MAC);    // Memory Access Control command
-	lcd_write_data(&param, 1);
+	lcd->inflight++;
+	return 0;
 }
 
-void lcd_buffer_init(bsp_lcd_t *lcd)
+/* Report completed flushes and failed earlier queued writes, waiting for a flush when asked */
+void lcd_poll(bsp_lcd_t *lcd, int wait)
 {
-	lcd->draw_buffer1 = bsp_db;
-	lcd->draw_buffer2 = bsp_wb;
-	lcd->buff_to_draw = NULL;
-	lcd->buff_to_flush = NULL;
+	int done;
+
+	if (lcd->async_err)
+	{
+		errno = lcd->async_err;
+		lcd->async_err = 0;
+		if (lcd->dma_err_cb)		lcd->dma_err_cb(lcd);
+	}
+
+	lcd_uring_poll(lcd, wait);
+
+	while (lcd->inflight)
+	{
+		done = lcd->transport->ops->wait_async(lcd->transport, wait ? -1 : 0);
+		if (done < 0)
+		{
+			/*Completions can no longer be collected, finish what is left as failed*/
+			if (lcd->dma_err_cb)	lcd->dma_err_cb(lcd);
+			done = lcd->inflight;
+		}
+		if (done == 0)
+		{
+			break;
+		}
+
+		for (; done > 0 && lcd->inflight; done--)
+		{
+			lcd->inflight--;
+			if (lcd->dma_cplt_cb)	lcd->dma_cplt_cb(lcd);
+		}
+		wait = 0;
+	}
+}
+
+/*
+ * Allocate the draw buffers that are not already there, page aligned and with
+ * DB_HDR_SIZE bytes of header room in front of each. The size is rounded up
+ * to the record padding that io_uring writes along with the pixels.
+ */
+static int lcd_db_alloc(bsp_lcd_t *lcd)
+{
+	void *mem;
+
+	for (uint32_t i = 0; i < lcd->db_count; i++)
+	{
+		if (lcd->db_mem[i] != NULL)
+		{
+			continue;
+		}
+		if (posix_memalign(&mem, sysconf(_SC_PAGESIZE), DB_HDR_SIZE + ILI9341_REC_ALIGN(lcd->db_size)) != 0)
+		{
+			return -1;
+		}
+		lcd->db_mem[i] = mem;
+	}
+
+	return 0;
+}
+
+static void lcd_db_free(bsp_lcd_t *lcd)
+{
+	for (uint32_t i = 0; i < BSP_LCD_DB_MAX_COUNT; i++)
+	{
+		free(lcd->db_mem[i]);
+		lcd->db_mem[i] = NULL;
+	}
+	lcd->draw_buffer1 = NULL;
+	lcd->draw_buffer2 = NULL;
+}
+
+/* io_uring submits to the descriptor directly, bypassing the ops */
+static void lcd_uring_start(bsp_lcd_t *lcd)
+{
+	if (BSP_LCD_USE_IO_URING && lcd->uring == NULL && lcd->transport->fd >= 0 &&
+	    (lcd_db_alloc(lcd) < 0 || lcd_uring_init(lcd) < 0))
+	{
+		lcd->uring = NULL;
+	}
+}
+
+static int lcd_shadow_alloc(bsp_lcd_t *lcd);
+
+int lcd_open(bsp_lcd_t *lcd)
+{
+	if (lcd->transport == NULL)
+	{
+		lcd->transport = lcd_transport_create(getenv(LCD_TRANSPORT_ENV));
+		if (lcd->transport == NULL)
+		{
+			return -1;
+		}
+	}
+
+	/* Render straight into the driver's framebuffer when it offers one */
+	if (lcd->fb == NULL)
+	{
+		lcd->fb = lcd->transport->ops->map_fb(lcd->transport);
+	}
+
+	lcd_uring_start(lcd);
+	return lcd_shadow_alloc(lcd);
+}
+
+void lcd_close(bsp_lcd_t *lcd)
+{
+	while (lcd->inflight)
+	{
+		lcd_poll(lcd, 1);
+	}
+	lcd_uring_exit(lcd);
+	lcd_db_free(lcd);
+	free(lcd->shadow);
+	lcd->shadow = NULL;
+
+	if (lcd->transport == NULL)
+	{
+		return;
+	}
+
+	if (lcd->fb != NULL)
+	{
+		lcd->transport->ops->unmap_fb(lcd->transport, lcd->fb);
+		lcd->fb = NULL;
+	}
+
+	lcd_transport_destroy(lcd->transport);
+	lcd->transport = NULL;
+}
+
+int lcd_buffer_init(bsp_lcd_t *lcd)
+{
+	lcd->db_index = 0;
+
+	/*
+	 * io_uring can only register ordinary pages, not the driver's mapping,
+	 * and flushes from the mapping could not be queued without blocking
+	 */
+	if (lcd->fb != NULL && lcd->uring == NULL && !lcd_nonblock_enabled(lcd))
+	{
+		/* One frame of the mapping per buffer, enough for full-frame buffering */
+		lcd->draw_buffer1 = lcd->fb;
+		lcd->draw_buffer2 = (lcd->db_count > 1) ? lcd->fb + ILI9341_FRAME_SIZE : NULL;
+		return 0;
+	}
+
+	if (lcd_db_alloc(lcd) < 0)
+	{
+		lcd_db_free(lcd);
+		return -1;
+	}
+	lcd->draw_buffer1 = lcd->db_mem[0] + DB_HDR_SIZE;
+	lcd->draw_buffer2 = (lcd->db_count > 1) ? lcd->db_mem[1] + DB_HDR_SIZE : NULL;
+	return 0;
+}
+
+#if BSP_LCD_USE_SHADOW_FB
+typedef struct{
+	bsp_lcd_t *lcd;
+	const lcd_area_t *area;
+	const uint8_t *buffer;
+	uint32_t stride;
+	lcd_txn_t txn;
+	lcd_area_t rects[LCD_DIFF_MAX_RECTS];
+	uint8_t extended[LCD_DIFF_MAX_RECTS];
+	uint32_t nrects;
+	int ret;
+}lcd_diff_t;
+
+static void lcd_diff_emit(lcd_diff_t *d, uint32_t i)
+{
+	lcd_area_t *r = &d->rects[i];
+	uint32_t rows = r->y2 - r->y1 + 1;
+	const uint8_t *src = d->buffer + (r->y1 - d->area->y1) * d->stride + (r->x1 - d->area->x1) * 2UL;
+
+	if (d->txn.nrecs + 3 > LCD_TXN_MAX_RECS || lcd_txn_rows_free(&d->txn) < rows + 4)
+	{
+		if (lcd_txn_submit(d->lcd, &d->txn) < 0)		d->ret = -1;
+	}
+
+	lcd_txn_add_area(&d->txn, r);
+	lcd_txn_add_rows(&d->txn, ILI9341_GRAM, src, (r->x2 - r->x1 + 1) * 2UL, rows, d->stride, LCD_PIXEL_FLAGS);
+
+	d->nrects--;
+	d->rects[i] = d->rects[d->nrects];
+	d->extended[i] = d->extended[d->nrects];
+}
+
+/*
+ * Add the changed span x1..x2 of row y. It extends an open rectangle ending on
+ * the previous row when the unchanged pixels this drags in cost less than a
+ * new window, otherwise it opens a rectangle of its own.
+ */
+static void lcd_diff_add_span(lcd_diff_t *d, uint16_t x1, uint16_t x2, uint16_t y)
+{
+	for (uint32_t i = 0; i < d->nrects; i++)
+	{
+		lcd_area_t *r = &d->rects[i];
+		uint32_t ux1 = (x1 < r->x1) ? x1 : r->x1;
+		uint32_t ux2 = (x2 > r->x2) ? x2 : r->x2;
+		uint32_t h = r->y2 - r->y1 + 1;
+		uint32_t extra = (ux2 - ux1 + 1) * (h + 1) - (r->x2 - r->x1 + 1) * h - (x2 - x1 + 1);
+
+		if (!d->extended[i] && r->y2 + 1 == y && extra * 2UL <= LCD_DIFF_SPLIT_COST)
+		{
+			r->x1 = ux1;
+			r->x2 = ux2;
+			r->y2 = y;
+			d->extended[i] = 1;
+			return;
+		}
+	}
+
+	if (d->nrects == LCD_DIFF_MAX_RECTS)
+	{
+		lcd_diff_emit(d, 0);
+	}
+
+	d->rects[d->nrects].x1 = x1;
+	d->rects[d->nrects].x2 = x2;
+	d->rects[d->nrects].y1 = y;
+	d->rects[d->nrects].y2 = y;
+	d->extended[d->nrects] = 1;
+	d->nrects++;
+}
+
+/*A write that failed left these rows unknown, the next one sends them in full*/
+static void lcd_shadow_forget(bsp_lcd_t *lcd, uint32_t y_start, uint32_t y_height)
+{
+	lcd_shadow_t *sh = lcd->shadow;
+
+	memset(&sh->row_valid[y_start], 0, y_height);
+}
+
+/*
+ * Compare a rectangle against the shadow and send only the changed spans,
+ * coalescing spans whose gap is cheaper to resend than to skip. Rows the
+ * shadow does not know yet are sent in full.
+ */
+int lcd_write_rect_diff(bsp_lcd_t *lcd, const lcd_area_t *area, const uint8_t *buffer, uint32_t stride)
+{
+	lcd_shadow_t *sh = lcd->shadow;
+	uint16_t width = lcd->width;
+	uint32_t row_len = (area->x2 - area->x1 + 1) * 2UL;
+	lcd_diff_t d;
+
+	d.lcd = lcd;
+	d.area = area;
+	d.buffer = buffer;
+	d.stride = stride;
+	d.nrects = 0;
+	d.ret = 0;
+	lcd_txn_init(&d.txn);
+
+	for (uint16_t y = area->y1; y <= area->y2; y++)
+	{
+		const uint16_t *row = (const uint16_t*)(buffer + (y - area->y1) * stride) - area->x1;
+		uint16_t *shadow = &sh->fb[y * width];
+		uint16_t x = area->x1;
+
+		for (uint32_t i = 0; i < d.nrects; i++)
+		{
+			d.extended[i] = 0;
+		}
+
+		if (!sh->row_valid[y])
+		{
+			lcd_diff_add_span(&d, area->x1, area->x2, y);
+			x = area->x2 + 1;
+		}
+
+		while (x <= area->x2)
+		{
+			uint16_t start, end, gap;
+
+			while (x <= area->x2 && row[x] == shadow[x])		x++;
+			if (x > area->x2)									break;
+
+			start = x;
+			while (1)
+			{
+				while (x <= area->x2 && row[x] != shadow[x])	x++;
+				end = x - 1;
+
+				gap = x;
+				while (gap <= area->x2 && row[gap] == shadow[gap] &&
+				       (gap - end) * 2UL <= LCD_DIFF_SPLIT_COST)
+				{
+					gap++;
+				}
+				if (gap > area->x2 || row[gap] == shadow[gap])	break;
+				x = gap;
+			}
+
+			lcd_diff_add_span(&d, start, end, y);
+			x = end + 1;
+		}
+
+		/*Rectangles that did not grow on this row are complete*/
+		for (uint32_t i = 0; i < d.nrects; )
+		{
+			if (!d.extended[i])			lcd_diff_emit(&d, i);
+			else						i++;
+		}
+
+		memcpy(&shadow[area->x1], &row[area->x1], row_len);
+		if (area->x1 == 0 && area->x2 == width - 1)
+		{
+			sh->row_valid[y] = 1;
+		}
+	}
+
+	while (d.nrects)
+	{
+		lcd_diff_emit(&d, 0);
+	}
+	if (lcd_txn_submit(lcd, &d.txn) < 0)			d.ret = -1;
+	if (d.ret < 0)
+	{
+		lcd_shadow_forget(lcd, area->y1, area->y2 - area->y1 + 1);
+	}
+
+	return d.ret;
+}
+
+static void lcd_shadow_fill(bsp_lcd_t *lcd, uint16_t color, uint32_t x_start, uint32_t x_width, uint32_t y_start, uint32_t y_height)
+{
+	lcd_shadow_t *sh = lcd->shadow;
+	uint16_t width = lcd->width;
+
+	for (uint32_t y = y_start; y < y_start + y_height; y++)
+	{
+		for (uint32_t x = x_start; x < x_start + x_width; x++)
+		{
+			sh->fb[y * width + x] = color;
+		}
+		if (x_start == 0 && x_width == width)
+		{
+			sh->row_valid[y] = 1;
+		}
+	}
+}
+
+void lcd_shadow_invalidate(bsp_lcd_t *lcd)
+{
+	lcd_shadow_t *sh = lcd->shadow;
+
+	if (sh != NULL)
+	{
+		memset(sh->row_valid, 0, sizeof(sh->row_valid));
+	}
+}
+
+/* Each panel keeps its own shadow, it starts out knowing nothing */
+static int lcd_shadow_alloc(bsp_lcd_t *lcd)
+{
+	if (lcd->shadow == NULL)
+	{
+		lcd->shadow = calloc(1, sizeof(lcd_shadow_t));
+	}
+	return (lcd->shadow != NULL) ? 0 : -1;
+}
+#else
+void lcd_shadow_invalidate(bsp_lcd_t *lcd)
+{
+	(void)lcd;
+}
+
+static int lcd_shadow_alloc(bsp_lcd_t *lcd)
+{
+	(void)lcd;
+	return 0;
+}
+#endif
+
+static int lcd_in_fb(bsp_lcd_t *lcd, const uint8_t *buffer)
+{
+	return lcd->fb != NULL && buffer >= lcd->fb && buffer < lcd->fb + ILI9341_FB_SIZE;
+}
+
+#if BSP_LCD_USE_REPEAT_FILL
+/*
+ * Fill a window of panel memory with one color. The driver repeats the
+ * pixel itself when the transport has the ioctl, otherwise a repeat record
+ * in a command stream does the same.
+ */
+static int lcd_fill_window(bsp_lcd_t *lcd, const lcd_area_t *area, uint16_t color)
+{
+	struct ili9341_fill_rect fill = { area->x1, area->x2, area->y1, area->y2, color, LCD_PIXEL_FLAGS };
+	uint32_t npixels = ((uint32_t)area->x2 - area->x1 + 1) * ((uint32_t)area->y2 - area->y1 + 1);
+	lcd_txn_t txn;
+
+	if (lcd->transport->ops->ioctl(lcd->transport, ILI9341_IOC_FILL_RECT, &fill) == 0)
+	{
+		return 0;
+	}
+	if (errno != ENOTTY)
+	{
+		return -1;
+	}
+
+	lcd_txn_init(&txn);
+	lcd_txn_add_area(&txn, area);
+	lcd_txn_add_repeat(&txn, ILI9341_GRAM, &color, sizeof(color), npixels, LCD_PIXEL_FLAGS);
+	return lcd_txn_submit(lcd, &txn);
+}
+
+/* Whether every pixel of a rectangle has the same color, returned in color */
+static int lcd_rect_is_uniform(const uint8_t *buffer, uint32_t len, uint32_t rows, uint32_t stride, uint16_t *color)
+{
+	const uint16_t *px = (const uint16_t*)buffer;
+
+	*color = px[0];
+	for (uint32_t y = 0; y < rows; y++, buffer += stride)
+	{
+		px = (const uint16_t*)buffer;
+		for (uint32_t x = 0; x < len / 2; x++)
+		{
+			if (px[x] != *color)	return 0;
+		}
+	}
+	return 1;
+}
+#endif
+
+/*
+ * Write a rectangle of panel memory whose rows are stride bytes apart in
+ * buffer. Buffers that live in the shared framebuffer are flushed by the
+ * driver without a copy.
+ */
+static int lcd_write_window(bsp_lcd_t *lcd, const lcd_area_t *area, const uint8_t *buffer, uint32_t stride)
+{
+	struct ili9341_flush_rect rect;
+	lcd_txn_t txn;
+	uint32_t len = (area->x2 - area->x1 + 1) * 2UL;
+	uint32_t rows = area->y2 - area->y1 + 1;
+	uint32_t n;
+	uint8_t flags = LCD_PIXEL_FLAGS;
+	int ret = 0;
+
+#if BSP_LCD_USE_SHADOW_FB
+	return lcd_write_rect_diff(lcd, area, buffer, stride);
+#endif
+
+	if (lcd_in_fb(lcd, buffer))
+	{
+		rect.x1 = area->x1;
+		rect.x2 = area->x2;
+		rect.y1 = area->y1;
+		rect.y2 = area->y2;
+		rect.offset = buffer - lcd->fb;
+		rect.stride = stride;
+		rect.flags = LCD_PIXEL_FLAGS;
+		return lcd->transport->ops->ioctl(lcd->transport, ILI9341_IOC_FLUSH_RECT, &rect);
+	}
+
+#if BSP_LCD_USE_REPEAT_FILL
+	/* A rectangle of one color goes out as a fill, its buffer is not written */
+	uint16_t color;
+
+	if (lcd_rect_is_uniform(buffer, len, rows, stride, &color))
+	{
+		return lcd_fill_window(lcd, area, color);
+	}
+#endif
+
+	/*
+	 * Window setup, memory write and all rows go out in one transaction. A
+	 * rectangle only spills into a second one (continuing the memory write)
+	 * when it has more rows than the gather list can hold.
+	 */
+	lcd_txn_init(&txn);
+	lcd_txn_add_area(&txn, area);
+	while (rows)
+	{
+		n = (stride == len) ? rows : lcd_txn_rows_free(&txn);
+		n = (n > rows) ? rows : n;
+		lcd_txn_add_rows(&txn, ILI9341_GRAM, buffer, len, n, stride, flags);
+		ret = lcd_txn_submit(lcd, &txn);
+		if (ret < 0)
+		{
+			break;
+		}
+		buffer += n * stride;
+		rows -= n;
+		flags |= ILI9341_REC_NO_CMD;
+	}
+
+	return ret;
+}
+
+/* Write a rectangle given in screen rows, following the scroll ring */
+int lcd_write_rect(bsp_lcd_t *lcd, const lcd_area_t *area, const uint8_t *buffer, uint32_t stride)
+{
+	lcd_area_t part[LCD_SCROLL_MAX_PARTS];
+	uint16_t skip[LCD_SCROLL_MAX_PARTS];
+	uint32_t n = lcd_scroll_split(lcd, area, part, skip);
+	int ret = 0;
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+		if (lcd_write_window(lcd, &part[i], buffer + skip[i] * stride, stride) < 0)
+		{
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Queue a rectangle for transmission and report completion through the
+ * handle's dma_cplt_cb/dma_err_cb. Buffers that cannot be queued are written
+ * synchronously and completed before returning.
+ */
+int lcd_write_rect_async(bsp_lcd_t *lcd, const lcd_area_t *area, uint8_t *buffer, uint32_t stride)
+{
+	lcd_area_t part[LCD_SCROLL_MAX_PARTS];
+	uint16_t skip[LCD_SCROLL_MAX_PARTS];
+	uint32_t len = (area->x2 - area->x1 + 1) * 2UL;
+	int ret;
+
+	/*A rectangle the scroll ring splits goes out synchronously*/
+	if (lcd->uring != NULL && stride == len && !BSP_LCD_USE_SHADOW_FB &&
+	    lcd_scroll_split(lcd, area, part, skip) == 1 &&
+	    lcd_uring_submit(lcd, &part[0], buffer, len * (area->y2 - area->y1 + 1)) == 0)
+	{
+		lcd_poll(lcd, 0);
+		return 0;
+	}
+
+	if (stride == len && !BSP_LCD_USE_SHADOW_FB && !lcd_in_fb(lcd, buffer) &&
+	    lcd_scroll_split(lcd, area, part, skip) == 1 &&
+	    lcd_nonblock_submit(lcd, &part[0], buffer, len * (area->y2 - area->y1 + 1)) == 0)
+	{
+		lcd_poll(lcd, 0);
+		return 0;
+	}
+
+	ret = lcd_write_rect(lcd, area, buffer, stride);
+	if (ret < 0 && lcd->dma_err_cb)		lcd->dma_err_cb(lcd);
+	if (lcd->dma_cplt_cb)				lcd->dma_cplt_cb(lcd);
+
+	return ret;
 }
 
 uint32_t get_total_bytes(bsp_lcd_t *hlcd,uint32_t w , uint32_t h)
@@ -231,12 +1349,12 @@ uint16_t convert_rgb888_to_rgb565(uint32_t rgb888)
 	return (uint16_t)((r << 11) | (g << 5) | b);
 }
 
-void make_area(lcd_area_t *area,uint32_t x_start, uint32_t x_width,uint32_t y_start,uint32_t y_height){
+void make_area(bsp_lcd_t *lcd, lcd_area_t *area,uint32_t x_start, uint32_t x_width,uint32_t y_start,uint32_t y_height){
 
 	uint16_t lcd_total_width,lcd_total_height;
 
-	lcd_total_width =  BSP_LCD_ACTIVE_WIDTH - 1;
-	lcd_total_height = BSP_LCD_ACTIVE_HEIGHT - 1;
+	lcd_total_width =  lcd->width - 1;
+	lcd_total_height = lcd->height - 1;
 
 	area->x1 = x_start;
 	area->x2 = x_start + x_width -1;
@@ -259,130 +1377,295 @@ uint32_t pixels_to_bytes(uint32_t pixels, uint8_t pixel_format)
 	return pixels * 2UL;
 }
 
- void lcd_flush(bsp_lcd_t *hlcd)
+/*
+ * Flushes are synchronous, so a buffer is free again as soon as the write
+ * returns; alternate between the two so consecutive fills never share one.
+ */
+uint8_t *get_buff(bsp_lcd_t *hlcd)
+{
+	uint8_t *buff = (hlcd->db_index == 0 || hlcd->draw_buffer2 == NULL) ? hlcd->draw_buffer1 : hlcd->draw_buffer2;
+
+	hlcd->db_index ^= 1;
+	return buff;
+}
+
+/*
+ * Fill area with one color, given in buffer byte order (see LCD_PIXEL), in a
+ * single write with one window and RAMWR per part of the scroll ring. The
+ * driver repeats the pixel itself when BSP_LCD_USE_REPEAT_FILL is set;
+ * otherwise one draw buffer is filled once and the records reference it as
+ * many times as the area needs.
+ */
+int lcd_fill_area(bsp_lcd_t *hlcd, const lcd_area_t *area, uint16_t color)
 {
-	lcd_set_display_area(&hlcd->area);
-	bsp_lcd_send_cmd_mem_write();
-#if (USE_DMA == 0)
-	bsp_lcd_write(hlcd->buff_to_flush, hlcd->write_length);
-	hlcd->buff_to_flush = NULL;
+	lcd_area_t part[LCD_SCROLL_MAX_PARTS];
+	uint16_t skip[LCD_SCROLL_MAX_PARTS];
+	uint32_t n = lcd_scroll_split(hlcd, area, part, skip);
+#if BSP_LCD_USE_REPEAT_FILL
+	int ret = 0;
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+#if BSP_LCD_USE_SHADOW_FB
+		lcd_shadow_fill(hlcd, color, part[i].x1, part[i].x2 - part[i].x1 + 1, part[i].y1, part[i].y2 - part[i].y1 + 1);
+#endif
+		if (lcd_fill_window(hlcd, &part[i], color) < 0)
+		{
+#if BSP_LCD_USE_SHADOW_FB
+			lcd_shadow_forget(hlcd, part[i].y1, part[i].y2 - part[i].y1 + 1);
+#endif
+			ret = -1;
+		}
+	}
+	return ret;
 #else
-	lcd_write_dma((uint32_t)hlcd->buff_to_flush,hlcd->write_length);
+	lcd_txn_t txn;
+	int ret;
+	uint16_t *buff = (uint16_t*)get_buff(hlcd);
+	uint32_t chunk = bytes_to_pixels(hlcd->db_size, hlcd->pixel_format);
+	uint32_t total = ((uint32_t)area->x2 - area->x1 + 1) * ((uint32_t)area->y2 - area->y1 + 1);
+
+	chunk = (chunk > total) ? total : chunk;
+	for (uint32_t i = 0; i < chunk; i++)
+	{
+		buff[i] = color;
+	}
+
+	ret = 0;
+	lcd_txn_init(&txn);
+	for (uint32_t i = 0; i < n && ret >= 0; i++)
+	{
+		uint32_t npixels = ((uint32_t)part[i].x2 - part[i].x1 + 1) * ((uint32_t)part[i].y2 - part[i].y1 + 1);
+		uint32_t rows = (chunk > npixels) ? 1 : npixels / chunk;
+		uint32_t len = (chunk > npixels) ? npixels : chunk;
+		uint32_t rest = pixels_to_bytes(npixels - rows * len, hlcd->pixel_format);
+		uint8_t flags = LCD_PIXEL_FLAGS;
+		uint32_t k;
+
+		if (txn.nrecs + 4 > LCD_TXN_MAX_RECS || lcd_txn_rows_free(&txn) < 8)
+		{
+			ret = lcd_txn_submit(hlcd, &txn);
+			if (ret < 0)	break;
+		}
+		lcd_txn_add_area(&txn, &part[i]);
+
+		/*Rows the gather list cannot hold continue the memory write in the next transaction*/
+		while (rows)
+		{
+			k = lcd_txn_rows_free(&txn);
+			k = (k > rows) ? rows : k;
+			if (k == 0 || lcd_txn_add_rows(&txn, ILI9341_GRAM, (uint8_t*)buff, pixels_to_bytes(len, hlcd->pixel_format),
+										   k, 0, flags) < 0)
+			{
+				ret = lcd_txn_submit(hlcd, &txn);
+				if (ret < 0)	break;
+				continue;
+			}
+			rows -= k;
+			flags |= ILI9341_REC_NO_CMD;
+		}
+		if (ret >= 0 && rest && lcd_txn_add(&txn, ILI9341_GRAM, NULL, 0, buff, rest, flags) < 0)
+		{
+			ret = lcd_txn_submit(hlcd, &txn);
+			if (ret >= 0)	lcd_txn_add(&txn, ILI9341_GRAM, NULL, 0, buff, rest, flags);
+		}
+#if BSP_LCD_USE_SHADOW_FB
+		lcd_shadow_fill(hlcd, color, part[i].x1, part[i].x2 - part[i].x1 + 1, part[i].y1, part[i].y2 - part[i].y1 + 1);
+#endif
+	}
+	if (ret >= 0)
+	{
+		ret = lcd_txn_submit(hlcd, &txn);
+	}
+#if BSP_LCD_USE_SHADOW_FB
+	for (uint32_t i = 0; ret < 0 && i < n; i++)
+	{
+		lcd_shadow_forget(hlcd, part[i].y1, part[i].y2 - part[i].y1 + 1);
+	}
+#endif
+	return ret;
 #endif
 }
 
-uint32_t copy_to_draw_buffer( bsp_lcd_t *hlcd,uint32_t nbytes,uint32_t rgb888)
+/*
+ * Use count (1 or 2) draw buffers of size bytes each, from one row in either
+ * orientation (ILI9341_FB_HEIGHT pixels) up to one full frame.
+ * Before lcd_init() this only sets the sizes; afterwards the buffers are
+ * reallocated, so nothing may be rendering into or flushing the old ones.
+ */
+int lcd_set_draw_buffers(bsp_lcd_t *lcd, uint32_t count, uint32_t size)
 {
-	uint16_t *fb_ptr = NULL;
-	uint32_t npixels;
-	hlcd->buff_to_draw = get_buff(hlcd);
-	fb_ptr = (uint16_t*)hlcd->buff_to_draw;
-	nbytes =  ((nbytes > DB_SIZE)?DB_SIZE:nbytes);
-	npixels= bytes_to_pixels(nbytes,hlcd->pixel_format);
-	if(hlcd->buff_to_draw != NULL){
-		for(uint32_t i = 0 ; i < npixels ;i++){
-			*fb_ptr = convert_rgb888_to_rgb565(rgb888);
-			fb_ptr++;
-		}
-		hlcd->write_length = pixels_to_bytes(npixels,hlcd->pixel_format);
-		hlcd->buff_to_flush = hlcd->buff_to_draw;
-		hlcd->buff_to_draw = NULL;
-		lcd_flush(hlcd);
-		return pixels_to_bytes(npixels,hlcd->pixel_format);
+	size &= ~1UL;
+	if (count < 1 || count > BSP_LCD_DB_MAX_COUNT || size < ILI9341_FB_HEIGHT * 2U || size > ILI9341_FRAME_SIZE)
+	{
+		return -1;
 	}
 
+	if (lcd->transport != NULL)
+	{
+		lcd_uring_exit(lcd);
+		lcd_db_free(lcd);
+	}
+
+	lcd->db_count = count;
+	lcd->db_size = size;
+
+	if (lcd->transport != NULL)
+	{
+		lcd_uring_start(lcd);
+		return lcd_buffer_init(lcd);
+	}
 	return 0;
 }
 
-uint32_t get_total_bytes(bsp_lcd_t *hlcd,uint32_t w , uint32_t h)
+/* Open the panel's transport, bring the panel up and allocate its draw buffers */
+int lcd_init(bsp_lcd_t *lcd)
 {
-	uint8_t bytes_per_pixel = 2;
-	if(hlcd->pixel_format == BSP_LCD_PIXEL_FMT_RGB565){
-		bytes_per_pixel = 2;
+	if (lcd_open(lcd) < 0)
+	{
+		return -1;
 	}
-	return (w * h * bytes_per_pixel);
+
+	lcd->pixel_format = BSP_LCD_PIXEL_FMT;
+	lcd_config(lcd);
+	lcd_set_orientation(lcd, BSP_LCD_ORIENTATION);
+	return lcd_buffer_init(lcd);
 }
 
-uint8_t *get_buff(bsp_lcd_t *hlcd)
+/*
+ * A handle for one more panel, driven through t, or through the backend
+ * named by $BSP_LCD_TRANSPORT when t is NULL. Handles share no state, so
+ * each can be used from its own thread. The handle owns t from now on.
+ */
+bsp_lcd_t *lcd_create(lcd_transport_t *t)
 {
-	uint32_t buf1 = (uint32_t)hlcd->draw_buffer1;
-	uint32_t buf2 = (uint32_t)hlcd->draw_buffer2;
+	bsp_lcd_t *lcd = calloc(1, sizeof(*lcd));
 
-	if(hlcd->buff_to_draw == NULL && hlcd->buff_to_flush == NULL){
-		return  hlcd->draw_buffer1;
-	}else if((uint32_t)hlcd->buff_to_flush == buf1 && hlcd->buff_to_draw == NULL ){
-		return  hlcd->draw_buffer2;
-	}else if ((uint32_t)hlcd->buff_to_flush == buf2 && hlcd->buff_to_draw == NULL){
-		return  hlcd->draw_buffer1;
+	if (lcd == NULL)
+	{
+		return NULL;
 	}
 
-	return NULL;
+	lcd->transport = t;
+	lcd->db_count = BSP_LCD_DB_COUNT;
+	lcd->db_size = BSP_LCD_DB_SIZE;
+	return lcd;
 }
 
-/* BSP Functions */
+void lcd_destroy(bsp_lcd_t *lcd)
+{
+	if (lcd != NULL)
+	{
+		lcd_close(lcd);
+		free(lcd);
+	}
+}
+
+/* BSP Functions, all on the default handle */
 
 void bsp_lcd_init(void)
 {
-    lcd_handle.orientation = BSP_LCD_ORIENTATION;
-	lcd_handle.pixel_format = BSP_LCD_PIXEL_FMT;
-	lcd_config();
-	hlcd->area.x1 = 0;
-	hlcd->area.x2 = BSP_LCD_ACTIVE_WIDTH-1;
-	hlcd->area.y1 = 0;
-	hlcd->area.y2 = BSP_LCD_ACTIVE_HEIGHT-1;
-	lcd_set_display_area(&hlcd->area);
-	lcd_set_orientation(hlcd->orientation);
-	lcd_buffer_init(hlcd);
+	if (lcd_init(hlcd) < 0)
+	{
+		perror("bsp_lcd_init");
+	}
+}
+
+/*
+ * Use t instead of the backend named by $BSP_LCD_TRANSPORT. Must be called
+ * before bsp_lcd_init(); the library owns t from then on.
+ */
+void bsp_lcd_set_transport(lcd_transport_t *t)
+{
+	if (hlcd->transport == NULL)
+	{
+		hlcd->transport = t;
+	}
+}
+
+void bsp_lcd_deinit(void)
+{
+	lcd_close(hlcd);
 }
 
 void bsp_lcd_set_orientation(int orientation)
 {
-    lcd_set_orientation(orientation);
+    if (orientation < PORTRAIT || orientation > LANDSCAPE_INVERTED) return;
+    lcd_set_orientation(hlcd, orientation);
+    lcd_shadow_invalidate(hlcd);
 }
 
-int bsp_lcd_write(uint8_t *buffer, uint32_t nbytes)
+uint16_t bsp_lcd_get_width(void)
 {
-    return spi_write(FRAME_16_B|DATA_MODE, buffer, nbytes);
+    return hlcd->width;
 }
 
-void bsp_lcd_set_background_color(uint32_t rgb888)
+uint16_t bsp_lcd_get_height(void)
 {
-	bsp_lcd_fill_rect(rgb888, 0, (BSP_LCD_ACTIVE_WIDTH), 0, (BSP_LCD_ACTIVE_HEIGHT));
+    return hlcd->height;
 }
 
-void bsp_lcd_fill_rect(uint32_t rgb888, uint32_t x_start, uint32_t x_width,uint32_t y_start,uint32_t y_height)
+/*
+ * Scroll rows top..top + height - 1 with bsp_lcd_scroll(); height 0 stops
+ * scrolling. Only possible in PORTRAIT and PORTRAIT_INVERTED. The offset
+ * starts over at 0, so whatever is shown in the old and the new area has to
+ * be drawn again.
+ */
+int bsp_lcd_set_scroll_area(uint16_t top, uint16_t height)
 {
+	return lcd_set_scroll_area(hlcd, top, height);
+}
 
-	uint32_t total_bytes_to_write = 0;
-	uint32_t bytes_sent_so_far = 0;
-	uint32_t remaining_bytes = 0;;
-	uint32_t npix;
-	uint32_t pixels_sent = 0;
-	uint32_t x1,y1;
-	uint32_t pixel_per_line = x_width;
+/*
+ * Move the picture in the scroll area down by dy rows (up when negative).
+ * Rows pushed out at one end come back in at the other and have to be
+ * drawn over; everything else keeps its place in screen coordinates.
+ */
+int bsp_lcd_scroll(int16_t dy)
+{
+	return lcd_scroll(hlcd, dy);
+}
 
-	if((x_start+x_width) > BSP_LCD_ACTIVE_WIDTH) return;
-	if((y_start+y_height) > BSP_LCD_ACTIVE_HEIGHT) return;
+/*
+ * Block until the panel starts its next frame (TE edge) or timeout_ms runs
+ * out, -1 waits forever. Returns 1 with ev filled in, 0 on timeout and -1
+ * with errno EOPNOTSUPP when the panel has no TE line.
+ */
+int bsp_lcd_wait_vsync(struct ili9341_event *ev, int timeout_ms)
+{
+	return lcd_wait_vsync(hlcd, ev, timeout_ms);
+}
 
-	//1. calculate total number of bytes written in to DB
-	total_bytes_to_write = get_total_bytes(hlcd,x_width,y_height);
-	remaining_bytes = total_bytes_to_write;
-	while(remaining_bytes){
-		x1 = x_start+(pixels_sent % pixel_per_line);
-		y1 = y_start+(pixels_sent / pixel_per_line);
+/*
+ * Move the TE edge bsp_lcd_wait_vsync() waits for to the start of panel
+ * line (GRAM row) line; 0 puts it back into vertical blanking
+ */
+int bsp_lcd_set_tear_scanline(uint16_t line)
+{
+	return lcd_set_tear_scanline(hlcd, line);
+}
 
-		make_area(&hlcd->area, x1, x_width, y1, y_height);
+int bsp_lcd_write(uint8_t *buffer, uint32_t nbytes)
+{
+    return spi_write(hlcd, LCD_PIXEL_MODE|DATA_MODE, buffer, nbytes);
+}
 
-		if(x1 != x_start){
-			npix = x_start+x_width - x1;
-		}else{
-			npix = bytes_to_pixels(remaining_bytes, hlcd->pixel_format);
-		}
+void bsp_lcd_set_background_color(uint32_t rgb888)
+{
+	bsp_lcd_fill_rect(rgb888, 0, hlcd->width, 0, hlcd->height);
+}
 
-		bytes_sent_so_far  +=  copy_to_draw_buffer(hlcd, pixels_to_bytes(npix,hlcd->pixel_format), rgb888);
-		pixels_sent = bytes_to_pixels(bytes_sent_so_far, hlcd->pixel_format);
-		remaining_bytes = total_bytes_to_write - bytes_sent_so_far;
-    }
+void bsp_lcd_fill_rect(uint32_t rgb888, uint32_t x_start, uint32_t x_width,uint32_t y_start,uint32_t y_height)
+{
+	uint16_t color;
+
+	if(x_width == 0 || y_height == 0) return;
+	if((x_start+x_width) > hlcd->width) return;
+	if((y_start+y_height) > hlcd->height) return;
+
+	color = LCD_PIXEL(convert_rgb888_to_rgb565(rgb888));
+	make_area(hlcd, &hlcd->area, x_start, x_width, y_start, y_height);
+	lcd_fill_area(hlcd, &hlcd->area, color);
 }
 
 void bsp_lcd_set_display_area(uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2)
@@ -392,12 +1675,48 @@ void bsp_lcd_set_display_area(uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2
     area.x2 = x2;
     area.y1 = y1;
     area.y2 = y2;
-    lcd_set_display_area(&area);
+    lcd_set_display_area(hlcd, &area);
+}
+
+int bsp_lcd_write_rect(const lcd_area_t *area, const uint8_t *buffer, uint32_t stride)
+{
+	return lcd_write_rect(hlcd, area, buffer, stride);
+}
+
+int bsp_lcd_write_rect_async(const lcd_area_t *area, uint8_t *buffer, uint32_t stride)
+{
+	return lcd_write_rect_async(hlcd, area, buffer, stride);
+}
+
+void bsp_lcd_poll(int wait)
+{
+	lcd_poll(hlcd, wait);
+}
+
+void bsp_lcd_shadow_invalidate(void)
+{
+	lcd_shadow_invalidate(hlcd);
 }
 
 void bsp_lcd_send_cmd_mem_write(void)
 {
-    lcd_write_cmd(ILI9341_GRAM);
+    lcd_write_cmd(hlcd, ILI9341_GRAM);
+}
+
+/* See lcd_set_draw_buffers() */
+int bsp_lcd_set_draw_buffers(uint32_t count, uint32_t size)
+{
+	return lcd_set_draw_buffers(hlcd, count, size);
+}
+
+uint32_t bsp_lcd_get_draw_buffer_size(void)
+{
+	return hlcd->db_size;
+}
+
+uint32_t bsp_lcd_get_draw_buffer_count(void)
+{
+	return hlcd->db_count;
 }
 
 void *bsp_lcd_get_draw_buffer1_addr(void)
@@ -414,4 +1733,37 @@ uint16_t bsp_lcd_convert_rgb888_to_rgb565(uint32_t rgb888)
 	return convert_rgb888_to_rgb565(rgb888);
 }
 
+void bsp_lcd_txn_init(lcd_txn_t *txn)
+{
+	lcd_txn_init(txn);
+}
+
+int bsp_lcd_txn_add(lcd_txn_t *txn, uint8_t cmd, const uint8_t *params, uint8_t nparams, const void *data, uint32_t len, uint8_t flags)
+{
+	return lcd_txn_add(txn, cmd, params, nparams, data, len, flags);
+}
 
+int bsp_lcd_txn_add_repeat(lcd_txn_t *txn, uint8_t cmd, const void *pattern, uint32_t len, uint32_t count, uint8_t flags)
+{
+	return lcd_txn_add_repeat(txn, cmd, pattern, len, count, flags);
+}
+
+int bsp_lcd_txn_add_area(lcd_txn_t *txn, const lcd_area_t *area)
+{
+	return lcd_txn_add_area(txn, area);
+}
+
+int bsp_lcd_txn_add_rows(lcd_txn_t *txn, uint8_t cmd, const uint8_t *data, uint32_t row_len, uint32_t rows, uint32_t stride, uint8_t flags)
+{
+	return lcd_txn_add_rows(txn, cmd, data, row_len, rows, stride, flags);
+}
+
+int bsp_lcd_txn_add_delay(lcd_txn_t *txn, uint8_t ms)
+{
+	return lcd_txn_add_delay(txn, ms);
+}
+
+int bsp_lcd_txn_submit(lcd_txn_t *txn)
+{
+	return lcd_txn_submit(hlcd, txn);
+}
@@ -9,6 +9,13 @@
 #include "lv_conf.h"
 #include "lvgl/lvgl.h"
 #include <string.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
 
 #include "tft.h"
 #include "ili9341_user_lib.h"
@@ -19,11 +26,96 @@ extern  bsp_lcd_t lcd_handle;
 /*********************
  *      DEFINES
  *********************/
+#define FLUSH_RING_SIZE		4	/*Power of two, larger than the number of draw buffers*/
 
+/*LVGL renders in the byte order the panel library sends, so no conversion is needed*/
+#if LV_COLOR_16_SWAP != BSP_LCD_PIXEL_SWAP
+#error "LV_COLOR_16_SWAP must match BSP_LCD_PIXEL_SWAP"
+#endif
+
+/*Strip sizes whose flushes are still waiting for completion, power of two*/
+#define TUNE_PENDING		8
+
+/*io_uring and non-blocking writes complete flushes themselves, the worker thread is only needed without them*/
+#define TFT_FLUSH_THREAD	(USE_DMA && !BSP_LCD_ASYNC_FLUSH)
 
 /**********************
  *      TYPEDEFS
  **********************/
+typedef struct {
+	lcd_area_t area;
+	const uint8_t * buf;
+	uint32_t stride;
+	bool vsync;					/*Wait for the panel to start a frame first*/
+} flush_job_t;
+
+/*Least squares fit of a cost in ns against a strip size in pixels*/
+typedef struct {
+	double n;
+	double sx;
+	double sy;
+	double sxx;
+	double sxy;
+} cost_fit_t;
+
+typedef struct {
+	bool enabled;
+	pthread_mutex_t lock;
+	cost_fit_t render;			/*LVGL drawing one strip*/
+	cost_fit_t xfer;			/*Sending one strip to the panel*/
+	uint64_t mark;				/*Rendering of the current strip started here*/
+	uint64_t wait_ns;			/*Time LVGL spent waiting for a buffer since mark*/
+	uint64_t done;				/*Completion time of the previous flush*/
+	uint64_t pend_t[TUNE_PENDING];
+	uint32_t pend_px[TUNE_PENDING];
+	uint32_t pend_head;
+	uint32_t pend_tail;
+	uint64_t px;
+	uint32_t refreshes;
+} tune_t;
+
+/*Scroll offload, see tft_set_scroll_offload()*/
+typedef struct {
+	lv_obj_t * obj;
+	lv_area_t area;				/*Rows the panel scrolls, empty while it does not*/
+	lv_coord_t scroll_x;		/*Scroll position of obj the panel content belongs to*/
+	lv_coord_t scroll_y;
+	int32_t pending;			/*Rows to move the panel by when the next refresh starts*/
+	lv_area_t inv;				/*Invalidation of obj that follows the scroll event...*/
+	lv_area_t exposed;			/*...and the rows it is cut down to*/
+	bool swallow;
+} hw_scroll_t;
+
+/*Frame pacing by the panel's TE output, see tft_set_te_source()*/
+typedef struct {
+	pthread_mutex_t lock;
+	tft_te_source_t src;		/*NULL: LVGL's refresh timer runs on its own*/
+	uint32_t seq;				/*Last edge seen...*/
+	uint64_t edge_ns;			/*...and when it came*/
+	uint64_t period_ns;			/*Measured frame period, 0 until known*/
+	uint64_t start_ns;			/*The current refresh started rendering here*/
+	uint64_t lead_ns;			/*Time it takes to render the first strip*/
+	bool sync;					/*The next flush is the first one of the refresh*/
+} te_t;
+
+/*One panel with its own display, draw buffers and flush worker, see tft_create()*/
+typedef struct {
+	bsp_lcd_t * lcd;
+	lv_disp_drv_t disp_drv;
+	lv_disp_draw_buf_t disp_buf;
+	lv_disp_t * disp;
+	tune_t tune;
+	hw_scroll_t hw_scroll;
+	te_t te;
+#if TFT_FLUSH_THREAD
+	/*Single-producer (LVGL) / single-consumer (flush thread) ring of draw buffers*/
+	flush_job_t flush_ring[FLUSH_RING_SIZE];
+	atomic_uint flush_head;
+	atomic_uint flush_tail;
+	sem_t flush_sem;
+	pthread_t flush_tid;
+#endif
+} tft_t;
 
 /**********************
  *  STATIC PROTOTYPES
@@ -31,10 +123,39 @@ extern  bsp_lcd_t lcd_handle;
 
 /*These 3 functions are needed by LittlevGL*/
 static void tft_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p);
+static void tft_update(lv_disp_drv_t * drv);
+static void tft_wait(lv_disp_drv_t * drv);
+static void tft_render_start(lv_disp_drv_t * drv);
+static void tft_wait_idle(lv_disp_drv_t * drv);
+static void tft_rounder(lv_disp_drv_t * drv, lv_area_t * area);
 
 /*LCD*/
+#if TFT_FLUSH_THREAD
+static void * flush_thread(void * arg);
+#endif
+
+/*Draw buffer tuning*/
+static uint64_t tune_now(void);
+static void tune_flushed(tft_t * tft, uint32_t px);
+static void tune_completed(tft_t * tft);
+static void tune_update(lv_disp_drv_t * drv);
+
+/*Scroll offload*/
+static void hw_scroll_event_cb(lv_event_t * e);
+static bool hw_scroll_area(tft_t * tft, lv_obj_t * obj, lv_area_t * visible, lv_area_t * area);
+static void hw_scroll_exclude(lv_obj_t * parent, uint32_t first, lv_area_t * area);
+static void hw_scroll_uncover(tft_t * tft, lv_obj_t * obj, lv_area_t * area);
+static void hw_scroll_reset(tft_t * tft);
+
+/*Frame pacing*/
+static bool te_active(tft_t * tft);
+static bool te_wait(tft_t * tft);
+static void te_align(tft_t * tft);
 
+static tft_t * tft_get(lv_disp_t * disp);
 
+void DMA_TransferComplete(bsp_lcd_t *hlcd);
+void DMA_TransferError(bsp_lcd_t *hlcd);
 
 static void Error_Handler(void);
 /**********************
@@ -42,14 +163,6 @@ static void Error_Handler(void);
  **********************/
 
 
-static lv_disp_drv_t disp_drv;
-
-static int32_t x1_flush;
-static int32_t y1_flush;
-static int32_t x2_flush;
-static int32_t y2_fill;
-static int32_t y_fill_act;
-static const lv_color_t * buf_to_flush;
 
 /**********************
  *      MACROS
@@ -62,7 +175,14 @@ static const lv_color_t * buf_to_flush;
 static volatile uint32_t t_saved = 0;
 void monitor_cb(lv_disp_drv_t * d, uint32_t t, uint32_t p)
 {
+	tft_t * tft = (tft_t *)d->user_data;
+
 	t_saved = t;
+
+	if(tft->tune.enabled) {
+		tft->tune.px += p;
+		if(++tft->tune.refreshes >= TFT_TUNE_PERIOD) tune_update(d);
+	}
 }
 
 /**
@@ -70,32 +190,165 @@ void monitor_cb(lv_disp_drv_t * d, uint32_t t, uint32_t p)
  */
 void tft_init(void)
 {
-	//static lv_color_t disp_buf1[TFT_HOR_RES * 32];
-	//static lv_color_t disp_buf2[TFT_HOR_RES * 32];
-	static lv_disp_draw_buf_t buf;
-	lv_color_t *draw_buf1;
-	lv_color_t *draw_buf2;
+	if(tft_create(&lcd_handle) == NULL) {
+		Error_Handler();
+	}
+}
 
-	bsp_lcd_init();
-	draw_buf1 = (lv_color_t*)bsp_lcd_get_draw_buffer1_addr();
-	draw_buf2 = (lv_color_t*)bsp_lcd_get_draw_buffer2_addr();
-	lv_disp_draw_buf_init(&buf,draw_buf1, draw_buf2, (10UL * 1024UL)/2);
-	lv_disp_drv_init(&disp_drv);
+/**
+ * Register a panel as a display of its own, with its own draw buffers and
+ * flush worker. Panels on different SPI buses transfer in parallel while
+ * LVGL renders the next strip of any of them.
+ * @param lcd handle of the panel, e.g. from lcd_create(); not initialized yet
+ * @return the new display, or NULL if the panel could not be set up
+ */
+lv_disp_t * tft_create(bsp_lcd_t * lcd)
+{
+	tft_t * tft = lv_malloc(sizeof(tft_t));
+	LV_ASSERT_MALLOC(tft);
+	if(tft == NULL) return NULL;
+	lv_memzero(tft, sizeof(tft_t));
+
+	tft->lcd = lcd;
+	tft->tune.enabled = TFT_DRAW_BUF_AUTOTUNE;
+	pthread_mutex_init(&tft->tune.lock, NULL);
+	lv_area_set(&tft->hw_scroll.area, 0, 0, -1, -1);
+	pthread_mutex_init(&tft->te.lock, NULL);
+#if TFT_USE_TE
+	tft->te.src = lcd_wait_vsync;
+#endif
+
+	lcd_set_draw_buffers(lcd, TFT_DRAW_BUF_COUNT, TFT_DRAW_BUF_SIZE * sizeof(lv_color_t));
+	if(lcd_init(lcd) < 0) {
+		perror("tft_create");
+		lv_free(tft);
+		return NULL;
+	}
+	lv_disp_draw_buf_init(&tft->disp_buf, lcd->draw_buffer1, lcd->draw_buffer2, lcd->db_size / sizeof(lv_color_t));
+	lv_disp_drv_init(&tft->disp_drv);
+
+	tft->disp_drv.draw_buf = &tft->disp_buf;
+	tft->disp_drv.flush_cb = tft_flush;
+	tft->disp_drv.monitor_cb = monitor_cb;
+	tft->disp_drv.render_start_cb = tft_render_start;
+	tft->disp_drv.wait_cb = tft_wait;
+	tft->disp_drv.rounder_cb = tft_rounder;
+	tft->disp_drv.hor_res = TFT_HOR_RES;
+	tft->disp_drv.ver_res = TFT_VER_RES;
+	/*The panel rotates through MADCTL, LVGL renders in the logical orientation*/
+	tft->disp_drv.sw_rotate = 0;
+	tft->disp_drv.rotated = BSP_LCD_ORIENTATION;
+	tft->disp_drv.drv_update_cb = tft_update;
+	tft->disp_drv.user_data = tft;
+
+	lcd->user_data = tft;
+	lcd->dma_cplt_cb = DMA_TransferComplete;
+	lcd->dma_err_cb = DMA_TransferError;
+#if TFT_FLUSH_THREAD
+	sem_init(&tft->flush_sem, 0, 0);
+	if(pthread_create(&tft->flush_tid, NULL, flush_thread, tft) != 0) {
+		Error_Handler();
+	}
+#endif
+
+	tft->disp = lv_disp_drv_register(&tft->disp_drv);
+	return tft->disp;
+}
+
+/**
+ * Replace the draw buffers, e.g. with full-frame ones. Call between refreshes.
+ * @param disp the display of the panel, NULL for the default display
+ * @param count 1 or 2 draw buffers
+ * @param size_px pixels per buffer, at most one frame
+ * @return 0 on success, -1 if the buffers could not be set up
+ */
+int tft_set_draw_buffers(lv_disp_t * disp, uint32_t count, uint32_t size_px)
+{
+	tft_t * tft = tft_get(disp);
+	bsp_lcd_t * lcd = tft->lcd;
+
+	tft_wait_idle(&tft->disp_drv);
+
+	if(lcd_set_draw_buffers(lcd, count, size_px * sizeof(lv_color_t)) < 0) {
+		return -1;
+	}
 
-	disp_drv.draw_buf = &buf;
-	disp_drv.flush_cb = tft_flush;
-	disp_drv.monitor_cb = monitor_cb;
-	disp_drv.hor_res = TFT_HOR_RES;
-	disp_drv.ver_res = TFT_VER_RES;
-	disp_drv.sw_rotate = 1;
-	disp_drv.user_data = (void*)&lcd_handle;
-	lv_disp_drv_register(&disp_drv);
+	lv_disp_draw_buf_init(&tft->disp_buf, lcd->draw_buffer1, lcd->draw_buffer2, lcd->db_size / sizeof(lv_color_t));
+	lv_obj_invalidate(lv_disp_get_scr_act(tft->disp));
+	return 0;
+}
+
+/**
+ * Let the strip size follow the measured render and transfer costs
+ * @param disp the display of the panel, NULL for the default display
+ * @param en true to enable the tuner, false to keep the current strip size
+ */
+void tft_set_autotune(lv_disp_t * disp, bool en)
+{
+	tft_get(disp)->tune.enabled = en;
+}
+
+/**
+ * Let the panel scroll obj: when it scrolls vertically the panel moves its
+ * picture (VSCRSADD) and LVGL only renders the rows that scroll into view.
+ * obj has to span the whole width of the screen in a portrait orientation,
+ * without rounded corners, top/bottom border or background image/gradient;
+ * otherwise it is redrawn as usual. Rows that other objects are drawn over
+ * are left out of the scroll and redrawn. Every panel offloads one object.
+ * @param disp the display of the panel, NULL for the default display
+ * @param obj the scrolling object on disp, e.g. a list, or NULL to stop
+ */
+void tft_set_scroll_offload(lv_disp_t * disp, lv_obj_t * obj)
+{
+	tft_t * tft = tft_get(disp);
+
+	if(tft->hw_scroll.obj != NULL) {
+		lv_obj_remove_event_cb_with_user_data(tft->hw_scroll.obj, hw_scroll_event_cb, tft);
+		hw_scroll_reset(tft);
+	}
+
+	tft->hw_scroll.obj = obj;
+	if(obj != NULL) {
+		tft->hw_scroll.scroll_x = lv_obj_get_scroll_x(obj);
+		tft->hw_scroll.scroll_y = lv_obj_get_scroll_y(obj);
+		lv_obj_add_event_cb(obj, hw_scroll_event_cb, LV_EVENT_ALL, tft);
+	}
+}
+
+/**
+ * Take the TE edges refreshes are paced by from src instead of the panel,
+ * e.g. a mock that simulates one in tests
+ * @param disp the display of the panel, NULL for the default display
+ * @param src function that waits for the next edge, NULL to run on LVGL's refresh timer alone
+ */
+void tft_set_te_source(lv_disp_t * disp, tft_te_source_t src)
+{
+	tft_t * tft = tft_get(disp);
+
+	if(tft->disp != NULL) tft_wait_idle(&tft->disp_drv);
+
+	pthread_mutex_lock(&tft->te.lock);
+	tft->te.src = src;
+	tft->te.edge_ns = 0;
+	tft->te.period_ns = 0;
+	pthread_mutex_unlock(&tft->te.lock);
 }
 
 /**********************
  *   STATIC FUNCTIONS
  **********************/
 
+/**
+ * Find the panel behind a display
+ * @param disp a display created by tft_create(), NULL for the default display
+ * @return the panel
+ */
+static tft_t * tft_get(lv_disp_t * disp)
+{
+	if(disp == NULL) disp = lv_disp_get_default();
+	return (tft_t *)disp->driver->user_data;
+}
+
 /**
  * Flush a color buffer
  * @param x1 left coordinate of the rectangle
@@ -106,87 +359,489 @@ void tft_init(void)
  */
 static void tft_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p)
 {
-  if(area->x2 < 0 || area->y2 < 0 || area->x1 > (TFT_HOR_RES  - 1) || area->y1 > (TFT_VER_RES  - 1)) {
+	tft_t * tft = (tft_t *)drv->user_data;
+	bsp_lcd_t *hlcd = tft->lcd;
+	int32_t hor_res = hlcd->width;
+	int32_t ver_res = hlcd->height;
+
+	/*Return if the area is out the screen*/
+	if(area->x2 < 0 || area->y2 < 0 || area->x1 > hor_res - 1 || area->y1 > ver_res - 1) {
 		lv_disp_flush_ready(drv);
 		return;
 	}
 
-	bsp_lcd_t *hlcd = (bsp_lcd_t*)drv->user_data;
-
-	/*Return if the area is out the screen*/
-	if(area->x2 < 0) return;
-	if(area->y2 < 0) return;
-	if(area->x1 > TFT_HOR_RES - 1) return;
-	if(area->y1 > TFT_VER_RES - 1) return;
-
 	/*Truncate the area to the screen*/
 	int32_t act_x1 = area->x1 < 0 ? 0 : area->x1;
 	int32_t act_y1 = area->y1 < 0 ? 0 : area->y1;
-	int32_t act_x2 = area->x2 > TFT_HOR_RES - 1 ? TFT_HOR_RES - 1 : area->x2;
-	int32_t act_y2 = area->y2 > TFT_VER_RES - 1 ? TFT_VER_RES - 1 : area->y2;
+	int32_t act_x2 = area->x2 > hor_res - 1 ? hor_res - 1 : area->x2;
+	int32_t act_y2 = area->y2 > ver_res - 1 ? ver_res - 1 : area->y2;
 
 	lv_coord_t w = (area->x2 - area->x1) + 1;
 
-	bsp_lcd_set_display_area(act_x1,act_x2,act_y1,act_y2);
-	uint32_t len = (act_x2 - act_x1 + 1) * 2ul;
-
-#if USE_DMA
-	x1_flush = act_x1;
-	y1_flush = act_y1;
-	x2_flush = act_x2;
-	y2_fill = act_y2;
-	y_fill_act = act_y1;
-	buf_to_flush = color_p;
-	  /*##-7- Start the DMA transfer using the interrupt mode #*/
-	  /* Configure the source, destination and buffer size DMA fields and Start DMA Stream transfer */
-	  /* Enable All the DMA interrupts */
-	len = len * ((act_y2 - act_y1) + 1);
-	bsp_lcd_send_cmd_mem_write();
-	bsp_lcd_write_dma((uint32_t)buf_to_flush, len);
+	/*Skip the clipped rows and columns of the buffer*/
+	color_p += (act_y1 - area->y1) * w + (act_x1 - area->x1);
+
+	lcd_area_t lcd_area = {act_x1, act_x2, act_y1, act_y2};
+
+	if(tft->tune.enabled) tune_flushed(tft, (act_x2 - act_x1 + 1) * (act_y2 - act_y1 + 1));
+
+	/*The first strip of a refresh goes out when the panel starts a frame*/
+	bool vsync = tft->te.sync;
+	if(vsync) {
+		uint64_t lead = tune_now() - tft->te.start_ns;
+
+		tft->te.lead_ns = tft->te.lead_ns ? (tft->te.lead_ns * 3 + lead) / 4 : lead;
+		tft->te.sync = false;
+	}
+
+#if BSP_LCD_ASYNC_FLUSH
+	/*Completion is reported through DMA_TransferComplete from lcd_poll*/
+	if(vsync) te_wait(tft);
+	lcd_write_rect_async(hlcd, &lcd_area, (uint8_t*)color_p, w * 2UL);
+#elif TFT_FLUSH_THREAD
+	unsigned int head = atomic_load_explicit(&tft->flush_head, memory_order_relaxed);
+
+	/*LVGL waits for a buffer before reusing it, so the ring is only full transiently*/
+	while(head - atomic_load_explicit(&tft->flush_tail, memory_order_acquire) >= FLUSH_RING_SIZE) {
+		sched_yield();
+	}
+
+	flush_job_t * job = &tft->flush_ring[head & (FLUSH_RING_SIZE - 1)];
+	job->area = lcd_area;
+	job->buf = (const uint8_t *)color_p;
+	job->stride = w * 2UL;
+	job->vsync = vsync;
+	atomic_store_explicit(&tft->flush_head, head + 1, memory_order_release);
+	sem_post(&tft->flush_sem);
+#else
+	if(vsync) te_wait(tft);
+	if(lcd_write_rect(hlcd, &lcd_area, (uint8_t*)color_p, w * 2UL) < 0) {
+		DMA_TransferError(hlcd);
+	}
+	DMA_TransferComplete(hlcd);
+#endif
+
+	/*Rendering of the next strip starts now*/
+	tft->tune.mark = tft->tune.enabled ? tune_now() : 0;
+	tft->tune.wait_ns = 0;
+}
+
+/**
+ * Called by LVGL after lv_disp_set_rotation(); turns the panel to match
+ * @param drv pointer to the display driver
+ */
+static void tft_update(lv_disp_drv_t * drv)
+{
+	tft_t * tft = (tft_t *)drv->user_data;
+
+	/*Let flushes rendered for the old orientation reach the panel first*/
+	tft_wait_idle(drv);
+	lcd_set_orientation(tft->lcd, drv->rotated);
+	lcd_shadow_invalidate(tft->lcd);
+
+	/*The panel stopped scrolling, and LVGL redraws everything anyway*/
+	lv_area_set(&tft->hw_scroll.area, 0, 0, -1, -1);
+	tft->hw_scroll.pending = 0;
+}
+
+/**
+ * Called by LVGL while it waits for a draw buffer to be flushed
+ * @param drv pointer to the display driver
+ */
+static void tft_wait(lv_disp_drv_t * drv)
+{
+	tft_t * tft = (tft_t *)drv->user_data;
+	uint64_t t = tune_now();
+
+#if BSP_LCD_ASYNC_FLUSH
+	lcd_poll(tft->lcd, 1);
 #else
-	//bsp_lcd_write_dma((uint32_t)buf_to_flush,nbytes);
-	bsp_lcd_send_cmd_mem_write();
-	for(uint32_t y = act_y1; y <= act_y2; y++) {
-			bsp_lcd_write((uint8_t*)color_p,len);
-	        color_p += w;
-	    }
-
-	lv_disp_flush_ready(&disp_drv);
+	sched_yield();
 #endif
+	tft->tune.wait_ns += tune_now() - t;
+}
+
+/**
+ * Wait until every queued flush has reached the panel
+ * @param drv pointer to the display driver
+ */
+static void tft_wait_idle(lv_disp_drv_t * drv)
+{
+	while(drv->draw_buf->flushing) {
+		tft_wait(drv);
+	}
 }
 
+/**
+ * Called by LVGL before it renders the first strip of a refresh
+ * @param drv pointer to the display driver
+ */
+static void tft_render_start(lv_disp_drv_t * drv)
+{
+	tft_t * tft = (tft_t *)drv->user_data;
+
+	tft->te.start_ns = tune_now();
+	tft->te.sync = te_active(tft);
+	te_align(tft);
+
+	/*Move the picture before the rows that scrolled into view arrive*/
+	tft->hw_scroll.swallow = false;
+	if(tft->hw_scroll.pending) {
+		tft_wait_idle(drv);
+		/*On a frame boundary the scroll does not tear, and the rows exposed follow right away*/
+		if(tft->te.sync && te_wait(tft)) tft->te.sync = false;
+		lcd_scroll(tft->lcd, tft->hw_scroll.pending);
+		tft->hw_scroll.pending = 0;
+	}
 
+	tft->tune.mark = tft->tune.enabled ? tune_now() : 0;
+	tft->tune.wait_ns = 0;
+}
+
+/**
+ * Called by LVGL for every invalidated area. Cuts the redraw of an offloaded
+ * scroll down to the rows that scrolled into view.
+ * @param drv pointer to the display driver
+ * @param area the invalidated area, modified in place
+ */
+static void tft_rounder(lv_disp_drv_t * drv, lv_area_t * area)
+{
+	tft_t * tft = (tft_t *)drv->user_data;
+
+	if(tft->hw_scroll.swallow && _lv_area_is_equal(area, &tft->hw_scroll.inv)) {
+		*area = tft->hw_scroll.exposed;
+		tft->hw_scroll.swallow = false;
+	}
+}
+
+/**
+ * Follow the scroll position of the offloaded object. LVGL invalidates the
+ * whole object right after LV_EVENT_SCROLL, tft_rounder() replaces that with
+ * the exposed rows, and the panel moves when the next refresh starts.
+ * @param e the event of the offloaded object
+ */
+static void hw_scroll_event_cb(lv_event_t * e)
+{
+	tft_t * tft = (tft_t *)lv_event_get_user_data(e);
+	lv_obj_t * obj = lv_event_get_target(e);
+	lv_event_code_t code = lv_event_get_code(e);
+
+	if(code == LV_EVENT_DELETE) {
+		hw_scroll_reset(tft);
+		tft->hw_scroll.obj = NULL;
+		return;
+	}
+	if(code != LV_EVENT_SCROLL) return;
+
+	lv_coord_t dx = tft->hw_scroll.scroll_x - lv_obj_get_scroll_x(obj);
+	lv_coord_t dy = tft->hw_scroll.scroll_y - lv_obj_get_scroll_y(obj);
+	lv_area_t visible, area;
+
+	tft->hw_scroll.scroll_x = lv_obj_get_scroll_x(obj);
+	tft->hw_scroll.scroll_y = lv_obj_get_scroll_y(obj);
+	tft->hw_scroll.swallow = false;
+
+	/*Not possible right now, LVGL redraws the object and the panel stays as it is*/
+	if(!hw_scroll_area(tft, obj, &visible, &area)) return;
+
+	if(area.y1 != tft->hw_scroll.area.y1 || area.y2 != tft->hw_scroll.area.y2) {
+		/*A new scroll area starts over at offset 0, LVGL redraws the object this time*/
+		hw_scroll_reset(tft);
+		tft_wait_idle(&tft->disp_drv);
+		if(lcd_set_scroll_area(tft->lcd, area.y1, lv_area_get_height(&area)) == 0) tft->hw_scroll.area = area;
+		return;
+	}
+	if(dx != 0 || dy == 0 || LV_ABS(dy) >= lv_area_get_height(&area)) return;
+
+	/*Rows left out of the scroll area are redrawn as they are*/
+	lv_area_t band = visible;
+	band.y2 = area.y1 - 1;
+	if(band.y2 >= band.y1) _lv_inv_area(tft->disp, &band);
+	band = visible;
+	band.y1 = area.y2 + 1;
+	if(band.y2 >= band.y1) _lv_inv_area(tft->disp, &band);
+
+	/*Dirty areas not rendered yet are stale on the panel and move along with the picture*/
+	uint16_t inv_p = tft->disp->inv_p;
+	for(uint16_t i = 0; i < inv_p; i++) {
+		lv_area_t a;
+
+		if(!_lv_area_intersect(&a, &tft->disp->inv_areas[i], &area)) continue;
+		lv_area_move(&a, 0, dy);
+		if(_lv_area_intersect(&a, &a, &area)) _lv_inv_area(tft->disp, &a);
+	}
+
+	/*Scrollbars stay in place while the content moves under them*/
+	lv_area_t hor, ver;
+	lv_obj_get_scrollbar_area(obj, &hor, &ver);
+	if(lv_area_get_size(&ver) > 0) {
+		ver.y1 = area.y1;
+		ver.y2 = area.y2;
+		_lv_inv_area(tft->disp, &ver);
+	}
+	if(lv_area_get_size(&hor) > 0) {
+		_lv_inv_area(tft->disp, &hor);
+		lv_area_move(&hor, 0, dy);
+		if(_lv_area_intersect(&hor, &hor, &area)) _lv_inv_area(tft->disp, &hor);
+	}
+
+	/*What lv_obj_invalidate(obj) is going to pass to tft_rounder()*/
+	lv_coord_t ext = _lv_obj_get_ext_draw_size(obj);
+	lv_area_t scr = {0, 0, lv_disp_get_hor_res(tft->disp) - 1, lv_disp_get_ver_res(tft->disp) - 1};
+
+	lv_area_set(&tft->hw_scroll.inv, obj->coords.x1 - ext, obj->coords.y1 - ext, obj->coords.x2 + ext, obj->coords.y2 + ext);
+	if(!lv_obj_area_is_visible(obj, &tft->hw_scroll.inv) || !_lv_area_intersect(&tft->hw_scroll.inv, &tft->hw_scroll.inv, &scr)) return;
+
+	tft->hw_scroll.exposed = area;
+	if(dy > 0) tft->hw_scroll.exposed.y2 = area.y1 + dy - 1;
+	else tft->hw_scroll.exposed.y1 = area.y2 + dy + 1;
+	tft->hw_scroll.swallow = true;
+	tft->hw_scroll.pending += dy;
+}
+
+/**
+ * Check whether moving the panel picture can stand in for redrawing obj
+ * @param tft the panel
+ * @param obj the offloaded object
+ * @param visible returns the visible rows of obj, always the whole screen width
+ * @param area returns the part of visible the panel can scroll
+ * @return true if obj can be scrolled by the panel now
+ */
+static bool hw_scroll_area(tft_t * tft, lv_obj_t * obj, lv_area_t * visible, lv_area_t * area)
+{
+	/*The panel only scrolls along its scan lines, the rows in portrait*/
+	if(tft->disp_drv.rotated == LV_DISP_ROT_90 || tft->disp_drv.rotated == LV_DISP_ROT_270) return false;
+	if(lv_obj_get_disp(obj) != tft->disp || !lv_disp_is_invalidation_enabled(tft->disp) || tft->disp->rendering_in_progress ||
+	   tft->disp->prev_scr != NULL || lv_obj_get_screen(obj) != tft->disp->act_scr) {
+		return false;
+	}
+
+	/*Whatever obj draws at a fixed place would move along with its content*/
+	if(lv_obj_get_style_radius(obj, LV_PART_MAIN) != 0 ||
+	   lv_obj_get_style_opa(obj, LV_PART_MAIN) != LV_OPA_COVER ||
+	   lv_obj_get_style_bg_opa(obj, LV_PART_MAIN) != LV_OPA_COVER ||
+	   lv_obj_get_style_bg_grad_dir(obj, LV_PART_MAIN) != LV_GRAD_DIR_NONE ||
+	   lv_obj_get_style_bg_img_src(obj, LV_PART_MAIN) != NULL ||
+	   (lv_obj_get_style_border_width(obj, LV_PART_MAIN) != 0 &&
+	    (lv_obj_get_style_border_side(obj, LV_PART_MAIN) & (LV_BORDER_SIDE_TOP | LV_BORDER_SIDE_BOTTOM))) ||
+	   lv_obj_has_flag(obj, LV_OBJ_FLAG_OVERFLOW_VISIBLE)) {
+		return false;
+	}
+	for(uint32_t i = 0; i < lv_obj_get_child_cnt(obj); i++) {
+		if(lv_obj_has_flag(lv_obj_get_child(obj, i), LV_OBJ_FLAG_FLOATING)) return false;
+	}
+
+	/*Full rows only, the panel moves them as a whole*/
+	lv_area_t scr = {0, 0, lv_disp_get_hor_res(tft->disp) - 1, lv_disp_get_ver_res(tft->disp) - 1};
+
+	*visible = obj->coords;
+	if(!lv_obj_area_is_visible(obj, visible) || !_lv_area_intersect(visible, visible, &scr)) return false;
+	if(visible->x1 != scr.x1 || visible->x2 != scr.x2) return false;
+
+	*area = *visible;
+	hw_scroll_uncover(tft, obj, area);
+	return area->y2 >= area->y1;
+}
+
+/**
+ * Leave the rows that children of parent from index first on cover out of area
+ * @param parent the parent whose children are checked
+ * @param first index of the first child to check
+ * @param area the rows to scroll, cut down in place
+ */
+static void hw_scroll_exclude(lv_obj_t * parent, uint32_t first, lv_area_t * area)
+{
+	for(uint32_t i = first; i < lv_obj_get_child_cnt(parent); i++) {
+		lv_obj_t * o = lv_obj_get_child(parent, i);
+		lv_coord_t ext = _lv_obj_get_ext_draw_size(o);
+		lv_area_t a;
+
+		if(lv_obj_has_flag(o, LV_OBJ_FLAG_HIDDEN)) continue;
+		lv_area_set(&a, o->coords.x1 - ext, o->coords.y1 - ext, o->coords.x2 + ext, o->coords.y2 + ext);
+		if(!_lv_area_is_on(&a, area)) continue;
+
+		/*Keep the larger part above or below it*/
+		if(a.y1 - area->y1 >= area->y2 - a.y2) area->y2 = a.y1 - 1;
+		else area->y1 = a.y2 + 1;
+	}
+}
+
+/**
+ * Leave out the rows of the offloaded object that something is drawn over,
+ * since that would move along with the picture
+ * @param tft the panel
+ * @param obj the offloaded object
+ * @param area the visible rows of obj, cut down in place
+ */
+static void hw_scroll_uncover(tft_t * tft, lv_obj_t * obj, lv_area_t * area)
+{
+	/*Later siblings of obj and of each of its parents are drawn over it, and so are the layers*/
+	for(lv_obj_t * o = obj; lv_obj_get_parent(o) != NULL; o = lv_obj_get_parent(o)) {
+		hw_scroll_exclude(lv_obj_get_parent(o), lv_obj_get_index(o) + 1, area);
+	}
+
+	hw_scroll_exclude(lv_disp_get_layer_top(tft->disp), 0, area);
+	hw_scroll_exclude(lv_disp_get_layer_sys(tft->disp), 0, area);
+}
+
+/**
+ * Stop the panel scrolling and redraw the rows it scrolled
+ * @param tft the panel
+ */
+static void hw_scroll_reset(tft_t * tft)
+{
+	if(tft->hw_scroll.area.y2 >= tft->hw_scroll.area.y1) {
+		tft_wait_idle(&tft->disp_drv);
+		lcd_set_scroll_area(tft->lcd, 0, 0);
+		_lv_inv_area(tft->disp, &tft->hw_scroll.area);
+	}
+
+	lv_area_set(&tft->hw_scroll.area, 0, 0, -1, -1);
+	tft->hw_scroll.pending = 0;
+	tft->hw_scroll.swallow = false;
+}
+
+/**
+ * Check whether refreshes are paced by TE edges
+ * @param tft the panel
+ * @return true while there is a TE source
+ */
+static bool te_active(tft_t * tft)
+{
+	bool active;
+
+	pthread_mutex_lock(&tft->te.lock);
+	active = tft->te.src != NULL;
+	pthread_mutex_unlock(&tft->te.lock);
+	return active;
+}
+
+/**
+ * Wait for the next TE edge, i.e. until the panel starts a new frame
+ * @param tft the panel
+ * @return true on an edge, false on timeout or without a TE source
+ */
+static bool te_wait(tft_t * tft)
+{
+	struct ili9341_event ev;
+	tft_te_source_t src;
+	int timeout;
+	int ret;
+
+	pthread_mutex_lock(&tft->te.lock);
+	src = tft->te.src;
+	timeout = tft->te.period_ns ? (int)(2 * tft->te.period_ns / 1000000) + 1 : TFT_TE_TIMEOUT;
+	pthread_mutex_unlock(&tft->te.lock);
+	if(src == NULL) return false;
+
+	do {
+		ret = src(tft->lcd, &ev, timeout);
+	} while(ret < 0 && errno == EINTR);
+
+	pthread_mutex_lock(&tft->te.lock);
+	if(ret < 0 && tft->te.src == src) {
+		/*No TE line, LVGL's refresh timer takes over again*/
+		tft->te.src = NULL;
+		tft->te.period_ns = 0;
+	}
+	else if(ret > 0 && ev.type == ILI9341_EVENT_VSYNC) {
+		/*Edges that went by unseen still count, sequence tells how many*/
+		uint32_t n = ev.sequence - tft->te.seq;
+
+		if(tft->te.edge_ns && n && ev.timestamp_ns > tft->te.edge_ns) {
+			uint64_t p = (ev.timestamp_ns - tft->te.edge_ns) / n;
+
+			tft->te.period_ns = tft->te.period_ns ? (tft->te.period_ns * 7 + p) / 8 : p;
+		}
+		tft->te.seq = ev.sequence;
+		tft->te.edge_ns = ev.timestamp_ns;
+	}
+	pthread_mutex_unlock(&tft->te.lock);
+
+	return ret > 0;
+}
+
+/**
+ * Time LVGL's next refresh so its first strip is ready just as the panel
+ * starts a frame, a whole number of frames after the one this refresh goes
+ * out with. Keeps LV_DISP_DEF_REFR_PERIOD as closely as the frame rate allows.
+ * @param tft the panel
+ */
+static void te_align(tft_t * tft)
+{
+	lv_timer_t * timer = _lv_disp_get_refr_timer(tft->disp);
+	uint64_t edge, period, lead, now, frames, next;
+
+	pthread_mutex_lock(&tft->te.lock);
+	edge = tft->te.edge_ns;
+	period = tft->te.period_ns;
+	pthread_mutex_unlock(&tft->te.lock);
+	lead = tft->te.lead_ns;
+	now = tune_now();
+
+	if(timer == NULL) return;
+	if(period == 0 || now + lead < edge) {
+		timer->period = LV_DISP_DEF_REFR_PERIOD;
+		return;
+	}
+
+	frames = (LV_DISP_DEF_REFR_PERIOD * 1000000ULL + period / 2) / period;
+	if(frames == 0) frames = 1;
+
+	/*The edge the first strip of this refresh will wait for*/
+	edge += ((now + lead - edge) / period + 1) * period;
+	next = edge + frames * period - lead;
+
+	/*
+	 * lv_timer only runs with a due time in the past, so move the period
+	 * instead. Ticks are whole ms and the timer handler runs late rather than
+	 * early, so aim a tick ahead: a strip that misses its edge waits a frame.
+	 */
+	next = (next - now) / 1000000;
+	timer->period = next > 1 ? next - 1 : 1;
+	timer->last_run = lv_tick_get();
+}
+
+#if TFT_FLUSH_THREAD
+/**
+ * Send queued draw buffers to the panel while LVGL renders the next one
+ * @param arg the panel
+ */
+static void * flush_thread(void * arg)
+{
+	tft_t * tft = (tft_t *)arg;
+	bsp_lcd_t *hlcd = tft->lcd;
+
+	while(1) {
+		while(sem_wait(&tft->flush_sem) != 0) {}
+
+		unsigned int tail = atomic_load_explicit(&tft->flush_tail, memory_order_relaxed);
+		flush_job_t * job = &tft->flush_ring[tail & (FLUSH_RING_SIZE - 1)];
+
+		if(job->vsync) te_wait(tft);
+		int ret = lcd_write_rect(hlcd, &job->area, job->buf, job->stride);
+		atomic_store_explicit(&tft->flush_tail, tail + 1, memory_order_release);
+
+		if(ret < 0 && hlcd->dma_err_cb) hlcd->dma_err_cb(hlcd);
+		if(hlcd->dma_cplt_cb) hlcd->dma_cplt_cb(hlcd);
+	}
+
+	return NULL;
+}
+#endif
 
 /**
   * @brief  DMA conversion complete callback
-  * @note   This function is executed when the transfer complete interrupt
-  *         is generated
+  * @note   This function is executed when a draw buffer has been sent to
+  *         the panel and may be reused by LVGL
   * @retval None
   */
 void DMA_TransferComplete(bsp_lcd_t *hlcd)
 {
-	lv_disp_flush_ready(&disp_drv);
-#if 0
-	y_fill_act ++;
-
-	if(y_fill_act > y2_fill) {
-		  lv_disp_flush_ready(&disp_drv);
-	} else {
-	  buf_to_flush += x2_flush - x1_flush + 1;
-#if 0
-	  /*##-7- Start the DMA transfer using the interrupt mode ####################*/
-	  /* Configure the source, destination and buffer size DMA fields and Start DMA Stream transfer */
-	  /* Enable All the DMA interrupts */
-	  if(HAL_DMA_Start_IT(han,(uint32_t)buf_to_flush, (uint32_t)&my_fb[y_fill_act * TFT_HOR_RES + x1_flush],
-						  (x2_flush - x1_flush + 1)) != HAL_OK)
-	  {
-	    while(1);	/*Halt on error*/
-	  }
-#endif
-	  uint32_t nbytes = (x2_flush - x1_flush + 1) * 2UL;
-	  bsp_lcd_write_dma((uint32_t)buf_to_flush,nbytes);
-	}
-#endif
+	tft_t * tft = (tft_t *)hlcd->user_data;
+
+	if(tft->tune.enabled) tune_completed(tft);
+	lv_disp_flush_ready(&tft->disp_drv);
 }
 
 /**
@@ -197,10 +852,141 @@ void DMA_TransferComplete(bsp_lcd_t *hlcd)
   */
  void DMA_TransferError(bsp_lcd_t *hlcd)
 {
+	(void)hlcd;
+	perror("tft_flush");
+}
+
+
+
+static uint64_t tune_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fit_add(cost_fit_t * f, double x, double y)
+{
+	f->n += 1;
+	f->sx += x;
+	f->sy += y;
+	f->sxx += x * x;
+	f->sxy += x * y;
+}
+
+/*Halve the weight of old samples so the fit follows changing content*/
+static void fit_decay(cost_fit_t * f)
+{
+	f->n /= 2;
+	f->sx /= 2;
+	f->sy /= 2;
+	f->sxx /= 2;
+	f->sxy /= 2;
+}
+
+/*cost = a + b * px; false while the samples do not cover different sizes*/
+static bool fit_line(const cost_fit_t * f, double * a, double * b)
+{
+	double det = f->n * f->sxx - f->sx * f->sx;
+
+	if(f->n < 8 || det <= 1e-6 * f->n * f->sxx) return false;
+
+	*b = (f->n * f->sxy - f->sx * f->sy) / det;
+	*a = (f->sy - *b * f->sx) / f->n;
+	if(*a < 0) *a = 0;
+	return *b > 0;
+}
+
+/**
+ * A strip of px pixels was rendered and handed to the panel
+ * @param tft the panel
+ * @param px number of pixels in the strip
+ */
+static void tune_flushed(tft_t * tft, uint32_t px)
+{
+	uint64_t now = tune_now();
+
+	pthread_mutex_lock(&tft->tune.lock);
+	if(tft->tune.mark) fit_add(&tft->tune.render, px, (double)(now - tft->tune.mark - tft->tune.wait_ns));
+	if(tft->tune.pend_head - tft->tune.pend_tail < TUNE_PENDING) {
+		tft->tune.pend_t[tft->tune.pend_head & (TUNE_PENDING - 1)] = now;
+		tft->tune.pend_px[tft->tune.pend_head & (TUNE_PENDING - 1)] = px;
+		tft->tune.pend_head++;
+	}
+	pthread_mutex_unlock(&tft->tune.lock);
+}
+
+/**
+ * The oldest pending strip reached the panel. Flushes complete in order, so
+ * its transfer started when it was queued or when the previous one finished.
+ * @param tft the panel
+ */
+static void tune_completed(tft_t * tft)
+{
+	uint64_t now = tune_now();
+
+	pthread_mutex_lock(&tft->tune.lock);
+	if(tft->tune.pend_head != tft->tune.pend_tail) {
+		uint64_t start = tft->tune.pend_t[tft->tune.pend_tail & (TUNE_PENDING - 1)];
 
+		if(tft->tune.done > start) start = tft->tune.done;
+		fit_add(&tft->tune.xfer, tft->tune.pend_px[tft->tune.pend_tail & (TUNE_PENDING - 1)], (double)(now - start));
+		tft->tune.pend_tail++;
+	}
+	tft->tune.done = now;
+	pthread_mutex_unlock(&tft->tune.lock);
 }
 
+/**
+ * Pick the strip size for the next refreshes. With P pixels per refresh, a
+ * strip of s pixels costs about P * max(render, xfer) per pixel, plus one
+ * strip that does not overlap (s * min(render, xfer)), plus P / s times the
+ * fixed render and transfer overhead of a strip. That is smallest at
+ * s = sqrt(overhead * P / min(render, xfer)).
+ * @param drv pointer to the display driver
+ */
+static void tune_update(lv_disp_drv_t * drv)
+{
+	tft_t * tft = (tft_t *)drv->user_data;
+	bsp_lcd_t *hlcd = tft->lcd;
+	uint32_t row = hlcd->width;
+	uint32_t max_px = hlcd->db_size / sizeof(lv_color_t);
+	uint32_t size;
+	double ar, br, at, bt;
+	bool ok;
+
+	/*Strips are whole rows, there is nothing to pick without room for one*/
+	if(max_px < row) {
+		tft->tune.px = 0;
+		tft->tune.refreshes = 0;
+		return;
+	}
 
+	pthread_mutex_lock(&tft->tune.lock);
+	ok = fit_line(&tft->tune.render, &ar, &br) && fit_line(&tft->tune.xfer, &at, &bt);
+	fit_decay(&tft->tune.render);
+	fit_decay(&tft->tune.xfer);
+	pthread_mutex_unlock(&tft->tune.lock);
+
+	if(ok) {
+		double x = (ar + at) * (double)(tft->tune.px / tft->tune.refreshes) / (br < bt ? br : bt);
+		lv_sqrt_res_t res;
+
+		lv_sqrt(x < 4294836225.0 ? (uint32_t)x : 4294836225U, &res, 0x8000);
+		size = res.i;
+	}
+	else {
+		/*Every strip had the same size so far, try another one to learn the slope*/
+		size = drv->draw_buf->size * 3 / 4;
+	}
+
+	size = LV_CLAMP(row, size / row * row, max_px / row * row);
+	drv->draw_buf->size = size;
+
+	tft->tune.px = 0;
+	tft->tune.refreshes = 0;
+}
 
 /**
   * @brief  This function is executed in case of error occurrence.